@@ -28,13 +28,31 @@
 #include "bptree.h"
 
 /* create a dummy data structure */
-bptree_t *bptree_poet_new(const char *poet_log_name, const char *heartbeats_log_name, bool use_poet, bool use_avx2);
+bptree_t *bptree_poet_new(const char *poet_log_name, const char *heartbeats_log_name, bool use_poet, bptree_simd_t simd, bptree_write_mode_t write_mode);
+
+/* counts an operation for the heartbeat (done by all wrappers) */
+void register_heartbeat();
 
 /* wrapper of set command */
 int bptree_poet_insert(bptree_t *bptree, bp_key_t key, value_t val);
 
+/* wrapper of set command with a variable size value */
+int bptree_poet_put(bptree_t *bptree, bp_key_t key, const void *data, size_t len);
+
 /* wrapper of get command */
 bool bptree_poet_get(bptree_t *bptree, bp_key_t key, value_t *result);
 
+/* wrapper of get command returning a view of the value */
+bool bptree_poet_get_view(bptree_t *bptree, bp_key_t key, value_view_t *view);
+
+/* wrapper of multi get command */
+size_t bptree_poet_get_batch(bptree_t *bptree, const bp_key_t *keys, size_t n, value_t *results, bool *found);
+
+/* wrapper of delete command */
+bool bptree_poet_delete(bptree_t *bptree, bp_key_t key);
+
+/* wrapper of scan command */
+size_t bptree_poet_scan(bptree_t *bptree, bp_key_t lo, bp_key_t hi, bptree_scan_fn fn, void *ctx);
+
 /* wrapper of free command */
 int bptree_poet_free(bptree_t *bptree);
\ No newline at end of file
@@ -1,6 +1,7 @@
 #pragma once
 #include <stdbool.h>
 #include "bptree.h"
+#include "bptree_shard.h"
 
 /*
  * size of the key in bytes
@@ -17,8 +18,8 @@ enum query_types
 };
 
 /* 
- * format of each query, it has a key and a type and we don't care
- * the value
+ * format of each query, it has a key and a type. The trace only
+ * stores the size of the values (see queries_init)
  */
 typedef struct __attribute__((__packed__))
 {
@@ -33,15 +34,36 @@ typedef struct
     size_t num_ops;
     size_t num_puts;
     size_t num_gets;
+    size_t num_dels;
+    size_t num_scans;
     size_t num_miss;
     size_t num_hits;
     double tput;
     double time;
     volatile bool *stop;
+    // skip puts and do not insert missed keys (see queries_preload)
+    bool read_only;
+    // if > 0, gets are replaced by scans over scan_len entries starting at the key
+    size_t scan_len;
+    // number of consecutive gets executed with one bptree_get_batch call
+    size_t num_mget;
+    // size of the values of puts in bytes (bptree_put).
+    // 0 stores the key itself as value (bptree_insert).
+    size_t val_len;
+    // xor of the first byte of all values that were read
+    char checksum;
+    // number of puts and deletes (including the puts of missed keys),
+    // sum and maximum of their latencies in nanoseconds
+    size_t num_writes;
+    double write_ns;
+    double max_write_ns;
     bptree_t *db;
+    // sharded store used instead of db (NULL if the run is not sharded)
+    bptree_sharded_t *shards;
 } thread_param;
 
-size_t queries_init(query **queries, char *filename);
+size_t queries_init(query **queries, size_t *val_len, char *filename);
+void queries_preload(bptree_t *db, bptree_sharded_t *shards, query *queries, size_t num_queries, int num_threads, size_t val_len);
 void *queries_exec(void *param);
 
 /* bench result */
@@ -54,5 +76,10 @@ typedef struct __attribute__((__packed__))
     size_t total_miss;
     size_t total_gets;
     size_t total_puts;
+    size_t total_dels;
+    size_t total_scans;
+    size_t total_writes;
+    double total_write_ns;
+    double max_write_ns;
     size_t num_threads;
 } result_t;
@@ -27,13 +27,26 @@ pthread_mutex_t printmutex;
 
 /* default parameter settings */
 static size_t num_threads = 1;
-// static size_t num_mget = 1;
+static size_t num_mget = 1;
 static float duration = 10.0;
 static char *inputfile = NULL;
 static char *log_file = NULL;
+static bool read_only = false;
+static size_t scan_len = 0;
+static bptree_write_mode_t write_mode = BPTREE_COPY_ON_WRITE;
+// size of the values, -1 uses the value size of the trace
+static long val_len = -1;
+// write-ahead log, writes are durable if set
+static char *wal_file = NULL;
+// inserts are applied by one combining thread
+static bool combining = false;
+// number of shards, 0 runs a single tree
+static int num_shards = 0;
+static bptree_shard_mode_t shard_mode = BPTREE_SHARD_RANGE;
 
 /* db structure is global */
 bptree_t *db;
+bptree_sharded_t *shards = NULL;
 
 /* using sigalarm for timer */
 volatile bool stop = false;
@@ -47,9 +60,20 @@ static void usage(char *binname)
 {
     printf("%s [-t #] [-b #] [-l trace] [-d #] [-h]\n", binname);
     printf("\t-t #: number of working threads, by default %" PRIu64 "\n", num_threads);
+    printf("\t-b #: number of gets executed as one batch (bptree_get_batch), by default %zu\n", num_mget);
     printf("\t-d #: duration of the test in seconds, by default %f\n", duration);
     printf("\t-l  : dataset file\n");
+    printf("\t-a #: node search, 0 scalar, 1 AVX2, 2 AVX-512, 3 best supported, by default 0\n");
     printf("\t-o  : heartbeats log file\n");
+    printf("\t-r  : read only, preload all keys and only run gets\n");
+    printf("\t-s #: replace gets by scans over # entries, by default %zu (no scans)\n", scan_len);
+    printf("\t-i  : update leaves in place instead of cloning them\n");
+    printf("\t-B  : buffer inserts and flush them into the tree in sorted batches\n");
+    printf("\t-v #: value size in bytes, by default the value size of the trace, 0 stores the keys as values\n");
+    printf("\t-w  : write-ahead log file, puts and deletes return once they are on disk\n");
+    printf("\t-c  : flat combining, one thread applies the inserts of all threads in sorted batches\n");
+    printf("\t-S #: split the keys into # trees by range, hot ranges are moved to neighbours, by default 0 (one tree)\n");
+    printf("\t-H  : split the keys of -S by hash instead of range\n");
     printf("\t-h  : show usage\n");
 }
 
@@ -63,10 +87,15 @@ void benchmark_n_threads(result_t *result, thread_param *tp, query *queries, siz
         tp[t].queries = queries + t * (num_queries / num_threads);
         tp[t].tid = t;
         tp[t].num_ops = num_queries / num_threads;
-        tp[t].num_puts = tp[t].num_gets = tp[t].num_miss = tp[t].num_hits = 0;
+        tp[t].num_puts = tp[t].num_gets = tp[t].num_dels = tp[t].num_scans = tp[t].num_miss = tp[t].num_hits = 0;
         tp[t].time = tp[t].tput = 0.0;
         tp[t].stop = &stop;
+        tp[t].read_only = read_only;
+        tp[t].scan_len = scan_len;
+        tp[t].num_mget = num_mget;
+        tp[t].val_len = val_len;
         tp[t].db = db;
+        tp[t].shards = shards;
         int rc = pthread_create(&threads[t], NULL, queries_exec, (void *)&tp[t]);
         if (rc)
         {
@@ -88,6 +117,11 @@ void benchmark_n_threads(result_t *result, thread_param *tp, query *queries, siz
     result->total_miss = 0;
     result->total_gets = 0;
     result->total_puts = 0;
+    result->total_dels = 0;
+    result->total_scans = 0;
+    result->total_writes = 0;
+    result->total_write_ns = 0.0;
+    result->max_write_ns = 0.0;
     result->num_threads = num_threads;
 
     for (t = 0; t < num_threads; t++)
@@ -105,6 +139,12 @@ void benchmark_n_threads(result_t *result, thread_param *tp, query *queries, siz
         result->total_miss += tp[t].num_miss;
         result->total_gets += tp[t].num_gets;
         result->total_puts += tp[t].num_puts;
+        result->total_dels += tp[t].num_dels;
+        result->total_scans += tp[t].num_scans;
+        result->total_writes += tp[t].num_writes;
+        result->total_write_ns += tp[t].write_ns;
+        if (tp[t].max_write_ns > result->max_write_ns)
+            result->max_write_ns = tp[t].max_write_ns;
     }
 
     result->grand_total_time += result->total_time;
@@ -119,16 +159,21 @@ int main(int argc, char **argv)
         exit(-1);
     }
 
-    bool use_avx2 = false;
+    bptree_simd_t simd = BPTREE_SIMD_NONE;
 
     char ch;
-    while ((ch = getopt(argc, argv, "t:d:h:l:o:a:")) != -1)
+    while ((ch = getopt(argc, argv, "t:b:d:h:l:o:a:rs:iBv:w:cS:H")) != -1)
     {
         switch (ch)
         {
         case 't':
             num_threads = atoi(optarg);
             break;
+        case 'b':
+            num_mget = atoi(optarg);
+            if (num_mget == 0)
+                num_mget = 1;
+            break;
         case 'd':
             duration = atof(optarg);
             break;
@@ -136,11 +181,38 @@ int main(int argc, char **argv)
             inputfile = optarg;
             break;
         case 'a':
-            use_avx2 = atoi(optarg);
+            simd = atoi(optarg);
             break;
         case 'o':
             log_file = optarg;
             break;
+        case 'r':
+            read_only = true;
+            break;
+        case 's':
+            scan_len = atoi(optarg);
+            break;
+        case 'i':
+            write_mode = BPTREE_IN_PLACE;
+            break;
+        case 'B':
+            write_mode = BPTREE_BUFFERED;
+            break;
+        case 'v':
+            val_len = atol(optarg);
+            break;
+        case 'w':
+            wal_file = optarg;
+            break;
+        case 'c':
+            combining = true;
+            break;
+        case 'S':
+            num_shards = atoi(optarg);
+            break;
+        case 'H':
+            shard_mode = BPTREE_SHARD_HASH;
+            break;
         case 'h':
             usage(argv[0]);
             exit(0);
@@ -151,33 +223,79 @@ int main(int argc, char **argv)
         }
     }
 
-    if (inputfile == NULL)
+    if (inputfile == NULL || (num_shards > 0 && wal_file != NULL))
     {
         usage(argv[0]);
         exit(-1);
     }
 
     query *queries;
-    size_t num_queries = queries_init(&queries, inputfile);
+    size_t trace_val_len;
+    size_t num_queries = queries_init(&queries, &trace_val_len, inputfile);
+    if (val_len < 0)
+        val_len = trace_val_len;
 
     pthread_t threads[num_threads];
     pthread_mutex_init(&printmutex, NULL);
 
     thread_param tp[num_threads];
 
-    db = bptree_poet_new(NULL, log_file, false, use_avx2);
+    db = bptree_poet_new(NULL, log_file, false, simd, write_mode);
+    if (combining)
+        bptree_combining_enable(db);
+    // the log is replayed before the run and the preload is not logged
+    if (wal_file != NULL && !bptree_wal_open(db, wal_file))
+    {
+        perror(wal_file);
+        exit(-1);
+    }
+    if (num_shards > 0)
+    {
+        shards = malloc(sizeof(bptree_sharded_t));
+        bptree_sharded_init(shards, num_shards, shard_mode, shard_mode == BPTREE_SHARD_RANGE, simd, write_mode);
+        for (int i = 0; i < num_shards && combining; i++)
+            bptree_combining_enable(&shards->shards[i].tree);
+    }
+    if (read_only)
+        queries_preload(db, shards, queries, num_queries, num_threads, val_len);
 
     result_t result;
     benchmark_n_threads(&result, tp, queries, num_queries, threads, num_threads);
 
     printf("total_time = %.2f\n", result.grand_total_time);
-    printf("total_tput = %.2f\n", (float)(result.total_gets + result.total_puts) / result.grand_total_time);
+    printf("total_tput = %.2f\n", (float)(result.total_gets + result.total_puts + result.total_dels + result.total_scans) / result.grand_total_time);
     printf("total_tput_get = %.2f\n", (float)(result.total_gets) / result.grand_total_time);
     printf("total_tput_insert = %.2f\n", (float)(result.total_puts) / result.grand_total_time);
+    printf("total_tput_delete = %.2f\n", (float)(result.total_dels) / result.grand_total_time);
+    printf("total_tput_scan = %.2f\n", (float)(result.total_scans) / result.grand_total_time);
     printf("total_hitratio = %.4f\n", (float)result.total_hits / result.total_gets);
+    printf("avg_write_latency_us = %.2f\n", result.total_writes == 0 ? 0.0 : result.total_write_ns / result.total_writes / 1000);
+    printf("max_write_latency_us = %.2f\n", result.max_write_ns / 1000);
+    if (db->mem.wal != NULL)
+    {
+        printf("wal_syncs = %" PRIu64 "\n", db->mem.wal->num_syncs);
+        printf("wal_records_per_sync = %.2f\n", (double)db->mem.wal->num_records / (db->mem.wal->num_syncs ? db->mem.wal->num_syncs : 1));
+    }
+    if (db->mem.combine != NULL && shards == NULL)
+    {
+        printf("combined_batches = %" PRIu64 "\n", db->mem.combine->num_batches);
+        printf("inserts_per_batch = %.2f\n", (double)db->mem.combine->num_requests / (db->mem.combine->num_batches ? db->mem.combine->num_batches : 1));
+    }
+    if (db->mem.buffers != NULL && shards == NULL)
+    {
+        printf("buffer_flushes = %" PRIu64 "\n", db->mem.buffers->num_flushes);
+        printf("inserts_per_flush = %.2f\n", (double)db->mem.buffers->num_messages / (db->mem.buffers->num_flushes ? db->mem.buffers->num_flushes : 1));
+    }
+    if (shards != NULL)
+        printf("shard_moves = %" PRIu64 "\n", shards->num_moves);
 
     free(queries);
     bptree_poet_free(db);
+    if (shards != NULL)
+    {
+        bptree_sharded_free(shards);
+        free(shards);
+    }
 
     printf("bye\n");
     return 0;
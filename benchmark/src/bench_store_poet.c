@@ -29,6 +29,8 @@ static size_t num_threads = 1;
 static float duration = 10.0;
 static char *inputfile = NULL;
 static char *output_dir = NULL;
+// value size of the trace
+static size_t val_len = 0;
 
 /* db structure is global */
 bptree_t *db;
@@ -47,7 +49,7 @@ static void usage(char *binname)
     printf("\t-t #: number of working threads, by default %" PRIu64 "\n", num_threads);
     printf("\t-d #: duration of the test in seconds, by default %f\n", duration);
     printf("\t-l  : path to dataset file\n");
-    printf("\t-a  : turn AVX2 on/off\n");
+    printf("\t-a #: node search, 0 scalar, 1 AVX2, 2 AVX-512, 3 best supported\n");
     printf("\t-o  : log directory\n");
     printf("\t-h  : show usage\n");
 }
@@ -62,10 +64,15 @@ void benchmark_n_threads(result_t *result, thread_param *tp, query *queries, siz
         tp[t].queries = queries + t * (num_queries / num_threads);
         tp[t].tid = t;
         tp[t].num_ops = num_queries / num_threads;
-        tp[t].num_puts = tp[t].num_gets = tp[t].num_miss = tp[t].num_hits = 0;
+        tp[t].num_puts = tp[t].num_gets = tp[t].num_dels = tp[t].num_scans = tp[t].num_miss = tp[t].num_hits = 0;
         tp[t].time = tp[t].tput = 0.0;
         tp[t].stop = &stop;
+        tp[t].read_only = false;
+        tp[t].scan_len = 0;
+        tp[t].num_mget = 1;
+        tp[t].val_len = val_len;
         tp[t].db = db;
+        tp[t].shards = NULL;
         int rc = pthread_create(&threads[t], NULL, queries_exec, (void *)&tp[t]);
         if (rc)
         {
@@ -87,6 +94,8 @@ void benchmark_n_threads(result_t *result, thread_param *tp, query *queries, siz
     result->total_miss = 0;
     result->total_gets = 0;
     result->total_puts = 0;
+    result->total_dels = 0;
+    result->total_scans = 0;
     result->num_threads = num_threads;
 
     for (t = 0; t < num_threads; t++)
@@ -104,6 +113,8 @@ void benchmark_n_threads(result_t *result, thread_param *tp, query *queries, siz
         result->total_miss += tp[t].num_miss;
         result->total_gets += tp[t].num_gets;
         result->total_puts += tp[t].num_puts;
+        result->total_dels += tp[t].num_dels;
+        result->total_scans += tp[t].num_scans;
     }
 
     result->grand_total_time += result->total_time;
@@ -117,7 +128,7 @@ int main(int argc, char **argv)
         usage(argv[0]);
         exit(-1);
     }
-    bool use_avx2 = false;
+    bptree_simd_t simd = BPTREE_SIMD_NONE;
     char ch;
     while ((ch = getopt(argc, argv, "t:d:h:l:o:a:")) != -1)
     {
@@ -136,7 +147,7 @@ int main(int argc, char **argv)
             output_dir = optarg;
             break;
         case 'a':
-            use_avx2 = atoi(optarg);
+            simd = atoi(optarg);
             break;
         case 'h':
             usage(argv[0]);
@@ -155,7 +166,7 @@ int main(int argc, char **argv)
     }
 
     query *queries;
-    size_t num_queries = queries_init(&queries, inputfile);
+    size_t num_queries = queries_init(&queries, &val_len, inputfile);
 
     pthread_t threads[num_threads];
 
@@ -166,7 +177,7 @@ int main(int argc, char **argv)
     sprintf(poet_log_filename, "%s/poet.log", output_dir);
     sprintf(heartbeat_log_filename, "%s/heartbeat.log", output_dir);
 
-    db = bptree_poet_new(poet_log_filename, heartbeat_log_filename, true, use_avx2);
+    db = bptree_poet_new(poet_log_filename, heartbeat_log_filename, true, simd, BPTREE_COPY_ON_WRITE);
 
     result_t result;
     for (int i = 1; i <= num_threads; i++)
@@ -176,9 +187,10 @@ int main(int argc, char **argv)
         benchmark_n_threads(&result, tp, queries, num_queries, threads, i);
 
     printf("total_time = %.2f\n", result.grand_total_time);
-    printf("total_tput = %.2f\n", (float)(result.total_gets + result.total_puts) / result.grand_total_time);
+    printf("total_tput = %.2f\n", (float)(result.total_gets + result.total_puts + result.total_dels + result.total_scans) / result.grand_total_time);
     printf("total_tput_get = %.2f\n", (float)(result.total_gets) / result.grand_total_time);
     printf("total_tput_insert = %.2f\n", (float)(result.total_puts) / result.grand_total_time);
+    printf("total_tput_delete = %.2f\n", (float)(result.total_dels) / result.grand_total_time);
     printf("total_hitratio = %.4f\n", (float)result.total_hits / result.total_gets);
 
     free(queries);
@@ -117,12 +117,12 @@ void hb_poet_finish()
 }
 
 /* create a dummy data structure */
-bptree_t *bptree_poet_new(const char *poet_log_name, const char *heartbeats_log_name, bool use_poet, bool use_avx2)
+bptree_t *bptree_poet_new(const char *poet_log_name, const char *heartbeats_log_name, bool use_poet, bptree_simd_t simd, bptree_write_mode_t write_mode)
 {
     hb_poet_init(poet_log_name, heartbeats_log_name, use_poet);
 
     bptree_t *bptree = malloc(sizeof(bptree_t));
-    bptree_init(bptree, use_avx2);
+    bptree_init(bptree, simd, write_mode);
 
     return bptree;
 }
@@ -146,6 +146,14 @@ int bptree_poet_insert(bptree_t *bptree, bp_key_t key, value_t val)
     return 1;
 }
 
+/* wrapper of set command with a variable size value */
+int bptree_poet_put(bptree_t *bptree, bp_key_t key, const void *data, size_t len)
+{
+    register_heartbeat();
+    bptree_put(bptree, key, data, len);
+    return 1;
+}
+
 /* wrapper of get command */
 bool bptree_poet_get(bptree_t *bptree, bp_key_t key, value_t *result)
 {
@@ -153,6 +161,34 @@ bool bptree_poet_get(bptree_t *bptree, bp_key_t key, value_t *result)
     return bptree_get(bptree, key, result);
 }
 
+/* wrapper of get command returning a view of the value */
+bool bptree_poet_get_view(bptree_t *bptree, bp_key_t key, value_view_t *view)
+{
+    register_heartbeat();
+    return bptree_get_view(bptree, key, view);
+}
+
+/* wrapper of multi get command */
+size_t bptree_poet_get_batch(bptree_t *bptree, const bp_key_t *keys, size_t n, value_t *results, bool *found)
+{
+    register_heartbeat();
+    return bptree_get_batch(bptree, keys, n, results, found);
+}
+
+/* wrapper of delete command */
+bool bptree_poet_delete(bptree_t *bptree, bp_key_t key)
+{
+    register_heartbeat();
+    return bptree_delete(bptree, key);
+}
+
+/* wrapper of scan command */
+size_t bptree_poet_scan(bptree_t *bptree, bp_key_t lo, bp_key_t hi, bptree_scan_fn fn, void *ctx)
+{
+    register_heartbeat();
+    return bptree_scan(bptree, lo, hi, fn, ctx);
+}
+
 /* wrapper of free command */
 int bptree_poet_free(bptree_t *bptree)
 {
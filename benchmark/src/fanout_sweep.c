@@ -0,0 +1,172 @@
+#include <getopt.h>
+#include <time.h>
+#include <pthread.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <unistd.h>
+
+#include "bptree.h"
+
+// Measures gets and inserts for growing trees with the node size this
+// binary was built with (NODE_LINES). `make fanout_sweep` builds and runs
+// one binary per node size, so the results show which fanout gives the
+// best tradeoff between tree height and compares per node.
+// Cache misses of the gets are read from the hardware performance
+// counters (-1 if the kernel does not provide them, e.g. in VMs).
+
+/* default parameter settings */
+static size_t max_keys = 10000000;
+static size_t num_ops = 1000000;
+static bptree_simd_t simd = BPTREE_SIMD_BEST;
+
+static void usage(char *binname)
+{
+    printf("%s [-n #] [-q #] [-a #] [-h]\n", binname);
+    printf("\t-n #: largest tree, trees grow by factors of 10 up to # keys, by default %zu\n", max_keys);
+    printf("\t-q #: number of gets and inserts per tree, by default %zu\n", num_ops);
+    printf("\t-a #: node search, 0 scalar, 1 AVX2, 2 AVX-512, 3 best supported, by default %d\n", simd);
+    printf("\t-h  : show usage\n");
+}
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// opens a counter for the calling thread, returns -1 if it is not available
+static int counter_open(uint32_t type, uint64_t config)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void counter_start(int fd)
+{
+    if (fd < 0)
+        return;
+    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+}
+
+// returns the number of events per operation (-1 if the counter is not available)
+static double counter_stop(int fd, size_t ops)
+{
+    uint64_t count;
+    if (fd < 0)
+        return -1;
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(fd, &count, sizeof(count)) != sizeof(count))
+        return -1;
+    return (double)count / ops;
+}
+
+static int tree_height(bptree_t *tree)
+{
+    int height = 0;
+    for (node_t *n = tree->root; n != NULL; n = n->is_leaf ? NULL : n->children.nodes[0])
+        height++;
+    return height;
+}
+
+// runs gets and inserts of random keys on a tree with num_keys keys (every second key)
+static void sweep(size_t num_keys)
+{
+    bp_key_t *keys = malloc(num_keys * sizeof(bp_key_t));
+    value_t *values = malloc(num_keys * sizeof(value_t));
+    for (size_t i = 0; i < num_keys; i++)
+    {
+        keys[i] = 2 * i;
+        values[i] = 2 * i;
+    }
+
+    bptree_t tree;
+    bptree_init(&tree, simd, BPTREE_IN_PLACE);
+    bptree_bulk_load(&tree, keys, values, num_keys, 0.7);
+
+    unsigned int seed = 0;
+    bp_key_t *queries = malloc(num_ops * sizeof(bp_key_t));
+    for (size_t i = 0; i < num_ops; i++)
+        queries[i] = 2 * (((size_t)rand_r(&seed) * RAND_MAX + rand_r(&seed)) % num_keys);
+
+    int llc_fd = counter_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    int l1d_fd = counter_open(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+
+    size_t hits = 0;
+    counter_start(llc_fd);
+    counter_start(l1d_fd);
+    double start = now();
+    for (size_t i = 0; i < num_ops; i++)
+    {
+        value_t v;
+        hits += bptree_get(&tree, queries[i], &v);
+    }
+    double get_time = now() - start;
+    double l1d_misses = counter_stop(l1d_fd, num_ops);
+    double llc_misses = counter_stop(llc_fd, num_ops);
+
+    start = now();
+    for (size_t i = 0; i < num_ops; i++)
+        bptree_insert(&tree, queries[i] + 1, queries[i] + 1);
+    double insert_time = now() - start;
+
+    if (hits != num_ops)
+        printf("ERROR: %zu of %zu keys found\n", hits, num_ops);
+
+    printf("%d,%d,%zu,%d,%.1f,%.1f,%.2f,%.2f\n", NODE_LINES, ORDER, num_keys, tree_height(&tree),
+           get_time / num_ops * 1e9, insert_time / num_ops * 1e9, l1d_misses, llc_misses);
+
+    if (llc_fd >= 0)
+        close(llc_fd);
+    if (l1d_fd >= 0)
+        close(l1d_fd);
+    bptree_free(&tree);
+    free(queries);
+    free(keys);
+    free(values);
+}
+
+int main(int argc, char **argv)
+{
+    char ch;
+    while ((ch = getopt(argc, argv, "n:q:a:h")) != -1)
+    {
+        switch (ch)
+        {
+        case 'n':
+            max_keys = atol(optarg);
+            break;
+        case 'q':
+            num_ops = atol(optarg);
+            break;
+        case 'a':
+            simd = atoi(optarg);
+            break;
+        case 'h':
+            usage(argv[0]);
+            exit(0);
+        default:
+            usage(argv[0]);
+            exit(-1);
+        }
+    }
+
+    printf("node_lines,order,keys,height,get_ns,insert_ns,l1d_misses_per_get,llc_misses_per_get\n");
+    for (size_t num_keys = 10000; num_keys <= max_keys; num_keys *= 10)
+        sweep(num_keys);
+    return 0;
+}
@@ -1,11 +1,12 @@
 #include <stdio.h>
 #include <pthread.h>
 #include <inttypes.h>
+#include <time.h>
 #include "queries.h"
 #include "bptree_poet.h"
 
-/* init all queries from the ycsb trace file before issuing them */
-size_t queries_init(query **queries, char *filename)
+/* init all queries from the ycsb trace file before issuing them, val_len is set to the value size of the trace */
+size_t queries_init(query **queries, size_t *val_len, char *filename)
 {
     FILE *input;
 
@@ -17,7 +18,7 @@ size_t queries_init(query **queries, char *filename)
         exit(1);
     }
 
-    size_t key_len, val_len, num_queries;
+    size_t key_len, num_queries;
     int n;
     n = fread(&key_len, sizeof(key_len), 1, input);
     if (n != 1)
@@ -30,13 +31,13 @@ size_t queries_init(query **queries, char *filename)
         perror(error_buffer);
     }
 
-    n = fread(&val_len, sizeof(val_len), 1, input);
+    n = fread(val_len, sizeof(*val_len), 1, input);
     if (n != 1)
         perror("fread error");
 
-    if (key_len != NKEY)
+    if (*val_len != NVAL)
     {
-        sprintf(error_buffer, "NVAL (%d) != val_len (%ld) in dataset %s", NVAL, val_len, filename);
+        sprintf(error_buffer, "NVAL (%d) != val_len (%ld) in dataset %s", NVAL, *val_len, filename);
         perror(error_buffer);
     }
 
@@ -46,7 +47,7 @@ size_t queries_init(query **queries, char *filename)
 
     printf("trace(%s):\n", filename);
     printf("\tkey_len = %zu\n", key_len);
-    printf("\tval_len = %zu\n", val_len);
+    printf("\tval_len = %zu\n", *val_len);
     printf("\tnum_queries = %zu\n", num_queries);
     printf("\n");
 
@@ -86,6 +87,221 @@ static double timeval_diff(struct timeval *start,
     return r;
 }
 
+/* monotonic time in nanoseconds */
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* the operations of a run go to the sharded store if it has one (-S) */
+static void store_insert(thread_param *p, bp_key_t key, value_t value)
+{
+    if (p->shards == NULL)
+    {
+        bptree_poet_insert(p->db, key, value);
+        return;
+    }
+    register_heartbeat();
+    bptree_sharded_insert(p->shards, key, value);
+}
+
+static void store_put(thread_param *p, bp_key_t key, const void *data, size_t len)
+{
+    if (p->shards == NULL)
+    {
+        bptree_poet_put(p->db, key, data, len);
+        return;
+    }
+    register_heartbeat();
+    bptree_sharded_put(p->shards, key, data, len);
+}
+
+static bool store_get(thread_param *p, bp_key_t key, value_t *result)
+{
+    if (p->shards == NULL)
+        return bptree_poet_get(p->db, key, result);
+    register_heartbeat();
+    return bptree_sharded_get(p->shards, key, result);
+}
+
+static bool store_get_view(thread_param *p, bp_key_t key, value_view_t *view)
+{
+    if (p->shards == NULL)
+        return bptree_poet_get_view(p->db, key, view);
+    register_heartbeat();
+    return bptree_sharded_get_view(p->shards, key, view);
+}
+
+static size_t store_get_batch(thread_param *p, const bp_key_t *keys, size_t n, value_t *results, bool *found)
+{
+    if (p->shards == NULL)
+        return bptree_poet_get_batch(p->db, keys, n, results, found);
+    register_heartbeat();
+    return bptree_sharded_get_batch(p->shards, keys, n, results, found);
+}
+
+static bool store_delete(thread_param *p, bp_key_t key)
+{
+    if (p->shards == NULL)
+        return bptree_poet_delete(p->db, key);
+    register_heartbeat();
+    return bptree_sharded_delete(p->shards, key);
+}
+
+static size_t store_scan(thread_param *p, bp_key_t lo, bp_key_t hi, bptree_scan_fn fn, void *ctx)
+{
+    if (p->shards == NULL)
+        return bptree_poet_scan(p->db, lo, hi, fn, ctx);
+    register_heartbeat();
+    return bptree_sharded_scan(p->shards, lo, hi, fn, ctx);
+}
+
+static void store_read_begin(thread_param *p)
+{
+    if (p->shards == NULL)
+        bptree_read_begin(p->db);
+    else
+        bptree_sharded_read_begin(p->shards);
+}
+
+static void store_read_end(thread_param *p)
+{
+    if (p->shards == NULL)
+        bptree_read_end(p->db);
+    else
+        bptree_sharded_read_end(p->shards);
+}
+
+/* adds the latency of a write that started at start */
+static void queries_write_done(thread_param *p, double start)
+{
+    double ns = now_ns() - start;
+    p->num_writes++;
+    p->write_ns += ns;
+    if (ns > p->max_write_ns)
+        p->max_write_ns = ns;
+}
+
+static int key_compare(const void *a, const void *b)
+{
+    bp_key_t x = *(const bp_key_t *)a;
+    bp_key_t y = *(const bp_key_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* writes the value of a key: the bytes of the key repeated until len bytes */
+static void query_value(char *buf, size_t len, bp_key_t key)
+{
+    for (size_t i = 0; i < len; i++)
+        buf[i] = ((char *)&key)[i % sizeof(key)];
+}
+
+/* bulk load the keys of all queries so a read only run finds every key */
+void queries_preload(bptree_t *db, bptree_sharded_t *shards, query *queries, size_t num_queries, int num_threads, size_t val_len)
+{
+    struct timeval tv_s, tv_e;
+    gettimeofday(&tv_s, NULL);
+
+    bp_key_t *keys = malloc(num_queries * sizeof(bp_key_t));
+    for (size_t i = 0; i < num_queries; i++)
+        keys[i] = *((key_t *)queries[i].hashed_key);
+    qsort(keys, num_queries, sizeof(bp_key_t), key_compare);
+
+    // remove duplicates
+    size_t num_keys = 0;
+    for (size_t i = 0; i < num_queries; i++)
+        if (num_keys == 0 || keys[num_keys - 1] != keys[i])
+            keys[num_keys++] = keys[i];
+
+    // every shard gets the same number of keys
+    if (shards != NULL)
+        bptree_sharded_split(shards, keys, num_keys);
+
+    value_t *values = malloc(num_keys * sizeof(value_t));
+    char *val = malloc(val_len);
+    for (size_t i = 0; i < num_keys; i++)
+    {
+        if (val_len == 0)
+            values[i] = (value_t)keys[i];
+        else
+        {
+            query_value(val, val_len, keys[i]);
+            values[i] = shards == NULL ? bptree_value_create(db, val, val_len) : bptree_sharded_value_create(shards, keys[i], val, val_len);
+        }
+    }
+    free(val);
+
+    if (shards == NULL)
+        bptree_bulk_load_parallel(db, keys, values, num_keys, 1.0, num_threads);
+    else
+        bptree_sharded_bulk_load(shards, keys, values, num_keys, 1.0, num_threads);
+    free(keys);
+    free(values);
+
+    gettimeofday(&tv_e, NULL);
+    printf("queries_preload...done (%zu keys in %.2f sec)\n", num_keys, timeval_diff(&tv_s, &tv_e));
+}
+
+/* scan callback, ctx counts down the remaining entries */
+static bool scan_count(bp_key_t key, value_t value, void *ctx)
+{
+    size_t *remaining = (size_t *)ctx;
+    return --(*remaining) > 0;
+}
+
+/* stores a key with the value size of the run */
+static void queries_put(thread_param *p, bp_key_t key, char *val)
+{
+    double start = now_ns();
+    if (p->val_len == 0 && p->shards == NULL)
+        bptree_insert(p->db, key, (value_t)key);
+    else if (p->val_len == 0)
+        bptree_sharded_insert(p->shards, key, (value_t)key);
+    else
+    {
+        query_value(val, p->val_len, key);
+        if (p->shards == NULL)
+            bptree_put(p->db, key, val, p->val_len);
+        else
+            bptree_sharded_put(p->shards, key, val, p->val_len);
+    }
+    queries_write_done(p, start);
+}
+
+/* executes the gets collected in keys with one batched lookup */
+static void queries_flush_gets(thread_param *p, bp_key_t *keys, value_t *results, bool *found, size_t *num_keys, char *val)
+{
+    size_t n = *num_keys;
+    if (n == 0)
+        return;
+    *num_keys = 0;
+
+    store_read_begin(p);
+    size_t hits = store_get_batch(p, keys, n, results, found);
+    // the values are read in place
+    for (size_t i = 0; i < n; i++)
+    {
+        value_view_t view;
+        if (p->val_len == 0 || !found[i])
+            continue;
+        value_store_view(results[i], &view);
+        p->checksum ^= *(const char *)view.data;
+    }
+    store_read_end(p);
+    p->num_gets += n;
+    p->num_hits += hits;
+    p->num_miss += n - hits;
+    if (p->read_only)
+        return;
+
+    // cache miss, put something (garbage) in cache
+    for (size_t i = 0; i < n; i++)
+        if (!found[i])
+            queries_put(p, keys[i], val);
+}
+
 /* executing queries at each thread */
 void *queries_exec(void *param)
 {
@@ -99,6 +315,18 @@ void *queries_exec(void *param)
     query *queries = p->queries;
     p->time = 0;
 
+    // gets that are not executed yet (if num_mget > 1)
+    bp_key_t *mget_keys = malloc(p->num_mget * sizeof(bp_key_t));
+    value_t *mget_results = malloc(p->num_mget * sizeof(value_t));
+    bool *mget_found = malloc(p->num_mget * sizeof(bool));
+    size_t mget_n = 0;
+
+    // value of the current put
+    char *val = malloc(p->val_len);
+    p->checksum = 0;
+    p->num_writes = 0;
+    p->write_ns = p->max_write_ns = 0;
+
     /* Strictly obey the timer */
     while (!*p->stop)
     {
@@ -107,27 +335,78 @@ void *queries_exec(void *param)
         {
             enum query_types type = queries[i].type;
             key_t key = *((key_t *)queries[i].hashed_key);
-            if (type == query_put)
+            if (p->read_only && type != query_get)
+            {
+                continue;
+            }
+
+            // keep the order of batched gets and updates
+            if (type != query_get)
+                queries_flush_gets(p, mget_keys, mget_results, mget_found, &mget_n, val);
+
+            if (type == query_get && p->scan_len == 0 && p->num_mget > 1)
+            {
+                mget_keys[mget_n++] = key;
+                if (mget_n == p->num_mget)
+                    queries_flush_gets(p, mget_keys, mget_results, mget_found, &mget_n, val);
+            }
+            else if (type == query_put)
             {
-                bptree_poet_insert(p->db, key, (value_t)key);
+                double start = now_ns();
+                if (p->val_len == 0)
+                    store_insert(p, key, (value_t)key);
+                else
+                {
+                    query_value(val, p->val_len, key);
+                    store_put(p, key, val, p->val_len);
+                }
+                queries_write_done(p, start);
                 p->num_puts++;
             }
+            else if (type == query_get && p->scan_len > 0)
+            {
+                size_t remaining = p->scan_len;
+                store_scan(p, key, KEY_T_MAX, scan_count, &remaining);
+                p->num_scans++;
+            }
             else if (type == query_get)
             {
-                value_t val;
-                bool found = bptree_poet_get(p->db, key, &val);
+                bool found;
+                if (p->val_len == 0)
+                {
+                    value_t result;
+                    found = store_get(p, key, &result);
+                }
+                else
+                {
+                    // the value is read in place
+                    value_view_t view;
+                    store_read_begin(p);
+                    found = store_get_view(p, key, &view);
+                    if (found)
+                        p->checksum ^= *(const char *)view.data;
+                    store_read_end(p);
+                }
                 p->num_gets++;
                 if (!found)
                 {
                     // cache miss, put something (garbage) in cache
                     p->num_miss++;
-                    bptree_insert(p->db, key, (value_t)key);
+                    if (!p->read_only)
+                        queries_put(p, key, val);
                 }
                 else
                 {
                     p->num_hits++;
                 }
             }
+            else if (type == query_del)
+            {
+                double start = now_ns();
+                store_delete(p, key);
+                queries_write_done(p, start);
+                p->num_dels++;
+            }
             else
             {
                 fprintf(stderr, "unknown query type\n");
@@ -137,16 +416,22 @@ void *queries_exec(void *param)
             if (*p->stop)
                 break;
         }
+        queries_flush_gets(p, mget_keys, mget_results, mget_found, &mget_n, val);
         gettimeofday(&tv_e, NULL); // stop timing
         p->time += timeval_diff(&tv_s, &tv_e);
     }
 
-    size_t nops = p->num_gets + p->num_puts;
+    free(mget_keys);
+    free(mget_results);
+    free(mget_found);
+    free(val);
+
+    size_t nops = p->num_gets + p->num_puts + p->num_dels + p->num_scans;
     p->tput = nops / p->time;
 
     printf("thread%" PRIu64 " gets %" PRIu64 " items in %.2f sec \n",
            p->tid, nops, p->time);
-    printf("#put = %zu, #get = %zu\n", p->num_puts, p->num_gets);
+    printf("#put = %zu, #get = %zu, #del = %zu, #scan = %zu\n", p->num_puts, p->num_gets, p->num_dels, p->num_scans);
     printf("#miss = %zu, #hits = %zu\n", p->num_miss, p->num_hits);
     printf("hitratio = %.4f\n", (float)p->num_hits / p->num_gets);
     printf("tput = %.2f\n", p->tput);
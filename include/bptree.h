@@ -1,156 +1,253 @@
 #pragma once
-#include <stdio.h>
-#include <stdbool.h>
-#include <string.h>
-#include <immintrin.h>
-#include <stdlib.h>
-#include <stdint.h>
-#include <pthread.h>
-#include <unistd.h>
-#include "spinlock.h"
-
-#define SIMD_REGISTER_SIZE sizeof(__m256i)
-
-// cache-line width of processor in bytes
-#define DCACHE_LINESIZE 64
+// The tree is specialized for one key width (KEY_SIZE) at compile time.
+// Building with -DBPTREE_WIDTH=<bits> prefixes all symbols with
+// bptree<bits>_, so trees for several widths can be linked into one
+// program (see bptree_typed.h).
+#ifdef BPTREE_WIDTH
+#include "bptree_rename.h"
+#endif
+#include "bptree_common.h"
 
 /**
  * @brief size of the keys in the binary tree in bytes
  */
+#ifdef BPTREE_WIDTH
+#define KEY_SIZE (BPTREE_WIDTH / 8)
+#else
 #define KEY_SIZE 8
+#endif
 
 // number of values that can fit into one AVX2 register
 #define NUM_REG_VALUES ((SIMD_REGISTER_SIZE) / (KEY_SIZE))
 
-// define macros for the AVX functions based on the KEY_SIZE
+// define macros for the AVX functions based on the KEY_SIZE.
+// The AVX-512 versions compare a whole cache line of keys at once.
 
 #if KEY_SIZE == 1
 typedef int8_t bp_key_t;
 #define KEY_T_MAX INT8_MAX
+#define KEY_T_MIN INT8_MIN
 #define _mm256_cmpgt_epi(a, b) _mm256_cmpgt_epi8(a, b)
 #define _mm256_set1_epi(a) _mm256_set1_epi8(a)
 #define _mm256_movemask(a) _mm256_movemask_epi8((__m256i)a)
+#define _mm512_cmpgt_epi_mask(a, b) _mm512_cmpgt_epi8_mask(a, b)
+#define _mm512_set1_epi(a) _mm512_set1_epi8(a)
 
 #elif KEY_SIZE == 2
 typedef int16_t bp_key_t;
 #define KEY_T_MAX INT16_MAX
+#define KEY_T_MIN INT16_MIN
 #define _mm256_cmpgt_epi(a, b) _mm256_cmpgt_epi16(a, b)
 #define _mm256_set1_epi(a) _mm256_set1_epi16(a)
 // there is no 16 bits version of movemask
 // so we use the 8-bit version and then gather every second bit
 #define _mm256_movemask(a) _pext_u32(_mm256_movemask_epi8((__m256i)a), 0xAAAAAAAA) // 0xA = 0b1010
+#define _mm512_cmpgt_epi_mask(a, b) _mm512_cmpgt_epi16_mask(a, b)
+#define _mm512_set1_epi(a) _mm512_set1_epi16(a)
 
 #elif KEY_SIZE == 4
 typedef int32_t bp_key_t;
 #define KEY_T_MAX INT32_MAX
+#define KEY_T_MIN INT32_MIN
 #define _mm256_cmpgt_epi(a, b) _mm256_cmpgt_epi32(a, b)
 #define _mm256_set1_epi(a) _mm256_set1_epi32(a)
 #define _mm256_movemask(a) _mm256_movemask_ps((__m256)a)
+#define _mm512_cmpgt_epi_mask(a, b) _mm512_cmpgt_epi32_mask(a, b)
+#define _mm512_set1_epi(a) _mm512_set1_epi32(a)
 
 #elif KEY_SIZE == 8
 typedef int64_t bp_key_t;
 #define KEY_T_MAX INT64_MAX
+#define KEY_T_MIN INT64_MIN
 #define _mm256_cmpgt_epi(a, b) _mm256_cmpgt_epi64(a, b)
 #define _mm256_set1_epi(a) _mm256_set1_epi64x(a)
 #define _mm256_movemask(a) _mm256_movemask_pd((__m256d)a)
+#define _mm512_cmpgt_epi_mask(a, b) _mm512_cmpgt_epi64_mask(a, b)
+#define _mm512_set1_epi(a) _mm512_set1_epi64(a)
 
 #else
 #error KEY_SIZE has to be 1,2,4 or 8
 #endif
 
-#define ORDER (DCACHE_LINESIZE / KEY_SIZE + 1)
+// number of keys within one cache line
+#define KEYS_PER_LINE (DCACHE_LINESIZE / KEY_SIZE)
+
+#define ORDER (NODE_LINES * KEYS_PER_LINE + 1)
+
+// a node with at most MIN_KEYS keys is fixed (borrow or merge)
+// before a delete descends into it. Two such nodes always fit into one.
+#define MIN_KEYS ((ORDER - 2) / 2)
+
+/**
+ * @brief returns the first index i where keys[i] >= key.
+ * If no key is larger or equal, size is returned.
+ * Unused keys (index >= size) have to be KEY_T_MAX.
+ */
+typedef uint16_t (*find_index_fn)(const bp_key_t keys[ORDER - 1], int size, bp_key_t key);
+
+// cell in the list of leaves used by scans.
+// All clones of a leaf share its cell, so the list stays
+// intact when leaves are replaced (copy-on-write).
+typedef struct leaf_link_t
+{
+    // current version of the leaf
+    struct node_t *leaf;
 
-// value type in b+tree
-typedef uintptr_t value_t;
+    // cell of the right neighbour (NULL for the last leaf)
+    struct leaf_link_t *next;
 
-// defines whether "super" version of node access is used.
-// A counter in bptree is used to keep track of ongoing
-// node_access operations and a node is only freed
-// when this counter is down to zero.
-#define BPTREE_SECURE_NODE_ACCESS
+    // the leaf was merged into its left neighbour
+    bool dead;
+} leaf_link_t;
 
 // a node within the b+tree
+// Layout: the keys fill the first NODE_LINES cache lines, so they can be
+// compared with aligned SIMD loads. The header follows in the next line
+// together with the first children, so a lookup usually touches the key
+// lines and one more line per node.
 typedef struct node_t
 {
     // array of keys within this node
     bp_key_t keys[ORDER - 1];
 
+    // version for optimistic reads.
+    // Odd while the node is modified in place.
+    // Readers of a node repeat their read if the version changed.
+    // NODE_OBSOLETE is set before the node is replaced.
+    uint64_t version;
+
+    // number of keys in node
+    uint16_t n;
+
+    // marks node as leaf
+    bool is_leaf;
+
+    // held by writers that modify the node or one of its child pointers
+    latch_t latch;
+
+    // id of the node in the checkpoint file of the tree (0 if it was not
+    // written yet). NODE_DIRTY is set once it is modified in place.
+    uint32_t checkpoint_id;
+
+    // generation the node was created in (see bptree_snapshot)
+    uint64_t generation;
+
     // array of node pointer (children) or values
     union
     {
-        value_t values[ORDER];
+        struct
+        {
+            value_t values[ORDER - 1];
+
+            // position of a leaf in the list of leaves
+            leaf_link_t *link;
+        };
         struct node_t *nodes[ORDER];
     } children;
+} __attribute__((aligned(DCACHE_LINESIZE))) node_t;
 
-    // reference counting counter
-    // number of get operations that currently
-    // access this node
-    uint64_t __attribute__((aligned(8))) rc_cnt;
+// scalar version of find_index_fn
+uint16_t find_index(const bp_key_t keys[ORDER - 1], int size, bp_key_t key);
 
-    // number of keys in node
-    uint16_t n;
+// AVX2 version of find_index_fn (two compares of 32 bytes per cache line)
+uint16_t find_index_avx2(const bp_key_t keys[ORDER - 1], int size, bp_key_t key);
 
-    // marks node as leaf
-    bool is_leaf;
-} __attribute__((aligned(32))) node_t;
+// AVX-512 version of find_index_fn (one compare per cache line)
+uint16_t find_index_avx512(const bp_key_t keys[ORDER - 1], int size, bp_key_t key);
+
+// returns the best implementation not better than simd that the cpu supports
+bptree_simd_t bptree_simd_resolve(bptree_simd_t simd);
+
+// returns the implementation of find_index for simd (see bptree_simd_resolve)
+find_index_fn find_index_select(bptree_simd_t simd);
 
 /**
  * @brief Allocates the memory for a new node and initializes it.
  * keys within the node are set to KEY_T_MAX.
- * rc_cnt is set to zero.
+ * version and latch are set to zero.
  * 
  * @param is_leaf marks whether the node is a leaf or itermediate node
+ * @param mem memory of the tree the node is allocated from
  * @return node_t* pointer to created node
  */
-node_t *node_create(bool is_leaf);
+node_t *node_create(bool is_leaf, bptree_mem_t *mem);
 
 /**
- * @brief finds the value for key within the node and its children 
+ * @brief finds the value for key within the node and its children.
+ * The caller must be within an epoch critical section of the tree.
+ * Does not write to shared memory: leaves are read optimistically
+ * and validated using their version.
  * 
  * @param n a node
  * @param key query key
  * @param result destination where the value is stored
- * @param inc_ops reference to counter (see BPTREE_SECURE_NODE_ACCESS)
- * @param use_avx2 whether to use AVX2 accelerated version of find_index
+ * @param find implementation of find_index (see find_index_select)
  * @return true if key was found
  * @return false else
  */
-bool node_get(node_t *n, bp_key_t key, value_t *result, uint64_t *inc_ops, bool use_avx2);
+bool node_get(node_t *n, bp_key_t key, value_t *result, find_index_fn find);
 
 /**
  * @brief inserts a key and its value into a bptree node.
  * The function clones the node (or its children) before the insert and
  * performs the insert on the clone. Poiter to this clone is returned
  * 
+ * Writers use latch coupling: n must be latched by the caller and
+ * is unlatched by the function. The latch of the node that holds the pointer
+ * to n (parent_latch) is released and set to NULL as soon as n is known to not
+ * be replaced. If a clone is returned the parent latch is still held.
+ * 
  * @param n node to insert it to
  * @param key 
  * @param value 
- * @param free_after function may stores a pointer to a node here. This node can be freed afterwards.
- * @param inc_ops reference to counter (see BPTREE_SECURE_NODE_ACCESS)
- * @param use_avx2 whether to use AVX2 accelerated version of find_index
- * @return node_t* clone of n that was inserted to. (NULL if no insertion happend)
+ * @param info gets the previous value if the key existed and the lsn of the log record
+ * @param free_after function may stores a pointer to a node here. This node can be retired afterwards.
+ * @param parent_latch latch protecting the pointer to n (NULL if n is not reachable by other threads)
+ * @param mem memory of the tree, replaced nodes are retired to its epoch domain
+ * @param mode whether leaves that are not split are cloned or modified in place
+ * @param find implementation of find_index (see find_index_select)
+ * @return node_t* clone of n that was inserted to. (NULL if n was not replaced)
+ */
+node_t *node_insert(node_t *n, bp_key_t key, value_t value, write_info_t *info, node_t **free_after, latch_t **parent_latch, bptree_mem_t *mem, bptree_write_mode_t mode, find_index_fn find);
+
+/**
+ * @brief deletes a key from a bptree node.
+ * Uses the same copy-on-write and latch coupling protocol as node_insert.
+ * Children with at most MIN_KEYS keys are fixed on the way down, by
+ * borrowing a key from a sibling or merging with it.
+ * 
+ * @param n node to delete from
+ * @param key 
+ * @param found set to whether the key existed
+ * @param info gets the value of the key if it existed and the lsn of the log record
+ * @param free_after function may store up to two nodes here. They can be retired afterwards.
+ * @param parent_latch latch protecting the pointer to n (see node_insert)
+ * @param mem memory of the tree, replaced nodes are retired to its epoch domain
+ * @param mode whether leaves that are not fixed are cloned or modified in place
+ * @param find implementation of find_index (see find_index_select)
+ * @return node_t* clone of n that was deleted from. (NULL if n was not replaced)
  */
-node_t *node_insert(node_t *n, bp_key_t key, value_t value, node_t **free_after, uint64_t *inc_ops, bool use_avx2);
+node_t *node_delete(node_t *n, bp_key_t key, bool *found, write_info_t *info, node_t *free_after[2], latch_t **parent_latch, bptree_mem_t *mem, bptree_write_mode_t mode, find_index_fn find);
 
-// Frees memory allocated by a nodes children
-// Does not free the node n inself.
-void node_free(node_t *n);
+// returns a node and all its children to the pools of mem.
+// Frees their values if the tree owns them (see bptree_put).
+// The nodes must not be reachable by other threads.
+void node_free(node_t *n, bptree_mem_t *mem);
 
 typedef struct bptree_t
 {
-    node_t *root;
-    pthread_spinlock_t lock;
-    uint64_t __attribute__((aligned(8))) inc_ops;
-    bool use_avx2;
+    BPTREE_FIELDS(struct node_t, find_index_fn)
 } bptree_t;
 
 /**
  * @brief initilizes a b+tree 
  * 
  * @param tree pointer to tree
- * @param use_avx2 whether to use avx2 acceleration of not
+ * @param simd implementation of find_index. Falls back to the best
+ * implementation supported by the cpu if it is not available.
+ * @param write_mode how leaves are updated and whether inserts are buffered (see bptree_write_mode_t)
  */
-void bptree_init(bptree_t *tree, bool use_avx2);
+void bptree_init(bptree_t *tree, bptree_simd_t simd, bptree_write_mode_t write_mode);
 
 /**
  * @brief finds the value for a key
@@ -163,9 +260,314 @@ void bptree_init(bptree_t *tree, bool use_avx2);
  */
 bool bptree_get(bptree_t *tree, bp_key_t key, value_t *result);
 
-// inserts a key-value pair or updates a keys value
+/**
+ * @brief finds the values for multiple keys.
+ * Groups of BPTREE_GET_GROUP lookups descend the tree together and
+ * prefetch their next node, which hides most of the memory latency.
+ * 
+ * @param tree a bptree
+ * @param keys query keys
+ * @param n number of keys
+ * @param results destination where the values are stored (n entries)
+ * @param found found[i] is true if keys[i] was found (n entries)
+ * @return size_t number of keys found
+ */
+size_t bptree_get_batch(bptree_t *tree, const bp_key_t *keys, size_t n, value_t *results, bool *found);
+
+// inserts a key-value pair or updates a keys value.
+// Can be called concurrently. With BPTREE_IN_PLACE a key above all keys
+// is appended to the last leaf directly if the previous insert went there.
 void bptree_insert(bptree_t *tree, bp_key_t key, value_t value);
 
-// frees memory allocated by the tree
-// does not free the bptree_t struct itself
+/**
+ * @brief inserts a batch of keys with one pass over the tree. The batch is
+ * sorted and split along the tree, so every node on the way is replaced only
+ * once and all keys that go to the same leaf are merged into one copy of it
+ * (split into as many leaves as needed). The root latch is taken once for the
+ * batch. If a key occurs more than once its last value is stored.
+ * Can be called concurrently.
+ * 
+ * @param tree a bptree
+ * @param keys keys in any order
+ * @param values values of the keys
+ * @param n number of keys
+ */
+void bptree_insert_batch(bptree_t *tree, const bp_key_t *keys, const value_t *values, size_t n);
+
+/**
+ * @brief hands the inserts of all threads to a single thread (flat combining).
+ * A thread publishes its insert and waits until it is applied. The first
+ * waiting thread becomes the combiner and applies all published inserts
+ * in key order, so the other threads do not contend for the latches and
+ * consecutive inserts share the nodes they pass in the cache. Pays off
+ * with many concurrent writers. Call before the tree is used concurrently.
+ * Inserts into a tree of BPTREE_BUFFERED go to its buffers instead.
+ * 
+ * @param tree a bptree
+ */
+void bptree_combining_enable(bptree_t *tree);
+
+/**
+ * @brief atomically replaces the value of a key by the one computed by fn
+ * (read-modify-write). If the key exists, its leaf is found like by a get
+ * and only the latch of the leaf is taken, so updates of different leaves do
+ * not wait for each other and gets are not blocked. New keys and leaves of
+ * a snapshot take the path of bptree_insert. Can be called concurrently.
+ * 
+ * @param tree a bptree
+ * @param key key to update
+ * @param fn computes the new value, called once with the leaf latched
+ * @param ctx passed to fn
+ * @return true if the key existed
+ * @return false else
+ */
+bool bptree_update(bptree_t *tree, bp_key_t key, bptree_update_fn fn, void *ctx);
+
+// replaces the value of an existing key if it is expected (see bptree_update).
+// Returns true if the value was replaced.
+bool bptree_cas(bptree_t *tree, bp_key_t key, value_t expected, value_t desired);
+
+// adds delta to the value of a key, a new key is inserted with delta
+// (see bptree_update). Returns the previous value (0 for a new key).
+// Not for trees whose values are stored with bptree_put.
+value_t bptree_fetch_add(bptree_t *tree, bp_key_t key, value_t delta);
+
+/**
+ * @brief deletes a key and its value.
+ * Can be called concurrently.
+ * 
+ * @param tree a bptree
+ * @param key key to delete
+ * @return true if the key existed
+ * @return false else
+ */
+bool bptree_delete(bptree_t *tree, bp_key_t key);
+
+/**
+ * @brief copies a value into the value store of the tree (see value_store.h).
+ * From then on the tree owns all its values: values that are replaced or
+ * deleted are freed, so the tree must not hold values of bptree_insert.
+ * The value has to be inserted with bptree_insert or bptree_bulk_load.
+ * 
+ * @param tree a bptree
+ * @param data the value
+ * @param len length of the value in bytes
+ * @return value_t encoded value
+ */
+value_t bptree_value_create(bptree_t *tree, const void *data, size_t len);
+
+// inserts a key with a value of variable size or updates the key's value.
+// Small values are stored inline in the leaf (see bptree_value_create).
+void bptree_put(bptree_t *tree, bp_key_t key, const void *data, size_t len);
+
+/**
+ * @brief finds the value of a key without copying it.
+ * Must be called between bptree_read_begin and bptree_read_end,
+ * the view stays valid until bptree_read_end.
+ * 
+ * @param tree a bptree whose values are stored with bptree_put
+ * @param key query key
+ * @param view set to the value
+ * @return true if key was found
+ * @return false else
+ */
+bool bptree_get_view(bptree_t *tree, bp_key_t key, value_view_t *view);
+
+// starts a section in which views of values stay valid.
+// Values returned by bptree_get, bptree_get_batch and bptree_scan can be
+// viewed with value_store_view within the section. Sections can be nested.
+void bptree_read_begin(bptree_t *tree);
+
+void bptree_read_end(bptree_t *tree);
+
+/**
+ * @brief callback for bptree_scan
+ * 
+ * @param key key of the entry
+ * @param value value of the entry
+ * @param ctx context passed to bptree_scan
+ * @return true to continue the scan
+ * @return false to stop it
+ */
+typedef bool (*bptree_scan_fn)(bp_key_t key, value_t value, void *ctx);
+
+/**
+ * @brief calls fn for all entries with lo <= key <= hi in ascending key order.
+ * Leaves are visited along the list of leaves and the next leaf is prefetched.
+ * Each leaf is read consistently, entries inserted or deleted concurrently
+ * may or may not be visited. Entries present during the whole scan are visited.
+ * 
+ * @param tree a bptree
+ * @param lo smallest key
+ * @param hi largest key
+ * @param fn callback called for every entry
+ * @param ctx passed to fn
+ * @return size_t number of entries passed to fn
+ */
+size_t bptree_scan(bptree_t *tree, bp_key_t lo, bp_key_t hi, bptree_scan_fn fn, void *ctx);
+
+// a read-only view of a tree as it was when bptree_snapshot returned
+typedef struct bptree_snapshot_t
+{
+    bptree_t *tree;
+    node_t *root;
+
+    // keeps the replaced nodes and values of the snapshot from being freed
+    epoch_record_t *pin;
+} bptree_snapshot_t;
+
+/**
+ * @brief takes a consistent read-only snapshot of the tree without blocking
+ * writers for longer than the writes that are in progress. Nodes that exist
+ * when the snapshot is taken are never modified in place afterwards: the
+ * first write to such a node clones it and the path above it. Replaced nodes
+ * and values are kept until the snapshot is released, so snapshots should
+ * not be held forever.
+ * 
+ * @param tree a bptree
+ * @return bptree_snapshot_t* snapshot, release it with bptree_snapshot_release
+ */
+bptree_snapshot_t *bptree_snapshot(bptree_t *tree);
+
+// like bptree_get, for the tree as it was when the snapshot was taken.
+// Values can be viewed with value_store_view until the snapshot is released.
+bool bptree_snapshot_get(bptree_snapshot_t *snapshot, bp_key_t key, value_t *result);
+
+/**
+ * @brief calls fn for all entries of the snapshot with lo <= key <= hi in
+ * ascending key order. Unlike bptree_scan the scan sees exactly the entries
+ * of the snapshot, however long it takes.
+ * 
+ * @param snapshot a snapshot of bptree_snapshot
+ * @param lo smallest key
+ * @param hi largest key
+ * @param fn callback called for every entry
+ * @param ctx passed to fn
+ * @return size_t number of entries passed to fn
+ */
+size_t bptree_snapshot_scan(bptree_snapshot_t *snapshot, bp_key_t lo, bp_key_t hi, bptree_scan_fn fn, void *ctx);
+
+// releases a snapshot, the old versions it kept can be freed from then on
+void bptree_snapshot_release(bptree_snapshot_t *snapshot);
+
+/**
+ * @brief builds the tree bottom up from sorted entries.
+ * Much faster than inserting the entries one by one: nodes are
+ * filled directly and no node is cloned.
+ * Existing entries are removed. The tree must not be
+ * accessed by other threads during the load and must have no snapshots.
+ * 
+ * @param tree a bptree
+ * @param keys strictly ascending keys
+ * @param values values of the keys
+ * @param n number of entries
+ * @param fill_factor fraction of the node capacity that is used (0, 1].
+ * Values below 1 leave room for inserts without immediate splits.
+ */
+void bptree_bulk_load(bptree_t *tree, const bp_key_t *keys, const value_t *values, size_t n, float fill_factor);
+
+/**
+ * @brief parallel version of bptree_bulk_load.
+ * Every level of the tree is split into num_threads ranges of
+ * nodes that are built independently.
+ * 
+ * @param tree a bptree
+ * @param keys strictly ascending keys
+ * @param values values of the keys
+ * @param n number of entries
+ * @param fill_factor fraction of the node capacity that is used (0, 1]
+ * @param num_threads number of threads used to build the tree
+ */
+void bptree_bulk_load_parallel(bptree_t *tree, const bp_key_t *keys, const value_t *values, size_t n, float fill_factor, int num_threads);
+
+/**
+ * @brief writes a snapshot of the tree that bptree_open_mmap can map.
+ * Nodes are written as they are in memory (cache line aligned), with
+ * their pointers linked for the address the snapshot will be mapped at.
+ * Gets can run concurrently, writers must not modify the tree.
+ * 
+ * @param tree a bptree
+ * @param path file the snapshot is written to
+ * @return true on success
+ * @return false if the file could not be written (see errno)
+ */
+bool bptree_save(bptree_t *tree, const char *path);
+
+/**
+ * @brief initializes a tree from a snapshot written by bptree_save.
+ * The file is mapped privately and its nodes are used in place, so only the
+ * pages that are accessed are read and unmodified pages are shared with other
+ * processes through the page cache. Writers clone the nodes they change into
+ * memory (or modify their page of the mapping with BPTREE_IN_PLACE), the
+ * file itself is never modified.
+ * If the snapshot can not be mapped at its address all its pointers are
+ * moved, which reads the whole file.
+ * 
+ * @param tree tree that is initialized (see bptree_init)
+ * @param path file written by bptree_save with the same key size and NODE_LINES
+ * @param simd implementation of find_index
+ * @param write_mode how leaves are updated
+ * @return true on success
+ * @return false if the file could not be mapped or has a different format (see errno)
+ */
+bool bptree_open_mmap(bptree_t *tree, const char *path, bptree_simd_t simd, bptree_write_mode_t write_mode);
+
+/**
+ * @brief makes inserts, puts and deletes durable with a write-ahead log.
+ * The records of the log are applied to the tree first, then every
+ * write appends a record (while it holds the latch of its leaf, so records
+ * of a key are in the order of the writes) and returns once the record is
+ * on disk or the log failed (see bptree_wal_error). Concurrent writers
+ * share one fdatasync (group commit, see wal.h). Bulk loads are not logged.
+ * 
+ * @param tree a bptree, values are logged by content if it was created
+ * with bptree_value_create (the log has to be opened the same way again)
+ * @param path log file, created if it does not exist
+ * @return true on success
+ * @return false if the file could not be opened (see errno)
+ */
+bool bptree_wal_open(bptree_t *tree, const char *path);
+
+/**
+ * @brief returns whether the write-ahead log of a tree failed. After a
+ * failed write or sync of the log the writes are still applied to the
+ * tree, but they are not durable anymore.
+ *
+ * @param tree a tree
+ * @return int errno of the failure, 0 if the log did not fail or the tree has none
+ */
+int bptree_wal_error(bptree_t *tree);
+
+/**
+ * @brief attaches a file of incremental checkpoints to a tree (see checkpoint.h)
+ * and loads the last checkpoint in it. Open the checkpoint before the
+ * write-ahead log, so the log is replayed on top of it.
+ * 
+ * @param tree a tree that is empty if the file holds a checkpoint
+ * @param path checkpoint file, created if it does not exist
+ * @return true on success
+ * @return false if the file could not be opened or was written for
+ * another key size or NODE_LINES (see errno)
+ */
+bool bptree_checkpoint_open(bptree_t *tree, const char *path);
+
+/**
+ * @brief appends a checkpoint of the tree to its checkpoint file.
+ * Only nodes that were created or modified since the last checkpoint are
+ * written, the others are referenced by their id. The whole tree is
+ * traversed in memory, but the bytes written are proportional to the changes.
+ * Afterwards the write-ahead log of the tree is truncated. Once the file
+ * holds mostly old versions of nodes it is compacted in the background.
+ * Gets can run concurrently, writers must not modify the tree.
+ * 
+ * @param tree a tree with a checkpoint file (see bptree_checkpoint_open)
+ * @return true once the checkpoint is on disk and the log is truncated
+ * @return false if it could not be written (the next checkpoint writes its nodes again)
+ * or the log could not be truncated (see bptree_wal_error)
+ */
+bool bptree_checkpoint(bptree_t *tree);
+
+// frees memory allocated by the tree by releasing its pools at once
+// (and unmaps its snapshot, closes its log and checkpoint file). Does not free the bptree_t struct itself.
+// Snapshots of bptree_snapshot have to be released before.
 void bptree_free(bptree_t *tree);
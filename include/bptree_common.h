@@ -0,0 +1,260 @@
+#pragma once
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <immintrin.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "spinlock.h"
+#include "epoch.h"
+#include "pool.h"
+#include "value_store.h"
+#include "wal.h"
+#include "checkpoint.h"
+
+#define SIMD_REGISTER_SIZE sizeof(__m256i)
+
+// cache-line width of processor in bytes
+#define DCACHE_LINESIZE 64
+
+/**
+ * @brief number of cache lines filled by the keys of a node (1, 2, 4 or 8).
+ * More lines make the tree flatter but every node needs more compares.
+ * Set for a build variant with -DNODE_LINES (see make NODE_LINES=...).
+ */
+#ifndef NODE_LINES
+#define NODE_LINES 1
+#endif
+
+#if NODE_LINES != 1 && NODE_LINES != 2 && NODE_LINES != 4 && NODE_LINES != 8
+#error NODE_LINES has to be 1,2,4 or 8
+#endif
+
+// number of lookups bptree_get_batch advances in lockstep.
+// Enough to overlap the cache misses of one tree level.
+#define BPTREE_GET_GROUP 16
+
+// value type in b+tree
+typedef uintptr_t value_t;
+
+// version bit of a node that is replaced by a clone
+#define NODE_OBSOLETE (1ULL << 63)
+
+// checkpoint_id bit of a node that changed since it was checkpointed
+#define NODE_DIRTY (1U << 31)
+
+// implementation of find_index used by a tree
+typedef enum bptree_simd_t
+{
+    BPTREE_SIMD_NONE = 0,
+    BPTREE_SIMD_AVX2 = 1,
+    BPTREE_SIMD_AVX512 = 2,
+    // best implementation supported by the cpu
+    BPTREE_SIMD_BEST = 3,
+} bptree_simd_t;
+
+// spin latch used by writers (see node_insert)
+typedef uint8_t latch_t;
+
+static inline void latch_acquire(latch_t *latch)
+{
+    while (__atomic_test_and_set(latch, __ATOMIC_ACQUIRE))
+        while (__atomic_load_n(latch, __ATOMIC_RELAXED))
+            _mm_pause();
+}
+
+// returns true if the latch was free and is held by the caller now
+static inline bool latch_try_acquire(latch_t *latch)
+{
+    return !__atomic_load_n(latch, __ATOMIC_RELAXED) && !__atomic_test_and_set(latch, __ATOMIC_ACQUIRE);
+}
+
+static inline void latch_release(latch_t *latch)
+{
+    __atomic_clear(latch, __ATOMIC_RELEASE);
+}
+
+// how writers update a leaf that is not split, merged or borrowed from
+typedef enum bptree_write_mode_t
+{
+    // the leaf is cloned and the clone replaces it in its parent
+    BPTREE_COPY_ON_WRITE = 0,
+
+    // the leaf is modified in place. Readers validate the version of the
+    // leaf and retry their read. Needs no allocation.
+    BPTREE_IN_PLACE,
+
+    // inserts are appended to a buffer of messages in front of the root
+    // and flushed into the tree as one sorted batch once it is full.
+    // Gets and scans look into the buffer first. Other writes flush the
+    // buffer before they run. Leaves are modified in place.
+    BPTREE_BUFFERED,
+} bptree_write_mode_t;
+
+// inserts of a tree that are not applied yet (defined by bptree.c)
+struct write_buffer_t;
+
+// buffers of the inserts of BPTREE_BUFFERED. Inserts are appended to the
+// active buffer. A full buffer is flushed into the tree by the thread that
+// found it full, while the other threads append to a new buffer.
+typedef struct write_buffers_t
+{
+    // buffer new inserts are appended to
+    struct write_buffer_t *active;
+
+    // full buffer that is flushed into the tree (NULL if there is none)
+    struct write_buffer_t *flushing;
+
+    // held by writers that append to the active buffer
+    latch_t latch;
+
+    // number of flushed buffers and inserts for statistics
+    uint64_t num_flushes;
+    uint64_t num_messages;
+} write_buffers_t;
+
+// insert that waits for a combiner (defined by bptree.c)
+struct combine_request_t;
+
+// inserts of all threads applied by one thread (flat combining, see
+// bptree_combining_enable). Threads publish their inserts on a stack
+// and the thread that gets the latch applies them as one sorted batch
+// with a single pass from the root (see bptree_insert_batch).
+typedef struct combine_t
+{
+    // stack of the published inserts
+    struct combine_request_t *__attribute__((aligned(64))) pending;
+
+    // held by the thread that applies the inserts (the combiner)
+    latch_t __attribute__((aligned(64))) latch;
+
+    // number of batches and inserts applied for statistics
+    uint64_t num_batches;
+    uint64_t num_requests;
+} combine_t;
+
+// memory of a tree
+typedef struct bptree_mem_t
+{
+    // replaced nodes are retired here and freed once no reader can access them
+    epoch_t epoch;
+
+    // slabs for nodes (cache line aligned) and leaf links
+    pool_t nodes;
+    pool_t links;
+
+    // values of bptree_put (see value_store.h)
+    value_store_t values;
+
+    // set once the tree holds values of the store. Replaced and
+    // deleted values are retired then.
+    bool owns_values;
+
+    // snapshot the tree was opened from (see bptree_open_mmap).
+    // Nodes, links and values within it are never freed.
+    char *image;
+    size_t image_size;
+
+    // write-ahead log of inserts and deletes (NULL if the
+    // tree is not durable, see bptree_wal_open)
+    wal_t *wal;
+
+    // file of incremental checkpoints (NULL if the tree
+    // has none, see bptree_checkpoint_open)
+    checkpoint_t *checkpoint;
+
+    // inserts are handed to a combiner (NULL if every
+    // thread inserts itself, see bptree_combining_enable)
+    combine_t *combine;
+
+    // inserts that are not applied yet (NULL unless the
+    // tree was initialized with BPTREE_BUFFERED)
+    write_buffers_t *buffers;
+
+    // last leaf of the tree (NULL if unknown). Keys above all keys are
+    // appended to it without a descent (see bptree_insert). Cleared
+    // before the leaf is retired.
+    void *tail;
+
+    // read snapshots (see bptree_snapshot). Nodes are created in the
+    // current generation. Nodes of a generation below frozen can be part
+    // of a live snapshot, writers clone them instead of changing them
+    // in place. Both only change while no writer is active.
+    uint64_t generation;
+    uint64_t frozen;
+    uint32_t num_snapshots;
+
+    // writers that passed the root latch or update a leaf without it
+    // (see bptree_update) and are not done yet
+    uint32_t writers;
+
+    // set while a snapshot waits for the writers. Updates that
+    // bypass the root latch wait for it on the root latch then.
+    bool paused;
+} bptree_mem_t;
+
+/**
+ * @brief callback of bptree_update, computes the new value of a key.
+ * Called with the leaf of the key latched, so it must not access the tree.
+ *
+ * @param value current value of the key (0 if it does not exist), set to the new value
+ * @param found whether the key exists
+ * @param ctx context passed to bptree_update
+ * @return true to store the new value (the key is inserted if it does not exist)
+ * @return false to leave the key unchanged
+ */
+typedef bool (*bptree_update_fn)(value_t *value, bool found, void *ctx);
+
+// nodes a write can replace below a node of a snapshot (3 per level)
+#define BPTREE_MAX_RETIRED (3 * 64)
+
+// results of a write that the caller handles once the tree is unlatched
+typedef struct write_info_t
+{
+    // previous value of the key if it existed (0 else)
+    value_t old_value;
+
+    // end of the log record of the write (0 if it was not logged)
+    uint64_t lsn;
+
+    // computes the value from the current value of the key
+    // (NULL for inserts, see bptree_update)
+    bptree_update_fn update;
+    void *update_ctx;
+
+    // whether the key existed (set by updates)
+    bool found;
+
+    // whether the write descends along the last child of every
+    // node so far. Such nodes are split unevenly (see node_split).
+    bool right_edge;
+
+    // set once the write split a node. The nodes below are not
+    // reachable by other threads until they are swapped in.
+    bool split;
+
+    // last leaf of the tree the key was appended to below a split node.
+    // It is made known to appends once it is reachable (see tail_publish).
+    void *tail;
+
+    // replaced nodes of a snapshot. They are retired once the
+    // new version of their path is reachable from the root.
+    void *retired[BPTREE_MAX_RETIRED];
+    int num_retired;
+} write_info_t;
+
+// fields of a tree, shared by bptree_t and the trees of bptree_typed.h.
+// Only the node type and the signature of find_index depend on the key width.
+//  - root_latch protects the root pointer. Inserts into disjoint subtrees run
+//    in parallel, since writers only hold the latches of the nodes they modify.
+//  - simd is the requested implementation of find_index, find the
+//    one it was resolved to for the cpu (see bptree_init).
+#define BPTREE_FIELDS(node_type, find_type) \
+    node_type *root;                        \
+    latch_t root_latch;                     \
+    bptree_mem_t mem;                       \
+    bptree_simd_t simd;                     \
+    find_type find;                         \
+    bptree_write_mode_t write_mode;
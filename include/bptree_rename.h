@@ -0,0 +1,62 @@
+#pragma once
+// Renames the symbols of bptree.c for a tree with BPTREE_WIDTH bit keys,
+// e.g. bptree_get becomes bptree32_get and node_get bptree32_node_get.
+// Included by bptree.h before any declaration.
+
+#define BPTREE_CAT_(a, b, c) a##b##c
+#define BPTREE_CAT(a, b, c) BPTREE_CAT_(a, b, c)
+#define BPTREE_RENAME(suffix) BPTREE_CAT(bptree, BPTREE_WIDTH, suffix)
+
+// types
+#define node_t BPTREE_RENAME(_node_t)
+#define leaf_link_t BPTREE_RENAME(_leaf_link_t)
+#define find_index_fn BPTREE_RENAME(_find_index_fn)
+#define bptree_t BPTREE_RENAME(_t)
+#define bptree_scan_fn BPTREE_RENAME(_scan_fn)
+#define bptree_snapshot_t BPTREE_RENAME(_snapshot_t)
+
+// node level functions
+#define node_create BPTREE_RENAME(_node_create)
+#define node_clone BPTREE_RENAME(_node_clone)
+#define node_get BPTREE_RENAME(_node_get)
+#define node_insert BPTREE_RENAME(_node_insert)
+#define node_delete BPTREE_RENAME(_node_delete)
+#define node_split BPTREE_RENAME(_node_split)
+#define node_free BPTREE_RENAME(_node_free)
+#define swap_and_retire BPTREE_RENAME(_swap_and_retire)
+#define find_index BPTREE_RENAME(_find_index)
+#define find_index_avx2 BPTREE_RENAME(_find_index_avx2)
+#define find_index_avx512 BPTREE_RENAME(_find_index_avx512)
+#define find_index_select BPTREE_RENAME(_find_index_select)
+#define bptree_simd_resolve BPTREE_RENAME(_simd_resolve)
+
+// tree level functions
+#define bptree_init BPTREE_RENAME(_init)
+#define bptree_get BPTREE_RENAME(_get)
+#define bptree_get_batch BPTREE_RENAME(_get_batch)
+#define bptree_insert BPTREE_RENAME(_insert)
+#define bptree_insert_batch BPTREE_RENAME(_insert_batch)
+#define bptree_combining_enable BPTREE_RENAME(_combining_enable)
+#define bptree_update BPTREE_RENAME(_update)
+#define bptree_cas BPTREE_RENAME(_cas)
+#define bptree_fetch_add BPTREE_RENAME(_fetch_add)
+#define bptree_delete BPTREE_RENAME(_delete)
+#define bptree_value_create BPTREE_RENAME(_value_create)
+#define bptree_put BPTREE_RENAME(_put)
+#define bptree_get_view BPTREE_RENAME(_get_view)
+#define bptree_read_begin BPTREE_RENAME(_read_begin)
+#define bptree_read_end BPTREE_RENAME(_read_end)
+#define bptree_scan BPTREE_RENAME(_scan)
+#define bptree_snapshot BPTREE_RENAME(_snapshot)
+#define bptree_snapshot_get BPTREE_RENAME(_snapshot_get)
+#define bptree_snapshot_scan BPTREE_RENAME(_snapshot_scan)
+#define bptree_snapshot_release BPTREE_RENAME(_snapshot_release)
+#define bptree_bulk_load BPTREE_RENAME(_bulk_load)
+#define bptree_bulk_load_parallel BPTREE_RENAME(_bulk_load_parallel)
+#define bptree_save BPTREE_RENAME(_save)
+#define bptree_open_mmap BPTREE_RENAME(_open_mmap)
+#define bptree_wal_open BPTREE_RENAME(_wal_open)
+#define bptree_wal_error BPTREE_RENAME(_wal_error)
+#define bptree_checkpoint_open BPTREE_RENAME(_checkpoint_open)
+#define bptree_checkpoint BPTREE_RENAME(_checkpoint)
+#define bptree_free BPTREE_RENAME(_free)
@@ -0,0 +1,143 @@
+#pragma once
+#include "bptree.h"
+
+// Store that splits the keys over independent trees (shards), so writers
+// of different shards never wait for the same latch.
+//
+// Keys are assigned to shards by range or by a hash of the key. Ranges keep
+// the keys of a shard consecutive, so scans visit the keys in order, and a
+// shard that receives most of the writes hands the lower or upper half of
+// its recently written keys to its colder neighbour (rebalancing). Hashing
+// spreads any key distribution evenly, but scans visit one shard after
+// another.
+//
+// Gets do not write to shared memory: the ranges of the shards change under
+// a sequence lock and a get is repeated if a range moved in the meantime.
+// Writes and scans are counted per shard. A range moves once the writes and
+// scans of both of its shards are done, new ones wait until it moved.
+
+// recently written keys per shard. Their median becomes the new bound
+// between a hot shard and its neighbour.
+#define SHARD_SAMPLES 64
+
+// writes to a shard between two checks for a hot shard (power of two)
+#define SHARD_CHECK_WRITES (1 << 16)
+
+// a shard is hot once it receives this many times its share of the writes
+#define SHARD_HOT_FACTOR 2
+
+// how keys are assigned to shards
+typedef enum
+{
+    // consecutive key ranges, rebalanced when a shard gets hot
+    BPTREE_SHARD_RANGE,
+    // hash of the key, scans are not ordered across shards
+    BPTREE_SHARD_HASH,
+} bptree_shard_mode_t;
+
+typedef struct bptree_shard_t
+{
+    bptree_t tree;
+
+    // writes and scans in progress. Written by every writer of the
+    // shard, so it gets its own cache line.
+    uint64_t __attribute__((aligned(64))) active;
+
+    // set while keys move from or to the shard, writers wait
+    bool moving;
+
+    // number of writes and the keys of the latest ones
+    uint64_t writes;
+    bp_key_t samples[SHARD_SAMPLES];
+} bptree_shard_t;
+
+typedef struct bptree_sharded_t
+{
+    bptree_shard_t *shards;
+    int num_shards;
+    bptree_shard_mode_t mode;
+
+    // shard i holds the keys in [bounds[i - 1], bounds[i]) (ranges only).
+    // The first shard starts at KEY_T_MIN, the last ends at KEY_T_MAX.
+    bp_key_t *bounds;
+
+    // odd while keys move between shards (sequence lock of gets)
+    uint64_t __attribute__((aligned(64))) version;
+
+    // move the ranges of hot shards automatically
+    bool rebalance;
+
+    // held while the writes of the shards are compared and a range moves
+    pthread_mutex_t lock;
+
+    // writes of every shard at the last check
+    uint64_t *checked;
+
+    // number of moved ranges for statistics
+    uint64_t num_moves;
+} bptree_sharded_t;
+
+/**
+ * @brief initializes a store with empty shards. Ranges split the key space
+ * evenly until bptree_sharded_split is called.
+ *
+ * @param s store
+ * @param num_shards number of trees
+ * @param mode how keys are assigned to shards
+ * @param rebalance move the ranges of hot shards automatically (ranges only)
+ * @param simd implementation of find_index
+ * @param write_mode how leaves are updated
+ */
+void bptree_sharded_init(bptree_sharded_t *s, int num_shards, bptree_shard_mode_t mode, bool rebalance, bptree_simd_t simd, bptree_write_mode_t write_mode);
+
+// sets the ranges of an empty store so every shard gets the same
+// number of the n strictly ascending keys (ranges only)
+void bptree_sharded_split(bptree_sharded_t *s, const bp_key_t *keys, size_t n);
+
+// the functions below behave like their bptree_* counterparts
+bool bptree_sharded_get(bptree_sharded_t *s, bp_key_t key, value_t *result);
+size_t bptree_sharded_get_batch(bptree_sharded_t *s, const bp_key_t *keys, size_t n, value_t *results, bool *found);
+void bptree_sharded_insert(bptree_sharded_t *s, bp_key_t key, value_t value);
+void bptree_sharded_put(bptree_sharded_t *s, bp_key_t key, const void *data, size_t len);
+bool bptree_sharded_delete(bptree_sharded_t *s, bp_key_t key);
+
+// views stay valid until bptree_sharded_read_end
+bool bptree_sharded_get_view(bptree_sharded_t *s, bp_key_t key, value_view_t *view);
+void bptree_sharded_read_begin(bptree_sharded_t *s);
+void bptree_sharded_read_end(bptree_sharded_t *s);
+
+/**
+ * @brief calls fn for all entries with lo <= key <= hi. With ranges the
+ * entries are visited in ascending key order, with hashing in key order
+ * per shard.
+ *
+ * @param s store
+ * @param lo smallest key
+ * @param hi largest key
+ * @param fn callback called for every entry
+ * @param ctx passed to fn
+ * @return size_t number of entries passed to fn
+ */
+size_t bptree_sharded_scan(bptree_sharded_t *s, bp_key_t lo, bp_key_t hi, bptree_scan_fn fn, void *ctx);
+
+// copies a value into the value store of the shard of key.
+// Only for values of bptree_sharded_bulk_load.
+value_t bptree_sharded_value_create(bptree_sharded_t *s, bp_key_t key, const void *data, size_t len);
+
+// bulk loads every shard with its part of the entries (see bptree_bulk_load_parallel)
+void bptree_sharded_bulk_load(bptree_sharded_t *s, const bp_key_t *keys, const value_t *values, size_t n, float fill_factor, int num_threads);
+
+/**
+ * @brief compares the writes every shard received since the last check.
+ * If a shard is hot, the keys on one side of the median of its recent
+ * writes move to the neighbour that received fewer writes. Called
+ * automatically every SHARD_CHECK_WRITES writes of a shard if the store
+ * rebalances.
+ *
+ * @param s store with ranges
+ * @return true if a range moved
+ */
+bool bptree_sharded_rebalance(bptree_sharded_t *s);
+
+// frees all shards. Does not free the bptree_sharded_t struct itself
+void bptree_sharded_free(bptree_sharded_t *s);
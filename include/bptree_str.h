@@ -0,0 +1,143 @@
+#pragma once
+#include "bptree_common.h"
+
+// B+tree for variable length string keys. Keys are byte strings ordered
+// like memcmp, a key sorts before all keys it is a prefix of.
+//
+// Nodes store an 8 byte head per key: the first 8 bytes of the key read
+// big endian (zero padded) with the sign bit flipped, so comparing heads as
+// signed integers orders keys by their first 8 bytes. The heads are searched
+// with the SIMD kernels of the 64 bit tree (see find_index_select). Only keys
+// with the same head as the query are compared in full. Full keys are stored
+// out of line. Separators of inner nodes are truncated to the shortest prefix
+// that separates the two children, so they rarely need the full compare.
+//
+// Readers do not write to shared memory: nodes are never modified once they
+// are reachable. Writers are serialized by a latch, copy the path from the
+// root to the leaf they modify and publish the new root with one store.
+// Replaced nodes and keys are retired to the epoch domain of the tree.
+
+// nodes have the size of the nodes of the 64 bit tree,
+// so its kernels can search the heads
+#define STR_ORDER (NODE_LINES * (DCACHE_LINESIZE / 8) + 1)
+
+// a key stored out of line. Shared by all versions of a node.
+typedef struct bptree_str_key_t
+{
+    uint32_t len;
+    char data[];
+} bptree_str_key_t;
+
+// a node within the string tree
+typedef struct str_node_t
+{
+    // heads of the keys (see above), unused heads are INT64_MAX
+    int64_t heads[STR_ORDER - 1];
+
+    // full keys (leaves) or separators (inner nodes)
+    bptree_str_key_t *keys[STR_ORDER - 1];
+
+    // number of keys in node
+    uint16_t n;
+
+    // marks node as leaf
+    bool is_leaf;
+
+    // array of node pointer (children) or values
+    union
+    {
+        value_t values[STR_ORDER - 1];
+        struct str_node_t *nodes[STR_ORDER];
+    } children;
+} __attribute__((aligned(DCACHE_LINESIZE))) str_node_t;
+
+// find_index_fn of the 64 bit tree, returns the first index i where heads[i] >= head
+typedef uint16_t (*str_find_fn)(const int64_t *heads, int size, int64_t head);
+
+typedef struct bptree_str_t
+{
+    str_node_t *root;
+
+    // held by writers for the whole write
+    latch_t latch;
+
+    // replaced nodes and keys are retired here
+    epoch_t epoch;
+    pool_t nodes;
+
+    bptree_simd_t simd;
+    str_find_fn find;
+} bptree_str_t;
+
+/**
+ * @brief called by bptree_str_scan for every entry in the range.
+ *
+ * @param key the key (not null terminated)
+ * @param len length of the key in bytes
+ * @param value value of the key
+ * @param ctx context pointer passed to bptree_str_scan
+ * @return true to continue the scan, false to stop it
+ */
+typedef bool (*bptree_str_scan_fn)(const char *key, size_t len, value_t value, void *ctx);
+
+/**
+ * @brief initializes an empty string tree
+ *
+ * @param tree pointer to tree
+ * @param simd implementation used to search the heads (see bptree_simd_resolve)
+ */
+void bptree_str_init(bptree_str_t *tree, bptree_simd_t simd);
+
+/**
+ * @brief finds the value of a key
+ *
+ * @param tree a tree
+ * @param key the key (does not have to be null terminated)
+ * @param len length of the key in bytes
+ * @param result destination where the value is stored
+ * @return true if key was found
+ * @return false else
+ */
+bool bptree_str_get(bptree_str_t *tree, const char *key, size_t len, value_t *result);
+
+/**
+ * @brief inserts a key or replaces its value. The key is copied.
+ *
+ * @param tree a tree
+ * @param key the key
+ * @param len length of the key in bytes (less than 4 GiB)
+ * @param value value of the key
+ */
+void bptree_str_insert(bptree_str_t *tree, const char *key, size_t len, value_t value);
+
+/**
+ * @brief deletes a key
+ *
+ * @param tree a tree
+ * @param key the key
+ * @param len length of the key in bytes
+ * @return true if the key was found and deleted
+ * @return false else
+ */
+bool bptree_str_delete(bptree_str_t *tree, const char *key, size_t len);
+
+/**
+ * @brief calls fn for all keys in [lo, hi] in ascending order.
+ * The scan reads one version of the tree, writes that happen during the
+ * scan are not visible to it.
+ *
+ * @param tree a tree
+ * @param lo smallest key of the range
+ * @param lo_len length of lo in bytes
+ * @param hi largest key of the range
+ * @param hi_len length of hi in bytes
+ * @param fn called for every entry until it returns false
+ * @param ctx passed to fn
+ * @return number of entries passed to fn
+ */
+size_t bptree_str_scan(bptree_str_t *tree, const char *lo, size_t lo_len, const char *hi, size_t hi_len,
+                       bptree_str_scan_fn fn, void *ctx);
+
+// frees all nodes and keys of the tree.
+// No thread must access the tree anymore.
+void bptree_str_free(bptree_str_t *tree);
@@ -0,0 +1,127 @@
+#pragma once
+#include <stddef.h>
+#include "bptree_common.h"
+
+// Trees for 8, 16, 32 and 64 bit keys that can be used side by side.
+//
+// bptree.c is compiled once per key width with -DBPTREE_WIDTH=<bits>
+// (see Makefile), so every width gets its own SIMD kernels and the
+// densest nodes for its keys (ORDER grows as the keys get smaller).
+// The functions behave like the bptree_* functions of bptree.h,
+// e.g. bptree32_get(&tree32, key, &value) looks up a 32 bit key.
+// The largest key of a width (e.g. INT32_MAX) marks unused key slots
+// and can not be stored.
+
+/**
+ * @brief declares the tree type of one key width
+ *
+ * @param width key width in bits (8, 16, 32 or 64)
+ * @param key_type signed integer type of the keys
+ */
+#define BPTREE_DECLARE_TYPES(width, key_type)                                                                            \
+    typedef uint16_t (*bptree##width##_find_index_fn)(const key_type *keys, int size, key_type key);                     \
+                                                                                                                         \
+    typedef struct bptree##width##_t                                                                                     \
+    {                                                                                                                    \
+        BPTREE_FIELDS(struct bptree##width##_node_t, bptree##width##_find_index_fn)                                      \
+    } bptree##width##_t;                                                                                                 \
+                                                                                                                         \
+    typedef bool (*bptree##width##_scan_fn)(key_type key, value_t value, void *ctx);                                     \
+    typedef struct bptree##width##_snapshot_t bptree##width##_snapshot_t;
+
+// declares the functions of one key width (see BPTREE_DECLARE_TYPES)
+#define BPTREE_DECLARE_FUNCTIONS(width, key_type)                                                                        \
+    void bptree##width##_init(bptree##width##_t *tree, bptree_simd_t simd, bptree_write_mode_t write_mode);              \
+    bool bptree##width##_get(bptree##width##_t *tree, key_type key, value_t *result);                                    \
+    size_t bptree##width##_get_batch(bptree##width##_t *tree, const key_type *keys, size_t n, value_t *results,          \
+                                     bool *found);                                                                       \
+    void bptree##width##_insert(bptree##width##_t *tree, key_type key, value_t value);                                   \
+    void bptree##width##_insert_batch(bptree##width##_t *tree, const key_type *keys, const value_t *values, size_t n);   \
+    void bptree##width##_combining_enable(bptree##width##_t *tree);                                                      \
+    bool bptree##width##_update(bptree##width##_t *tree, key_type key, bptree_update_fn fn, void *ctx);                  \
+    bool bptree##width##_cas(bptree##width##_t *tree, key_type key, value_t expected, value_t desired);                  \
+    value_t bptree##width##_fetch_add(bptree##width##_t *tree, key_type key, value_t delta);                             \
+    bool bptree##width##_delete(bptree##width##_t *tree, key_type key);                                                  \
+    value_t bptree##width##_value_create(bptree##width##_t *tree, const void *data, size_t len);                         \
+    void bptree##width##_put(bptree##width##_t *tree, key_type key, const void *data, size_t len);                       \
+    bool bptree##width##_get_view(bptree##width##_t *tree, key_type key, value_view_t *view);                            \
+    void bptree##width##_read_begin(bptree##width##_t *tree);                                                            \
+    void bptree##width##_read_end(bptree##width##_t *tree);                                                              \
+    size_t bptree##width##_scan(bptree##width##_t *tree, key_type lo, key_type hi, bptree##width##_scan_fn fn,           \
+                                void *ctx);                                                                              \
+    bptree##width##_snapshot_t *bptree##width##_snapshot(bptree##width##_t *tree);                                       \
+    bool bptree##width##_snapshot_get(bptree##width##_snapshot_t *snapshot, key_type key, value_t *result);              \
+    size_t bptree##width##_snapshot_scan(bptree##width##_snapshot_t *snapshot, key_type lo, key_type hi,                 \
+                                         bptree##width##_scan_fn fn, void *ctx);                                         \
+    void bptree##width##_snapshot_release(bptree##width##_snapshot_t *snapshot);                                         \
+    void bptree##width##_bulk_load(bptree##width##_t *tree, const key_type *keys, const value_t *values, size_t n,       \
+                                   float fill_factor);                                                                   \
+    void bptree##width##_bulk_load_parallel(bptree##width##_t *tree, const key_type *keys, const value_t *values,        \
+                                            size_t n, float fill_factor, int num_threads);                               \
+    bool bptree##width##_save(bptree##width##_t *tree, const char *path);                                                \
+    bool bptree##width##_open_mmap(bptree##width##_t *tree, const char *path, bptree_simd_t simd,                        \
+                                   bptree_write_mode_t write_mode);                                                      \
+    bool bptree##width##_wal_open(bptree##width##_t *tree, const char *path);                                            \
+    int bptree##width##_wal_error(bptree##width##_t *tree);                                                              \
+    bool bptree##width##_checkpoint_open(bptree##width##_t *tree, const char *path);                                     \
+    bool bptree##width##_checkpoint(bptree##width##_t *tree);                                                            \
+    void bptree##width##_free(bptree##width##_t *tree);
+
+/**
+ * @brief declares the tree type and functions for one key width
+ *
+ * @param width key width in bits (8, 16, 32 or 64)
+ * @param key_type signed integer type of the keys
+ */
+#define BPTREE_DECLARE(width, key_type) BPTREE_DECLARE_TYPES(width, key_type) BPTREE_DECLARE_FUNCTIONS(width, key_type)
+
+// bptree.c includes this header for the width it is compiled for, so its
+// definitions are checked against the functions declared here. The tree
+// type of that width is the bptree_t of bptree.h, the one declared here
+// has to be laid out the same way.
+#define BPTREE_CHECK_FIELD(width, field)                                                                                 \
+    _Static_assert(offsetof(struct bptree##width##_layout_t, field) == offsetof(bptree##width##_t, field),               \
+                   "offset of " #field " in bptree" #width "_t");
+
+#define BPTREE_CHECK_LAYOUT(width)                                                                                       \
+    struct bptree##width##_layout_t                                                                                      \
+    {                                                                                                                    \
+        BPTREE_FIELDS(struct bptree##width##_node_t, bptree##width##_find_index_fn)                                      \
+    };                                                                                                                   \
+    _Static_assert(sizeof(struct bptree##width##_layout_t) == sizeof(bptree##width##_t), "size of bptree" #width "_t");  \
+    _Static_assert(_Alignof(struct bptree##width##_layout_t) == _Alignof(bptree##width##_t),                             \
+                   "alignment of bptree" #width "_t");                                                                   \
+    BPTREE_CHECK_FIELD(width, root)                                                                                      \
+    BPTREE_CHECK_FIELD(width, root_latch)                                                                                \
+    BPTREE_CHECK_FIELD(width, mem)                                                                                       \
+    BPTREE_CHECK_FIELD(width, simd)                                                                                      \
+    BPTREE_CHECK_FIELD(width, find)                                                                                      \
+    BPTREE_CHECK_FIELD(width, write_mode)
+
+#if defined(BPTREE_WIDTH) && BPTREE_WIDTH == 8
+BPTREE_CHECK_LAYOUT(8)
+BPTREE_DECLARE_FUNCTIONS(8, int8_t)
+#else
+BPTREE_DECLARE(8, int8_t)
+#endif
+
+#if defined(BPTREE_WIDTH) && BPTREE_WIDTH == 16
+BPTREE_CHECK_LAYOUT(16)
+BPTREE_DECLARE_FUNCTIONS(16, int16_t)
+#else
+BPTREE_DECLARE(16, int16_t)
+#endif
+
+#if defined(BPTREE_WIDTH) && BPTREE_WIDTH == 32
+BPTREE_CHECK_LAYOUT(32)
+BPTREE_DECLARE_FUNCTIONS(32, int32_t)
+#else
+BPTREE_DECLARE(32, int32_t)
+#endif
+
+#if defined(BPTREE_WIDTH) && BPTREE_WIDTH == 64
+BPTREE_CHECK_LAYOUT(64)
+BPTREE_DECLARE_FUNCTIONS(64, int64_t)
+#else
+BPTREE_DECLARE(64, int64_t)
+#endif
@@ -0,0 +1,171 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+// Append-only file of incremental checkpoints of a tree.
+//
+// Every node that was written to the file has an id. A checkpoint appends
+// one segment with the records of the nodes that are new or were changed
+// since the last checkpoint, followed by the id of the root. Unchanged nodes
+// are referenced by their id, so a checkpoint writes bytes in proportion to
+// the changes and not to the size of the tree. The last record of an id in
+// the file is its current version.
+//
+// Ids that are no longer reachable from the root are reused. Once the file
+// is more than twice as large as the records reachable from the root, a
+// thread copies these records into a new file, appends the segments that
+// were written in the meantime and replaces the file (compaction).
+//
+// Every segment has a checksum. A segment that was written only partly is
+// cut off when the file is opened.
+
+// records of a checkpoint start at multiples of this
+#define CHECKPOINT_ALIGN 8
+
+// header of a segment, followed by len bytes of records
+typedef struct checkpoint_segment_t
+{
+    uint64_t magic;
+    uint64_t len;
+    uint32_t checksum;
+
+    // layout of the records (see checkpoint_open)
+    uint32_t format;
+
+    // id of the root node (0 for an empty tree)
+    uint32_t root;
+
+    // ids below next_id are either used or free
+    uint32_t next_id;
+} checkpoint_segment_t;
+
+// header of the record of a node. Inner nodes continue with the ids
+// of their n + 1 children, the rest of the record is up to the tree.
+typedef struct checkpoint_record_t
+{
+    uint32_t id;
+
+    // length of the record including the header (multiple of CHECKPOINT_ALIGN)
+    uint32_t len;
+
+    uint16_t n;
+    bool is_leaf;
+    uint8_t flags;
+} checkpoint_record_t;
+
+// writes a region of a file through a buffer and sums up its checksum
+typedef struct checkpoint_writer_t
+{
+    int fd;
+
+    // offset of the region in the file and bytes added to it
+    uint64_t start;
+    uint64_t len;
+
+    char *buf;
+    size_t buf_len;
+    uint32_t checksum;
+
+    // false once a write failed
+    bool ok;
+} checkpoint_writer_t;
+
+typedef struct checkpoint_t
+{
+    int fd;
+    char *path;
+    uint32_t format;
+
+    // held while a segment is written and while a compaction replaces the file
+    pthread_mutex_t lock;
+
+    // end of the last complete segment
+    uint64_t size;
+
+    // root of the last checkpoint
+    uint32_t root;
+
+    // for every id: the length of its record if it is reachable from the
+    // root (0 if the id is free) and the last checkpoint that reached it
+    uint32_t next_id;
+    uint32_t *sizes;
+    uint32_t *seen;
+    size_t cap;
+    uint32_t stamp;
+
+    // bytes of the records reachable from the root
+    uint64_t live_bytes;
+
+    // ids that can be reused
+    uint32_t *free_ids;
+    size_t num_free;
+    size_t free_cap;
+
+    // records of the segment that is written (see checkpoint_begin)
+    checkpoint_writer_t segment;
+
+    // ids allocated for the segment, freed again if it can not be written
+    uint32_t *new_ids;
+    size_t num_new;
+    size_t new_cap;
+
+    // file mapped by checkpoint_open until checkpoint_load_end
+    char *map;
+    size_t map_size;
+    uint64_t *offsets;
+
+    // a thread compacts the file, done is set once it finished
+    pthread_t compactor;
+    bool compacting;
+    bool compact_done;
+    uint64_t num_compactions;
+} checkpoint_t;
+
+/**
+ * @brief opens a checkpoint file (it is created if it does not exist) and
+ * maps it, so the records of the last checkpoint can be read with
+ * checkpoint_record until checkpoint_load_end is called.
+ *
+ * @param c checkpoint file
+ * @param path file
+ * @param format layout of the records, a file written with another format is not opened
+ * @return true on success, c->root is the id of the root (0 if the file is empty)
+ * @return false if the file could not be opened or has another format (see errno)
+ */
+bool checkpoint_open(checkpoint_t *c, const char *path, uint32_t format);
+
+// returns the current record of an id (between checkpoint_open and checkpoint_load_end)
+const checkpoint_record_t *checkpoint_record(checkpoint_t *c, uint32_t id);
+
+// unmaps the file after it was loaded
+void checkpoint_load_end(checkpoint_t *c);
+
+// starts a new checkpoint. Nodes are reported with checkpoint_add
+// and checkpoint_keep, then checkpoint_commit writes the segment.
+void checkpoint_begin(checkpoint_t *c);
+
+// returns an unused id for a node that was never written
+uint32_t checkpoint_new_id(checkpoint_t *c);
+
+// adds the record of a new or changed node to the checkpoint
+void checkpoint_add(checkpoint_t *c, const checkpoint_record_t *rec);
+
+// reports a node that did not change since its record was written
+void checkpoint_keep(checkpoint_t *c, uint32_t id);
+
+/**
+ * @brief writes the segment of the checkpoint and waits until it is on disk.
+ * Ids that were not reached by the checkpoint are freed. May start a
+ * compaction of the file.
+ *
+ * @param c checkpoint file
+ * @param root id of the root (0 for an empty tree)
+ * @return true on success
+ * @return false if the segment could not be written (the file still holds the last checkpoint)
+ */
+bool checkpoint_commit(checkpoint_t *c, uint32_t root);
+
+// waits for a running compaction and closes the file
+void checkpoint_close(checkpoint_t *c);
@@ -0,0 +1,141 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+// Epoch based memory reclamation (EBR).
+//
+// Readers announce that they are accessing shared memory with
+// epoch_enter/epoch_exit. Writers unlink objects first and then hand
+// them to epoch_retire. A retired object is put on a per-thread limbo
+// list and is only freed once the global epoch advanced twice, which
+// guarantees that no reader that could have seen the object is still
+// active. Writers never wait for readers.
+
+// number of limbo lists per thread (objects of epoch e are stored in list e % 3)
+#define EPOCH_LIMBO_LISTS 3
+
+// number of objects a thread retires before it tries
+// to advance the global epoch and free its limbo lists
+#define EPOCH_BATCH_SIZE 64
+
+// number of epoch domains a thread can access without
+// looking up its record in the domain's record list
+#define EPOCH_TLS_SLOTS 8
+
+/**
+ * @brief function called to free a retired object
+ *
+ * @param ptr retired object
+ * @param ctx context pointer of the epoch domain (see epoch_init)
+ */
+typedef void (*epoch_free_fn)(void *ptr, void *ctx);
+
+typedef struct epoch_entry_t
+{
+    void *ptr;
+    epoch_free_fn free_fn;
+} epoch_entry_t;
+
+// objects retired by one thread within one epoch
+typedef struct epoch_limbo_t
+{
+    epoch_entry_t *entries;
+    size_t n;
+    size_t cap;
+    uint64_t epoch;
+} epoch_limbo_t;
+
+// state of a thread within an epoch domain.
+// Aligned to a cache line so entering and leaving a critical
+// section only writes to memory owned by the thread itself.
+typedef struct epoch_record_t
+{
+    // (epoch << 1) | active
+    uint64_t __attribute__((aligned(64))) local;
+
+    // number of nested epoch_enter calls
+    uint32_t nesting;
+
+    // number of retired objects in the limbo lists
+    size_t pending;
+
+    pthread_t owner;
+
+    // the record belongs to epoch_pin and not to a thread
+    bool is_pin;
+
+    // the thread of the record exited. The next thread that enters the
+    // domain takes the record over with the objects left in its lists.
+    bool released;
+
+    epoch_limbo_t limbo[EPOCH_LIMBO_LISTS];
+
+    // next record in the domain's record list
+    struct epoch_record_t *next;
+} epoch_record_t;
+
+// an epoch domain. Every data structure owns its own domain.
+typedef struct epoch_t
+{
+    // global epoch, only advanced if all active threads observed it
+    uint64_t __attribute__((aligned(64))) global;
+
+    // list of all threads that ever accessed the domain
+    epoch_record_t *records;
+
+    // unique id used to cache thread records in thread local storage
+    uint64_t id;
+
+    // context passed to the epoch_free_fn of retired objects
+    void *ctx;
+
+    // next domain in the list of live domains, which exiting
+    // threads search for their records
+    struct epoch_t *next;
+} epoch_t;
+
+/**
+ * @brief initializes an epoch domain
+ *
+ * @param e pointer to domain
+ * @param ctx context pointer that is passed to every epoch_free_fn
+ */
+void epoch_init(epoch_t *e, void *ctx);
+
+// enters a critical section. Objects that are reachable when entering
+// are not freed until epoch_exit is called. Calls can be nested.
+void epoch_enter(epoch_t *e);
+
+// leaves a critical section
+void epoch_exit(epoch_t *e);
+
+/**
+ * @brief pins the domain independent of the calling thread: objects that
+ * are reachable now are not freed until epoch_unpin is called. Retired
+ * objects pile up meanwhile, so pins should not be held forever.
+ *
+ * @param e epoch domain
+ * @return epoch_record_t* the pin that has to be passed to epoch_unpin
+ */
+epoch_record_t *epoch_pin(epoch_t *e);
+
+// releases a pin returned by epoch_pin
+void epoch_unpin(epoch_t *e, epoch_record_t *pin);
+
+/**
+ * @brief retires an object. The object must not be reachable for
+ * threads that enter the domain afterwards.
+ * free_fn is called once no thread can hold a reference to it anymore.
+ *
+ * @param e epoch domain
+ * @param ptr object that is retired
+ * @param free_fn function that frees the object
+ */
+void epoch_retire(epoch_t *e, void *ptr, epoch_free_fn free_fn);
+
+// frees all retired objects and thread records.
+// No thread must be within a critical section.
+// Records of threads that exit are released for new threads before.
+void epoch_destroy(epoch_t *e);
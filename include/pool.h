@@ -0,0 +1,104 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "spinlock.h"
+
+// Fixed size object pool (slab allocator).
+//
+// Objects are carved out of large slabs that are owned by the pool,
+// so destroying the pool releases all objects at once. Every thread
+// allocates from and frees to its own cache. Caches only synchronize
+// when they exchange a whole batch of free objects with the pool or
+// need a new slab. The caches of exiting threads are released: new
+// threads take them over and other threads adopt their objects.
+
+// size of a slab in bytes
+#define POOL_SLAB_SIZE (1 << 20)
+
+// number of free objects a thread cache keeps before
+// it hands them to the pool as one batch
+#define POOL_BATCH_SIZE 256
+
+// number of pools a thread can access without
+// looking up its cache in the pool's cache list.
+// A tree uses 10 pools with consecutive ids (nodes, links and the
+// value classes), so the pools of a few trees never share a slot.
+#define POOL_TLS_SLOTS 32
+
+// a free object
+typedef struct pool_object_t
+{
+    // next free object within the same batch
+    struct pool_object_t *next;
+
+    // next batch (only used by the first object of a batch)
+    struct pool_object_t *next_batch;
+} pool_object_t;
+
+// objects owned by one thread.
+// Aligned to a cache line to avoid false sharing between threads.
+typedef struct pool_cache_t
+{
+    // free objects
+    pool_object_t *__attribute__((aligned(64))) free;
+    size_t n;
+
+    // unused part of the slab the thread allocates from
+    char *bump;
+    char *end;
+
+    pthread_t owner;
+
+    // the thread of the cache exited. The next thread that accesses the
+    // pool takes the cache over, until then its objects can be adopted.
+    bool released;
+
+    // next cache in the pool's cache list
+    struct pool_cache_t *next;
+} pool_cache_t;
+
+typedef struct pool_t
+{
+    // size of a slot. Multiple of the alignment.
+    size_t slot_size;
+    size_t align;
+
+    // all slabs, linked through their first slot
+    void *slabs;
+
+    // batches of free objects returned by thread caches
+    pool_object_t *batches;
+    pthread_spinlock_t lock;
+
+    // list of all threads that ever accessed the pool
+    pool_cache_t *caches;
+
+    // unique id used to cache thread caches in thread local storage
+    uint64_t id;
+
+    // next pool in the list of live pools, which exiting
+    // threads walk to release their caches
+    struct pool_t *next;
+} pool_t;
+
+/**
+ * @brief initializes a pool
+ *
+ * @param p pointer to pool
+ * @param obj_size size of the objects in bytes
+ * @param align alignment of the objects (power of two)
+ */
+void pool_init(pool_t *p, size_t obj_size, size_t align);
+
+// returns an uninitialized object
+void *pool_alloc(pool_t *p);
+
+// returns an object to the pool. Can be called by any thread.
+void pool_free(pool_t *p, void *ptr);
+
+// releases all slabs (and with them all objects) at once.
+// Unlinks the pool from the live pools.
+// No thread must access the pool anymore.
+void pool_destroy(pool_t *p);
@@ -0,0 +1,75 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "pool.h"
+
+// Storage for variable size values.
+//
+// A value is encoded in one word (the value_t of the trees). Values of up to
+// VALUE_INLINE_MAX bytes are stored in the word itself and live in the leaf
+// without any allocation (lowest bit set). Larger values are copied into a
+// blob that is allocated from the pool of the smallest size class that fits
+// (malloc beyond the largest class) and the word holds the blob pointer.
+// Blobs are never modified, so all clones of a leaf can share them.
+
+// values up to this size are stored inline (one byte holds the length)
+#define VALUE_INLINE_MAX (sizeof(uintptr_t) - 1)
+
+// pools for blobs of 16, 32, ... 16 << (VALUE_CLASSES - 1) bytes
+#define VALUE_CLASSES 8
+
+// a value stored out of line
+typedef struct value_blob_t
+{
+    uint32_t len;
+    char data[];
+} value_blob_t;
+
+typedef struct value_store_t
+{
+    pool_t classes[VALUE_CLASSES];
+} value_store_t;
+
+// zero-copy view of a value. Inline values are copied into the view,
+// so it must not be copied itself.
+typedef struct value_view_t
+{
+    const void *data;
+    size_t len;
+    char inline_data[sizeof(uintptr_t)];
+} value_view_t;
+
+void value_store_init(value_store_t *s);
+
+/**
+ * @brief stores a value and returns its encoding
+ *
+ * @param s value store
+ * @param data the value
+ * @param len length of the value in bytes (less than 4 GiB)
+ * @return uintptr_t encoded value, never 0
+ */
+uintptr_t value_store_put(value_store_t *s, const void *data, size_t len);
+
+/**
+ * @brief makes a view of an encoded value.
+ * The view stays valid as long as the blob of the value is not freed.
+ *
+ * @param value encoded value (see value_store_put)
+ * @param view view that is filled
+ */
+void value_store_view(uintptr_t value, value_view_t *view);
+
+// returns the blob of an encoded value, NULL if the value is stored inline
+static inline value_blob_t *value_store_blob(uintptr_t value)
+{
+    return value & 1 ? NULL : (value_blob_t *)value;
+}
+
+// frees a blob. Can be called by any thread.
+void value_store_free(value_store_t *s, value_blob_t *blob);
+
+// releases the pools of the store. Blobs larger than the
+// largest class have to be freed with value_store_free before.
+void value_store_destroy(value_store_t *s);
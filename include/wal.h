@@ -0,0 +1,115 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+// Append-only write-ahead log with group commit.
+//
+// Writers append records to an in-memory buffer and then wait until the
+// log is durable up to their record (wal_sync). The first waiting writer
+// becomes the leader: it takes the whole buffer, writes it and calls
+// fdatasync once for all records in it, while the other writers keep
+// appending to a second buffer. So concurrent writers share one sync.
+//
+// Every record is framed by its length and a checksum. A crash can leave
+// a partly written record at the end of the file, it is cut off when the
+// log is opened again.
+//
+// A failed write or sync is sticky: the records that were not durable
+// before are lost and no later record becomes durable.
+
+// frame of a record in the log file
+typedef struct wal_record_t
+{
+    uint32_t len;
+    uint32_t checksum;
+} wal_record_t;
+
+typedef struct wal_t
+{
+    int fd;
+
+    // protects all fields below
+    pthread_mutex_t lock;
+
+    // signalled when durable advances
+    pthread_cond_t synced;
+
+    // records that are not written yet
+    char *buf;
+    size_t len;
+    size_t cap;
+
+    // buffer written by the leader
+    char *spare;
+    size_t spare_cap;
+
+    // log sequence numbers count the bytes appended to the log
+    // (see wal_truncate). appended is the end of the last record,
+    // all records before durable are on disk
+    uint64_t appended;
+    uint64_t durable;
+
+    // a leader is writing the spare buffer
+    bool flushing;
+
+    // errno of the first failed write, sync or truncate (0 if none failed)
+    int error;
+
+    // number of records and syncs for statistics
+    uint64_t num_records;
+    uint64_t num_syncs;
+} wal_t;
+
+/**
+ * @brief called for every record of the log by wal_open
+ *
+ * @param rec the record
+ * @param len length of the record in bytes
+ * @param ctx context passed to wal_open
+ */
+typedef void (*wal_replay_fn)(const void *rec, size_t len, void *ctx);
+
+/**
+ * @brief opens a log file (it is created if it does not exist), replays
+ * its records and cuts off a torn record at the end.
+ *
+ * @param w log
+ * @param path log file
+ * @param fn called for every record in the order they were appended
+ * @param ctx passed to fn
+ * @return true on success
+ * @return false if the file could not be opened (see errno)
+ */
+bool wal_open(wal_t *w, const char *path, wal_replay_fn fn, void *ctx);
+
+/**
+ * @brief appends a record that consists of two parts.
+ * The record is durable once wal_sync returned true for the returned lsn.
+ * Only the lsn is counted once the log failed.
+ *
+ * @param w log
+ * @param head first part of the record
+ * @param head_len length of head
+ * @param data second part of the record (can be NULL if data_len is 0)
+ * @param data_len length of data
+ * @return uint64_t lsn of the end of the record
+ */
+uint64_t wal_append(wal_t *w, const void *head, size_t head_len, const void *data, size_t data_len);
+
+// waits until all records up to lsn are on disk (group commit).
+// Returns false if they are not and never will be (see error).
+bool wal_sync(wal_t *w, uint64_t lsn);
+
+// syncs all records and removes them from the file, e.g. once they are
+// part of a checkpoint. No writer may append concurrently.
+// Returns false if the sync or the truncation failed (see error).
+bool wal_truncate(wal_t *w);
+
+// syncs all records and closes the log.
+// Returns false if not all records are on disk.
+bool wal_close(wal_t *w);
+
+// returns the errno of the failure of the log or 0 if it did not fail
+int wal_error(wal_t *w);
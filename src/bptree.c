@@ -1,4 +1,3 @@
-#pragma GCC target "avx2", "bmi2"
 #include <stdio.h>
 #include <stdbool.h>
 #include <string.h>
@@ -6,15 +5,32 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <pthread.h>
+#include <sched.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "bptree.h"
 #include "spinlock.h"
+#include "epoch.h"
+#include "pool.h"
+#include "wal.h"
+#include "checkpoint.h"
+#ifdef BPTREE_WIDTH
+// checks the definitions against the declarations of the typed trees
+#include "bptree_typed.h"
+#endif
+
+// the kernels are compiled for their instruction set only,
+// so the rest of the tree runs on every x86-64 cpu
+#define TARGET_AVX2 __attribute__((target("avx2,bmi2")))
+#define TARGET_AVX512 __attribute__((target("avx512f,avx512bw")))
 
 // macros for atomic operations
-#define atomic_inc(a) __atomic_fetch_add(a, 1, __ATOMIC_RELAXED)
-#define atomic_dec(a) __atomic_fetch_sub(a, 1, __ATOMIC_RELAXED)
-#define atomic_exchange(a, b) __atomic_exchange_n(a, b, __ATOMIC_RELAXED)
-#define atomic_store(a, b) __atomic_store_n(a, b, __ATOMIC_RELAXED)
+#define atomic_exchange(a, b) __atomic_exchange_n(a, b, __ATOMIC_RELEASE)
+#define atomic_store(a, b) __atomic_store_n(a, b, __ATOMIC_RELEASE)
+#define atomic_load(a) __atomic_load_n(a, __ATOMIC_ACQUIRE)
 
 // macros for memcopy/move operations
 // uses the size of destionatio type as unit size
@@ -22,58 +38,263 @@
 #define memcpy_sized(dst, src, n) memcpy(dst, src, (n) * sizeof(*(dst)))
 #define memmove_sized(dst, src, n) memmove(dst, src, (n) * sizeof(*(dst)))
 
-node_t *node_create(bool is_leaf)
+node_t *node_create(bool is_leaf, bptree_mem_t *mem)
 {
-    node_t *n = aligned_alloc(32, sizeof(node_t));
+    node_t *n = pool_alloc(&mem->nodes);
+    n->version = 0;
+    n->latch = 0;
+    n->checkpoint_id = 0;
+    n->generation = mem->generation;
     n->n = 0;
     n->is_leaf = is_leaf;
+    if (is_leaf)
+        n->children.link = NULL;
     for (int i = 0; i < ORDER - 1; i++)
         n->keys[i] = KEY_T_MAX;
-    n->rc_cnt = 0;
     return n;
 }
 
 // clones a node and returns the pointer to node
-// reference counter in clone is set to zerop
-node_t *node_clone(node_t *node)
+node_t *node_clone(node_t *node, bptree_mem_t *mem)
 {
-    node_t *clone = aligned_alloc(32, sizeof(node_t));
+    node_t *clone = pool_alloc(&mem->nodes);
     memcpy_sized(clone, node, 1);
-    clone->rc_cnt = 0;
+    clone->version = 0;
+    clone->latch = 0;
+    clone->checkpoint_id = 0;
+    clone->generation = mem->generation;
     return clone;
 }
 
 /**
- * @brief safe acccess to a node with reference counting.
- * Makes sure not is not freed while node is accessed.
- * Call exit_node when node is no longer accessed.
+ * @brief starts an optimistic read of a node.
+ * Waits until no in place modification of the node is in progress.
  * 
- * @param node location where pointer to node is stored
- * @param inc_ops see BPTREE_SECURE_NODE_ACCESS
- * @return node_t* pointer to node 
+ * @param n node
+ * @return uint64_t version that has to be passed to node_read_validate
  */
-static inline node_t *node_access(node_t **node, uint64_t *inc_ops)
+static inline uint64_t node_read_begin(node_t *n)
 {
+    uint64_t version;
+    while ((version = __atomic_load_n(&n->version, __ATOMIC_ACQUIRE)) & 1)
+        _mm_pause();
+    return version;
+}
 
-#ifdef BPTREE_SECURE_NODE_ACCESS
-    atomic_inc(inc_ops);
-#endif
+// returns true if the node was not modified since node_read_begin returned version
+static inline bool node_read_validate(node_t *n, uint64_t version)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&n->version, __ATOMIC_RELAXED) == version;
+}
+
+// marks a node that is modified in place, so the next checkpoint writes it again
+static inline void node_mark_dirty(node_t *n)
+{
+    n->checkpoint_id |= NODE_DIRTY;
+}
 
-    node_t *n = *node;
-    atomic_inc(&n->rc_cnt);
+// marks the start of an in place modification of a node (version becomes odd)
+static inline void node_write_begin(node_t *n)
+{
+    node_mark_dirty(n);
+    __atomic_fetch_add(&n->version, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
 
-#ifdef BPTREE_SECURE_NODE_ACCESS
-    atomic_dec(inc_ops);
-#endif
+// marks the end of an in place modification of a node (version becomes even)
+static inline void node_write_end(node_t *n)
+{
+    __atomic_fetch_add(&n->version, 1, __ATOMIC_RELEASE);
+}
 
-    return n;
+static inline bool node_is_obsolete(node_t *n)
+{
+    return __atomic_load_n(&n->version, __ATOMIC_ACQUIRE) & NODE_OBSOLETE;
+}
+
+// has to be called before a node is replaced by a clone
+static inline void node_mark_obsolete(node_t *n)
+{
+    __atomic_fetch_or(&n->version, NODE_OBSOLETE, __ATOMIC_RELEASE);
+}
+
+// creates the cell of a new leaf in the list of leaves
+static leaf_link_t *leaf_link_create(node_t *leaf, leaf_link_t *next, bptree_mem_t *mem)
+{
+    leaf_link_t *link = pool_alloc(&mem->links);
+    link->leaf = leaf;
+    link->next = next;
+    link->dead = false;
+    return link;
+}
+
+// makes a clone of a leaf visible in the list of leaves.
+// The old version has to be marked obsolete before.
+static inline void leaf_publish(node_t *clone)
+{
+    atomic_store(&clone->children.link->leaf, clone);
+}
+
+// returns true if ptr lies within the snapshot the tree was opened from
+static inline bool mem_in_image(bptree_mem_t *mem, void *ptr)
+{
+    return (char *)ptr >= mem->image && (char *)ptr < mem->image + mem->image_size;
+}
+
+// epoch_free_fn for nodes, ctx is the memory of the tree
+static void node_reclaim(void *node, void *ctx)
+{
+    if (!mem_in_image(ctx, node))
+        pool_free(&((bptree_mem_t *)ctx)->nodes, node);
+}
+
+// epoch_free_fn for leaf links
+static void leaf_link_reclaim(void *link, void *ctx)
+{
+    if (!mem_in_image(ctx, link))
+        pool_free(&((bptree_mem_t *)ctx)->links, link);
+}
+
+// epoch_free_fn for blobs of replaced and deleted values
+static void value_reclaim(void *blob, void *ctx)
+{
+    if (!mem_in_image(ctx, blob))
+        value_store_free(&((bptree_mem_t *)ctx)->values, blob);
+}
+
+// retires a value that was replaced or deleted if it is held by the value store
+static inline void value_retire(value_t value, bptree_mem_t *mem)
+{
+    value_blob_t *blob = value_store_blob(value);
+    if (__atomic_load_n(&mem->owns_values, __ATOMIC_RELAXED) && blob != NULL)
+        epoch_retire(&mem->epoch, blob, value_reclaim);
+}
+
+// operations in the write-ahead log
+#define LOG_INSERT 0
+#define LOG_PUT 1
+#define LOG_DELETE 2
+
+// log record of a write. The bytes of the value follow for LOG_PUT.
+typedef struct __attribute__((packed)) log_head_t
+{
+    uint8_t op;
+    bp_key_t key;
+    value_t value;
+} log_head_t;
+
+// appends the record of a write to the log of the tree (if it has one).
+// Called with the leaf of the key latched.
+static inline void log_write(bptree_mem_t *mem, uint8_t op, bp_key_t key, value_t value, write_info_t *info)
+{
+    if (mem->wal == NULL)
+        return;
+    log_head_t head = {op, key, value};
+    if (op == LOG_INSERT && mem->owns_values)
+    {
+        // the value is stored again when the log is replayed
+        value_view_t view;
+        value_store_view(value, &view);
+        head.op = LOG_PUT;
+        head.value = 0;
+        info->lsn = wal_append(mem->wal, &head, sizeof(head), view.data, view.len);
+    }
+    else
+        info->lsn = wal_append(mem->wal, &head, sizeof(head), NULL, 0);
+}
+
+// hands a node that is no longer reachable to the epoch domain.
+// It is freed once no reader can access it anymore.
+static inline void node_retire(node_t *node, bptree_mem_t *mem)
+{
+    node_mark_obsolete(node);
+    // appends must not find the node once it can be freed
+    if (atomic_load(&mem->tail) == node)
+        atomic_store(&mem->tail, NULL);
+    // the cell of a merged leaf is retired with its last version
+    if (node->is_leaf && node->children.link->dead && node->children.link->leaf == node)
+        epoch_retire(&mem->epoch, node->children.link, leaf_link_reclaim);
+    epoch_retire(&mem->epoch, node, node_reclaim);
+}
+
+// releases the latch of a parent once the child is known to not be replaced
+static inline void latch_release_parent(latch_t **parent_latch)
+{
+    if (*parent_latch != NULL)
+    {
+        latch_release(*parent_latch);
+        *parent_latch = NULL;
+    }
+}
+
+// returns true if a node can be part of a live snapshot (see bptree_snapshot).
+// Frozen nodes are never modified in place and only point to frozen nodes.
+static inline bool node_frozen(node_t *n, bptree_mem_t *mem)
+{
+    return n->generation < mem->frozen;
+}
+
+/**
+ * @brief replaces a frozen inner node by a clone once one of its children
+ * was replaced. The old child stays reachable through n until the clone is
+ * swapped in by a caller, so it is retired at the end of the write.
+ * 
+ * @param n frozen inner node, latched
+ * @param i index of the replaced child
+ * @param new_child clone of the child
+ * @param free_after nodes the child replaced besides itself (NULL entries are skipped)
+ * @param num_free_after number of entries in free_after
+ * @param info write that retires the replaced nodes
+ * @param mem memory of the tree
+ * @return node_t* clone of n
+ */
+static node_t *node_clone_frozen(node_t *n, uint16_t i, node_t *new_child, node_t **free_after, int num_free_after, write_info_t *info, bptree_mem_t *mem)
+{
+    node_t *n_clone = node_clone(n, mem);
+    info->retired[info->num_retired++] = n->children.nodes[i];
+    for (int j = 0; j < num_free_after; j++)
+        if (free_after[j] != NULL)
+            info->retired[info->num_retired++] = free_after[j];
+    n_clone->children.nodes[i] = new_child;
+    node_mark_obsolete(n);
+    latch_release(&n->latch);
+    return n_clone;
+}
+
+// starts a write: counts it as active and resets info
+static inline void write_begin(bptree_t *tree, write_info_t *info)
+{
+    info->old_value = 0;
+    info->lsn = 0;
+    info->update = NULL;
+    info->num_retired = 0;
+    epoch_enter(&tree->mem.epoch);
+    latch_acquire(&tree->root_latch);
+    __atomic_fetch_add(&tree->mem.writers, 1, __ATOMIC_RELAXED);
+}
+
+// ends a write started with write_begin. Nodes of the write are
+// reachable, the root latch must be released before.
+static inline void write_end(bptree_t *tree, write_info_t *info)
+{
+    for (int i = 0; i < info->num_retired; i++)
+        node_retire(info->retired[i], &tree->mem);
+    value_retire(info->old_value, &tree->mem);
+    __atomic_fetch_sub(&tree->mem.writers, 1, __ATOMIC_RELEASE);
+    epoch_exit(&tree->mem.epoch);
+    // a failed log is reported by bptree_wal_error
+    if (info->lsn != 0)
+        wal_sync(tree->mem.wal, info->lsn);
 }
 
-// exit a node by reducing its reference counter
-// so it can be freed if it is no longer needed
-static inline void exit_node(node_t *node)
+// computes the value of an update from the current value of the key.
+// Returns false if the key is left unchanged (see bptree_update_fn).
+static inline bool update_apply(write_info_t *info, value_t current, bool found, value_t *value)
 {
-    atomic_dec(&node->rc_cnt);
+    info->found = found;
+    *value = found ? current : 0;
+    return info->update(value, found, info->update_ctx);
 }
 
 /**
@@ -83,32 +304,76 @@ static inline void exit_node(node_t *node)
  * @param y_ptr pointer to list of keys
  * @return uint64_t bit mask (bit i is 1 if x_vec[i] > y_ptr[i])
  */
-static inline uint64_t cmp(__m256i x_vec, bp_key_t *y_ptr)
+static inline TARGET_AVX2 uint64_t cmp(__m256i x_vec, const bp_key_t *y_ptr)
 {
     __m256i y_vec = _mm256_load_si256((__m256i *)y_ptr);
     __m256i mask = _mm256_cmpgt_epi(x_vec, y_vec);
-    return _mm256_movemask(mask);
+    // movemask returns a signed int, do not sign extend it
+    return (uint32_t)_mm256_movemask(mask);
+}
+
+/**
+ * @brief first level of the search within a node. Finds the cache line
+ * that contains the result by comparing the last key of every line.
+ * Unused keys are KEY_T_MAX, so the line is never behind the result.
+ * 
+ * @param keys list of orderst keys (smallest first)
+ * @param key search key
+ * @return int first line whose last key is >= key (or the last line)
+ */
+static inline int find_line(const bp_key_t keys[ORDER - 1], bp_key_t key)
+{
+    int l = 0;
+    while (l < NODE_LINES - 1 && keys[(l + 1) * KEYS_PER_LINE - 1] < key)
+        l++;
+    return l;
 }
 
 /**
  * @brief AVX2 accelerated version of find_index.
+ * Compares the keys of one cache line (see find_line).
  * 
  * @param keys list of orderst keys (smallest first)
  * @param size number of keys
- * @param key search key as avx2 register (key repeated to fill 256bit register)
+ * @param key search key
  * @return uint16_t First index i where keys[i] >= key 
  */
-uint16_t find_index_avx2(bp_key_t keys[ORDER - 1], __m256i key)
+TARGET_AVX2 uint16_t find_index_avx2(const bp_key_t keys[ORDER - 1], int size, bp_key_t key)
 {
-    uint64_t mask = cmp(key, keys);
+    int l = find_line(keys, key);
+    const bp_key_t *line = keys + l * KEYS_PER_LINE;
+
+    __m256i key_vec = _mm256_set1_epi(key);
+    uint64_t mask = cmp(key_vec, line);
     // IMPORTANT: This second compare could only performed
     // if node->n > NUM_REG_VALUES.
     // BUT due to the introduced branching the performance
     // than is as good as the normal find_index version
-    mask += cmp(key, &keys[NUM_REG_VALUES]) << NUM_REG_VALUES;
-    int i = __builtin_ffs(~mask) - 1;
+    mask += cmp(key_vec, &line[NUM_REG_VALUES]) << NUM_REG_VALUES;
+    int i = __builtin_ffsll(~mask) - 1;
 
-    return i;
+    // all 64 bits set (1 byte keys larger than all keys)
+    return i < 0 ? ORDER - 1 : l * KEYS_PER_LINE + i;
+}
+
+/**
+ * @brief AVX-512 accelerated version of find_index.
+ * The keys of one cache line (see find_line) fill exactly one 512bit register.
+ * 
+ * @param keys list of orderst keys (smallest first)
+ * @param size number of keys
+ * @param key search key
+ * @return uint16_t First index i where keys[i] >= key 
+ */
+TARGET_AVX512 uint16_t find_index_avx512(const bp_key_t keys[ORDER - 1], int size, bp_key_t key)
+{
+    int l = find_line(keys, key);
+
+    __m512i key_vec = _mm512_set1_epi(key);
+    uint64_t mask = _mm512_cmpgt_epi_mask(key_vec, _mm512_loadu_si512(keys + l * KEYS_PER_LINE));
+    int i = __builtin_ffsll(~mask) - 1;
+
+    return i < 0 ? ORDER - 1 : l * KEYS_PER_LINE + i;
 }
 
 /**
@@ -120,34 +385,57 @@ uint16_t find_index_avx2(bp_key_t keys[ORDER - 1], __m256i key)
  * @param key search key
  * @return uint16_t First index i where keys[i] >= key 
  */
-uint16_t find_index(bp_key_t keys[ORDER - 1], int size, bp_key_t key)
+uint16_t find_index(const bp_key_t keys[ORDER - 1], int size, bp_key_t key)
 {
-    int i = 0;
+    int i = find_line(keys, key) * KEYS_PER_LINE;
     while (i < size && key > keys[i])
         i++;
     return i;
 }
 
-bool node_get(node_t *n, bp_key_t key, value_t *result, uint64_t *inc_ops, bool use_avx2)
+bptree_simd_t bptree_simd_resolve(bptree_simd_t simd)
+{
+    __builtin_cpu_init();
+    if (simd >= BPTREE_SIMD_AVX512 && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+        return BPTREE_SIMD_AVX512;
+    if (simd >= BPTREE_SIMD_AVX2 && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi2"))
+        return BPTREE_SIMD_AVX2;
+    return BPTREE_SIMD_NONE;
+}
+
+find_index_fn find_index_select(bptree_simd_t simd)
 {
-    __m256i cmp_key;
-    if (use_avx2)
-        cmp_key = _mm256_set1_epi(key);
+    switch (bptree_simd_resolve(simd))
+    {
+    case BPTREE_SIMD_AVX512:
+        return find_index_avx512;
+    case BPTREE_SIMD_AVX2:
+        return find_index_avx2;
+    default:
+        return find_index;
+    }
+}
 
+bool node_get(node_t *n, bp_key_t key, value_t *result, find_index_fn find)
+{
     while (true)
     {
-        uint16_t i;
-        if (use_avx2)
-            i = find_index_avx2(n->keys, cmp_key);
-        else
-            i = find_index(n->keys, n->n, key);
+        // leaves can be modified in place. The leaf is read
+        // optimistically and the read is repeated if its
+        // version changed in the meantime.
+        uint64_t version = n->is_leaf ? node_read_begin(n) : 0;
+
+        uint16_t i = find(n->keys, n->n, key);
 
-        bool eq = n->keys[i] == key;
+        // keys[n->n] is past the keys of a full node
+        bool eq = i < n->n && n->keys[i] == key;
         if (n->is_leaf)
         {
+            value_t value = eq ? n->children.values[i] : 0;
+            if (!node_read_validate(n, version))
+                continue;
             if (eq)
-                *result = n->children.values[i];
-            exit_node(n);
+                *result = value;
             return eq;
         }
         else
@@ -155,36 +443,86 @@ bool node_get(node_t *n, bp_key_t key, value_t *result, uint64_t *inc_ops, bool
             if (eq)
                 i++;
 
-            node_t *old = n;
-            n = node_access(&n->children.nodes[i], inc_ops);
-            exit_node(old);
+            n = atomic_load(&n->children.nodes[i]);
         }
     }
 }
 
+// returns the index of the child of an inner node that contains key
+static inline uint16_t node_child_index(node_t *n, bp_key_t key, find_index_fn find)
+{
+    uint16_t i = find(n->keys, n->n, key);
+
+    if (i < n->n && n->keys[i] == key)
+        i++;
+    return i;
+}
+
+// prefetches all cache lines of a node
+static inline void node_prefetch(node_t *n)
+{
+    for (size_t offset = 0; offset < sizeof(node_t); offset += DCACHE_LINESIZE)
+        __builtin_prefetch((char *)n + offset);
+}
+
 /**
- * @brief makes sure the node is only freed once 
- * its reference counter is down to zero.
- * Spins until node is freed. 
+ * @brief looks up a group of keys in lockstep. In every round each lookup
+ * descends one level and prefetches its next node, so the cache misses
+ * of the lookups overlap instead of being paid one after another.
  * 
- * @param node node to be freed
- * @param inc_ops see BPTREE_SECURE_NODE_ACCESS
+ * @param root root of the tree
+ * @param keys query keys
+ * @param n number of keys (at most BPTREE_GET_GROUP)
+ * @param results destination for the values
+ * @param found whether a key was found
+ * @param find implementation of find_index
+ * @return size_t number of keys found
  */
-void delayed_free(node_t *node, uint64_t *inc_ops)
+static size_t node_get_group(node_t *root, const bp_key_t *keys, size_t n, value_t *results, bool *found, find_index_fn find)
 {
-#ifdef BPTREE_SECURE_NODE_ACCESS
-    do
+    node_t *nodes[BPTREE_GET_GROUP];
+    for (size_t g = 0; g < n; g++)
+        nodes[g] = root;
+
+    bool done = false;
+    while (!done)
     {
-#endif
-        while (node->rc_cnt > 0)
-            ;
+        done = true;
+        for (size_t g = 0; g < n; g++)
+        {
+            // the node was prefetched in the last round
+            node_t *node = nodes[g];
+            if (node->is_leaf)
+                continue;
+            done = false;
 
-#ifdef BPTREE_SECURE_NODE_ACCESS
-    } while (*inc_ops > 0);
-#endif
-    free(node);
+            uint16_t i = node_child_index(node, keys[g], find);
+            node = atomic_load(&node->children.nodes[i]);
+            node_prefetch(node);
+            nodes[g] = node;
+        }
+    }
+
+    size_t count = 0;
+    for (size_t g = 0; g < n; g++)
+    {
+        found[g] = node_get(nodes[g], keys[g], &results[g], find);
+        count += found[g];
+    }
+    return count;
+}
+
+// sets all unused keys of a node to KEY_T_MAX
+static inline void node_clear_keys(node_t *n)
+{
+    for (int j = n->n; j < ORDER - 1; j++)
+        n->keys[j] = KEY_T_MAX;
 }
 
+// number of keys the right node gets when a node on the right edge of
+// the tree is split by an append. The left node stays about 90% full.
+#define APPEND_SPLIT_KEYS ((ORDER - 1) / 10 > 0 ? (ORDER - 1) / 10 : 1)
+
 /**
  * @brief split the node child and insert the promoted key into n at location i
  * IMPORTANT: n must not be full
@@ -192,17 +530,20 @@ void delayed_free(node_t *node, uint64_t *inc_ops)
  * @param n parent of child
  * @param i index where promoted key is inserted to into n
  * @param child node that is beeing split
+ * @param append whether the key that causes the split is above all keys of the tree.
+ * The right node then only gets APPEND_SPLIT_KEYS keys, since keys are only
+ * appended to it. An even split would leave half empty nodes behind.
  */
-void node_split(node_t *n, uint16_t i, node_t *child)
+void node_split(node_t *n, uint16_t i, node_t *child, bool append, bptree_mem_t *mem)
 {
-    node_t *right = node_create(child->is_leaf);
-
-    int min_deg = (ORDER + ORDER % 2) / 2;
+    node_t *right = node_create(child->is_leaf, mem);
 
     // is we split the child. its values have to be reinserted into right node
     // k makes sure all new values in the node are moved one to the right
     int k = child->is_leaf ? 1 : 0;
 
+    int min_deg = append ? ORDER - APPEND_SPLIT_KEYS - 1 + k : (ORDER + ORDER % 2) / 2;
+
     right->n = (ORDER - min_deg - 1) + k;
 
     if (child->is_leaf)
@@ -210,11 +551,21 @@ void node_split(node_t *n, uint16_t i, node_t *child)
     else
         memcpy_sized(right->children.nodes, child->children.nodes + min_deg, right->n + 1);
 
-    memcpy_sized(right->keys, child->keys + min_deg - k, right->n + k - 1);
+    memcpy_sized(right->keys, child->keys + min_deg - k, right->n);
 
     // Reduce the number of keys in y
     child->n = min_deg - 1;
 
+    if (child->is_leaf)
+    {
+        // link the right half behind the left half (the node
+        // child is a clone of must be marked obsolete already)
+        leaf_link_t *link = child->children.link;
+        right->children.link = leaf_link_create(right, link->next, mem);
+        leaf_publish(child);
+        atomic_store(&link->next, right->children.link);
+    }
+
     memmove_sized(n->children.nodes + i + 2, n->children.nodes + i + 1, n->n - i);
     // Link the new child to this node
     n->children.nodes[i + 1] = right;
@@ -226,58 +577,116 @@ void node_split(node_t *n, uint16_t i, node_t *child)
     // Copy the middle key of y to this node
     n->keys[i] = child->keys[min_deg - 1];
 
-    for (int j = child->n; j < ORDER - 1; j++)
-        child->keys[j] = KEY_T_MAX;
+    node_clear_keys(child);
 
     // Increment count of keys in this node
     n->n++;
 }
 
 /**
- * @brief writes new_node into target and frees old node stored earlier in target
+ * @brief writes new_node into target and retires old node stored earlier in target
  * 
  * @param new_node new node
  * @param target value to be swapped
- * @param free_after value that is freed after operation (if not NULL)
- * @param inc_ops see BPTREE_SECURE_NODE_ACCESS
+ * @param free_after node that is retired after operation (if not NULL)
+ * @param mem memory of the tree the nodes are retired to
  */
-void swap_and_free(node_t *new_node, node_t **target, node_t *free_after, uint64_t *inc_ops)
+void swap_and_retire(node_t *new_node, node_t **target, node_t *free_after, bptree_mem_t *mem)
 {
     if (new_node != NULL)
     {
         node_t *old_next = atomic_exchange(target, new_node);
-        delayed_free(old_next, inc_ops);
+        node_retire(old_next, mem);
         if (free_after != NULL)
-            delayed_free(free_after, inc_ops);
+            node_retire(free_after, mem);
     }
 }
 
-node_t *node_insert(node_t *n, bp_key_t key, value_t value, node_t **free_after, uint64_t *inc_ops, bool use_avx2)
+// makes the leaf a key was appended to below a split node known to appends
+// (see tree_append). Called once the new nodes are swapped in, while the
+// latch that protects the pointer to them is still held. So no writer
+// can replace the leaf before.
+static inline void tail_publish(write_info_t *info, bptree_mem_t *mem)
 {
-    uint16_t i;
-    if (use_avx2)
-        i = find_index_avx2(n->keys, _mm256_set1_epi(key));
-    else
-        i = find_index(n->keys, n->n, key);
+    if (info->tail != NULL)
+    {
+        atomic_store(&mem->tail, info->tail);
+        info->tail = NULL;
+    }
+}
+
+node_t *node_insert(node_t *n, bp_key_t key, value_t value, write_info_t *info, node_t **free_after, latch_t **parent_latch, bptree_mem_t *mem, bptree_write_mode_t mode, find_index_fn find)
+{
+    uint16_t i = find(n->keys, n->n, key);
 
-    bool eq = n->keys[i] == key;
+    bool eq = i < n->n && n->keys[i] == key;
     if (n->is_leaf)
     {
-        if (eq)
+        if (info->update != NULL && !update_apply(info, eq ? n->children.values[i] : 0, eq, &value))
+        {
+            latch_release_parent(parent_latch);
+            latch_release(&n->latch);
+            return NULL;
+        }
+        log_write(mem, LOG_INSERT, key, value, info);
+        // leaves of a snapshot are cloned
+        bool frozen = node_frozen(n, mem);
+        if (eq && !frozen)
+        {
+            latch_release_parent(parent_latch);
+            node_write_begin(n);
+            info->old_value = n->children.values[i];
+            n->children.values[i] = value;
+            node_write_end(n);
+            latch_release(&n->latch);
+            return NULL;
+        }
+        else if (mode != BPTREE_COPY_ON_WRITE && !frozen)
         {
+            // the caller made sure that n is not full
+            latch_release_parent(parent_latch);
+            node_write_begin(n);
+            memmove_sized(n->keys + i + 1, n->keys + i, n->n - i);
+            memmove_sized(n->children.values + i + 1, n->children.values + i, n->n - i);
+            n->keys[i] = key;
             n->children.values[i] = value;
+            n->n++;
+            node_write_end(n);
+            // keys above all keys are appended to n directly (see tree_append)
+            // until a key goes to another leaf
+            if (info->right_edge && i == n->n - 1)
+            {
+                if (info->split)
+                    info->tail = n;
+                else if (atomic_load(&mem->tail) != n)
+                    atomic_store(&mem->tail, n);
+            }
+            else if (!info->right_edge && atomic_load(&mem->tail) != NULL)
+                atomic_store(&mem->tail, NULL);
+            latch_release(&n->latch);
             return NULL;
         }
         else
         {
-            node_t *n_clone = node_clone(n);
-            // shift values to right an insert
-            memmove_sized(n_clone->keys + i + 1, n_clone->keys + i, n_clone->n - i);
-            memmove_sized(n_clone->children.values + i + 1, n_clone->children.values + i, n_clone->n - i);
+            node_t *n_clone = node_clone(n, mem);
+            if (eq)
+            {
+                info->old_value = n_clone->children.values[i];
+                n_clone->children.values[i] = value;
+            }
+            else
+            {
+                // shift values to right an insert
+                memmove_sized(n_clone->keys + i + 1, n_clone->keys + i, n_clone->n - i);
+                memmove_sized(n_clone->children.values + i + 1, n_clone->children.values + i, n_clone->n - i);
 
-            n_clone->keys[i] = key;
-            n_clone->children.values[i] = value;
-            n_clone->n++;
+                n_clone->keys[i] = key;
+                n_clone->children.values[i] = value;
+                n_clone->n++;
+            }
+            node_mark_obsolete(n);
+            leaf_publish(n_clone);
+            latch_release(&n->latch);
             return n_clone;
         }
     }
@@ -285,120 +694,2326 @@ node_t *node_insert(node_t *n, bp_key_t key, value_t value, node_t **free_after,
     {
         if (eq)
             i++;
+        info->right_edge &= i == n->n;
 
         node_t *to_split = n->children.nodes[i];
 
         // lock node we are eventually going to split
         // to make sure all possible ongoing insert
         // operations one this node are done
+        latch_acquire(&to_split->latch);
 
         if (to_split->n == ORDER - 1)
         {
-            node_t *n_clone = node_clone(n);
-            node_t *to_split_clone = node_clone(to_split);
+            node_t *n_clone = node_clone(n, mem);
+            node_t *to_split_clone = node_clone(to_split, mem);
             n_clone->children.nodes[i] = to_split_clone;
 
-            node_split(n_clone, i, to_split_clone);
+            node_mark_obsolete(to_split);
+            node_split(n_clone, i, to_split_clone, info->right_edge && to_split->keys[ORDER - 2] < key, mem);
+            info->split = true;
 
-            if (n_clone->keys[i] < key)
+            // n and to_split are replaced by their clones.
+            // Nobody waits for their latches, since this requires
+            // the parent latch which is still held
+            latch_release(&to_split->latch);
+            latch_release(&n->latch);
+
+            if (n_clone->keys[i] <= key)
                 i++;
+            info->right_edge &= i == n_clone->n;
             node_t *next = n_clone->children.nodes[i];
 
-            if (next != to_split)
-                *free_after = to_split;
+            *free_after = to_split;
+
+            // n_clone is not reachable for other threads yet
+            latch_t *clone_latch = NULL;
+            latch_acquire(&next->latch);
 
             node_t *free_after_2 = NULL;
-            node_t *new_next = node_insert(next, key, value, &free_after_2, inc_ops, use_avx2);
-            swap_and_free(new_next, &n_clone->children.nodes[i], free_after_2, inc_ops);
+            node_t *new_next = node_insert(next, key, value, info, &free_after_2, &clone_latch, mem, mode, find);
+            swap_and_retire(new_next, &n_clone->children.nodes[i], free_after_2, mem);
 
             return n_clone;
         }
         else
         {
+            // a child that is not full is never split, so n is
+            // not replaced unless it is part of a snapshot
+            bool frozen = node_frozen(n, mem);
+            if (!frozen)
+                latch_release_parent(parent_latch);
+            bool reachable = !info->split;
 
-            node_t *next = n->children.nodes[i];
+            node_t *next = to_split;
+            latch_t *n_latch = &n->latch;
 
             node_t *free_after_2 = NULL;
-            node_t *new_next = node_insert(next, key, value, &free_after_2, inc_ops, use_avx2);
-            swap_and_free(new_next, &n->children.nodes[i], free_after_2, inc_ops);
+            node_t *new_next = node_insert(next, key, value, info, &free_after_2, &n_latch, mem, mode, find);
+            if (frozen && new_next != NULL)
+                return node_clone_frozen(n, i, new_next, &free_after_2, 1, info, mem);
+            if (new_next != NULL)
+                node_mark_dirty(n);
+            swap_and_retire(new_next, &n->children.nodes[i], free_after_2, mem);
+            if (reachable)
+                tail_publish(info, mem);
+
+            if (n_latch != NULL)
+                latch_release(n_latch);
             return NULL;
         }
     }
 }
 
-void node_free(node_t *n)
+/**
+ * @brief moves one key from sibling into child (both children of n).
+ * sibling must have more than MIN_KEYS keys.
+ * 
+ * @param n parent of child and sibling
+ * @param i index of child in n
+ * @param child node that receives a key
+ * @param sibling left or right neighbour of child
+ * @param from_right whether sibling is the right neighbour
+ */
+static void node_borrow(node_t *n, uint16_t i, node_t *child, node_t *sibling, bool from_right)
 {
-    if (!n->is_leaf)
+    if (from_right)
     {
-        for (int i = 0; i < n->n + 1; i++)
-            node_free(n->children.nodes[i]);
+        if (child->is_leaf)
+        {
+            child->keys[child->n] = sibling->keys[0];
+            child->children.values[child->n] = sibling->children.values[0];
+            memmove_sized(sibling->children.values, sibling->children.values + 1, sibling->n - 1);
+        }
+        else
+        {
+            child->keys[child->n] = n->keys[i];
+            child->children.nodes[child->n + 1] = sibling->children.nodes[0];
+            n->keys[i] = sibling->keys[0];
+            memmove_sized(sibling->children.nodes, sibling->children.nodes + 1, sibling->n);
+        }
+        memmove_sized(sibling->keys, sibling->keys + 1, sibling->n - 1);
+        child->n++;
+        sibling->n--;
+        if (child->is_leaf)
+            n->keys[i] = sibling->keys[0];
+    }
+    else
+    {
+        memmove_sized(child->keys + 1, child->keys, child->n);
+        if (child->is_leaf)
+        {
+            memmove_sized(child->children.values + 1, child->children.values, child->n);
+            child->keys[0] = sibling->keys[sibling->n - 1];
+            child->children.values[0] = sibling->children.values[sibling->n - 1];
+            n->keys[i - 1] = child->keys[0];
+        }
+        else
+        {
+            memmove_sized(child->children.nodes + 1, child->children.nodes, child->n + 1);
+            child->keys[0] = n->keys[i - 1];
+            child->children.nodes[0] = sibling->children.nodes[sibling->n];
+            n->keys[i - 1] = sibling->keys[sibling->n - 1];
+        }
+        child->n++;
+        sibling->n--;
     }
-    free(n);
+    node_clear_keys(sibling);
 }
 
-void bptree_init(bptree_t *tree, bool use_avx2)
+/**
+ * @brief merges right into left and removes the key
+ * separating them (at index i) from their parent n.
+ * 
+ * @param n parent of left and right
+ * @param i index of left in n
+ * @param left left child (receives all keys)
+ * @param right right neighbour of left
+ */
+static void node_merge(node_t *n, uint16_t i, node_t *left, node_t *right)
 {
-    tree->root = NULL;
-    pthread_spin_init(&tree->lock, 0);
-    tree->inc_ops = 0;
-    tree->use_avx2 = use_avx2;
+    if (left->is_leaf)
+    {
+        memcpy_sized(left->keys + left->n, right->keys, right->n);
+        memcpy_sized(left->children.values + left->n, right->children.values, right->n);
+        left->n += right->n;
+    }
+    else
+    {
+        left->keys[left->n] = n->keys[i];
+        memcpy_sized(left->keys + left->n + 1, right->keys, right->n);
+        memcpy_sized(left->children.nodes + left->n + 1, right->children.nodes, right->n + 1);
+        left->n += right->n + 1;
+    }
+
+    memmove_sized(n->keys + i, n->keys + i + 1, n->n - i - 1);
+    memmove_sized(n->children.nodes + i + 1, n->children.nodes + i + 2, n->n - i - 1);
+    n->n--;
+    node_clear_keys(n);
 }
 
-bool bptree_get(bptree_t *tree, bp_key_t key, value_t *result)
+// swap_and_retire for the two nodes node_delete may replace besides n
+static void swap_and_retire_pair(node_t *new_node, node_t **target, node_t *free_after[2], bptree_mem_t *mem)
 {
-    bool found = false;
-    if (tree->root != NULL)
+    swap_and_retire(new_node, target, free_after[0], mem);
+    if (new_node != NULL && free_after[1] != NULL)
+        node_retire(free_after[1], mem);
+}
+
+node_t *node_delete(node_t *n, bp_key_t key, bool *found, write_info_t *info, node_t *free_after[2], latch_t **parent_latch, bptree_mem_t *mem, bptree_write_mode_t mode, find_index_fn find)
+{
+    uint16_t i = find(n->keys, n->n, key);
+
+    bool eq = i < n->n && n->keys[i] == key;
+    if (n->is_leaf)
+    {
+        *found = eq;
+        if (!eq)
+        {
+            latch_release_parent(parent_latch);
+            latch_release(&n->latch);
+            return NULL;
+        }
+        info->old_value = n->children.values[i];
+        log_write(mem, LOG_DELETE, key, 0, info);
+
+        // an empty root leaf is replaced, so the tree can shrink
+        if (mode != BPTREE_COPY_ON_WRITE && n->n > 1 && !node_frozen(n, mem))
+        {
+            latch_release_parent(parent_latch);
+            node_write_begin(n);
+            memmove_sized(n->keys + i, n->keys + i + 1, n->n - i - 1);
+            memmove_sized(n->children.values + i, n->children.values + i + 1, n->n - i - 1);
+            n->n--;
+            node_clear_keys(n);
+            node_write_end(n);
+            latch_release(&n->latch);
+            return NULL;
+        }
+
+        node_t *n_clone = node_clone(n, mem);
+        memmove_sized(n_clone->keys + i, n_clone->keys + i + 1, n_clone->n - i - 1);
+        memmove_sized(n_clone->children.values + i, n_clone->children.values + i + 1, n_clone->n - i - 1);
+        n_clone->n--;
+        node_clear_keys(n_clone);
+        node_mark_obsolete(n);
+        leaf_publish(n_clone);
+        latch_release(&n->latch);
+        return n_clone;
+    }
+
+    if (eq)
+        i++;
+
+    node_t *child = n->children.nodes[i];
+    latch_acquire(&child->latch);
+
+    if (child->n > MIN_KEYS)
     {
-        node_t *root = node_access(&tree->root, &tree->inc_ops);
-        found = node_get(root, key, result, &tree->inc_ops, tree->use_avx2);
+        // the child can lose a key without being fixed, so n is
+        // not replaced unless it is part of a snapshot
+        bool frozen = node_frozen(n, mem);
+        if (!frozen)
+            latch_release_parent(parent_latch);
+
+        latch_t *n_latch = &n->latch;
+        node_t *free_after_2[2] = {NULL, NULL};
+        node_t *new_child = node_delete(child, key, found, info, free_after_2, &n_latch, mem, mode, find);
+        if (frozen && new_child != NULL)
+            return node_clone_frozen(n, i, new_child, free_after_2, 2, info, mem);
+        if (new_child != NULL)
+            node_mark_dirty(n);
+        swap_and_retire_pair(new_child, &n->children.nodes[i], free_after_2, mem);
+
+        if (n_latch != NULL)
+            latch_release(n_latch);
+        return NULL;
     }
-    return found;
+
+    // child could underflow. Borrow a key from a sibling or merge
+    // with it. All changed nodes are cloned to keep readers safe.
+    bool from_right = i < n->n;
+    uint16_t j = from_right ? i + 1 : i - 1;
+    node_t *sibling = n->children.nodes[j];
+    latch_acquire(&sibling->latch);
+
+    node_t *n_clone = node_clone(n, mem);
+    node_t *child_clone = node_clone(child, mem);
+    node_t *sibling_clone = node_clone(sibling, mem);
+
+    // n, child and sibling are replaced by their clones. Updates latch
+    // leaves without their parent (see tree_update_leaf), so the
+    // children are marked obsolete before their latches are released
+    node_mark_obsolete(child);
+    node_mark_obsolete(sibling);
+    latch_release(&sibling->latch);
+    latch_release(&child->latch);
+    latch_release(&n->latch);
+    free_after[0] = child;
+    free_after[1] = sibling;
+
+    if (sibling->n > MIN_KEYS)
+    {
+        node_borrow(n_clone, i, child_clone, sibling_clone, from_right);
+        n_clone->children.nodes[i] = child_clone;
+        n_clone->children.nodes[j] = sibling_clone;
+        if (child->is_leaf)
+        {
+            leaf_publish(child_clone);
+            leaf_publish(sibling_clone);
+        }
+    }
+    else
+    {
+        uint16_t left = from_right ? i : j;
+        node_t *merged = from_right ? child_clone : sibling_clone;
+        node_t *right = from_right ? sibling_clone : child_clone;
+        node_merge(n_clone, left, merged, right);
+        n_clone->children.nodes[left] = merged;
+        if (child->is_leaf)
+        {
+            // unlink the cell of the right leaf. It is retired with its last version.
+            leaf_publish(merged);
+            atomic_store(&merged->children.link->next, right->children.link->next);
+            right->children.link->dead = true;
+        }
+        // was never reachable for other threads
+        pool_free(&mem->nodes, right);
+    }
+
+    i = find(n_clone->keys, n_clone->n, key);
+    if (i < n_clone->n && n_clone->keys[i] == key)
+        i++;
+    node_t *next = n_clone->children.nodes[i];
+
+    // n_clone is not reachable for other threads yet
+    latch_t *clone_latch = NULL;
+    latch_acquire(&next->latch);
+
+    node_t *free_after_2[2] = {NULL, NULL};
+    node_t *new_next = node_delete(next, key, found, info, free_after_2, &clone_latch, mem, mode, find);
+    swap_and_retire_pair(new_next, &n_clone->children.nodes[i], free_after_2, mem);
+
+    return n_clone;
 }
 
-void bptree_insert(bptree_t *tree, bp_key_t key, value_t value)
+void node_free(node_t *n, bptree_mem_t *mem)
 {
-    pthread_spin_lock(&tree->lock);
-    if (tree->root == NULL)
+    if (!n->is_leaf)
     {
-        node_t *root = node_create(true);
-        root->keys[0] = key;
-        root->children.values[0] = value;
-        root->n = 1;
-        atomic_store(&tree->root, root);
+        for (int i = 0; i < n->n + 1; i++)
+            node_free(n->children.nodes[i], mem);
     }
     else
     {
-        if (tree->root->n == ORDER - 1)
-        {
-            node_t *s = node_create(false);
-            s->children.nodes[0] = node_clone(tree->root);
+        if (mem->owns_values)
+            for (int i = 0; i < n->n; i++)
+                if (value_store_blob(n->children.values[i]) != NULL)
+                    value_reclaim(value_store_blob(n->children.values[i]), mem);
+        leaf_link_reclaim(n->children.link, mem);
+    }
+    node_reclaim(n, mem);
+}
 
-            node_split(s, 0, s->children.nodes[0]);
-            int i = 0;
-            if (s->keys[0] < key)
-                i++;
-            node_t *next = s->children.nodes[i];
+// number of inserts a buffer of BPTREE_BUFFERED holds
+#define WRITE_BUFFER_SIZE 1024
 
-            node_t *free_after = NULL;
-            node_t *new_next = node_insert(next, key, value, &free_after, &tree->inc_ops, tree->use_avx2);
-            swap_and_free(new_next, &s->children.nodes[i], free_after, &tree->inc_ops);
+// a buffer has a filter of 2^WRITE_BUFFER_FILTER_SHIFT bits, one per key hash.
+// Gets only scan the buffer if the bit of their key is set (about 6% of the
+// misses with a full buffer).
+#define WRITE_BUFFER_FILTER_SHIFT 14
 
-            // Change root
-            node_t *old_root = atomic_exchange(&tree->root, s);
-            delayed_free(old_root, &tree->inc_ops);
-        }
-        else
+// inserts of BPTREE_BUFFERED in the order they were appended. Messages
+// below n are never changed, readers scan them without validation.
+typedef struct write_buffer_t
+{
+    bp_key_t keys[WRITE_BUFFER_SIZE];
+    value_t values[WRITE_BUFFER_SIZE];
+    uint64_t filter[(1 << WRITE_BUFFER_FILTER_SHIFT) / 64];
+    uint32_t n;
+} write_buffer_t;
+
+static write_buffer_t *buffer_create(void)
+{
+    write_buffer_t *buffer = malloc(sizeof(write_buffer_t));
+    memset(buffer->filter, 0, sizeof(buffer->filter));
+    buffer->n = 0;
+    return buffer;
+}
+
+// bit of a key in the filter of a buffer (multiplicative hash)
+static inline uint32_t buffer_filter_bit(bp_key_t key)
+{
+    return ((uint64_t)key * 0x9E3779B97F4A7C15ULL) >> (64 - WRITE_BUFFER_FILTER_SHIFT);
+}
+
+// epoch_free_fn for flushed buffers
+static void buffer_reclaim(void *buffer, void *ctx)
+{
+    free(buffer);
+}
+
+// finds the last insert of a key in a buffer (that can be NULL)
+static inline bool buffer_find(write_buffer_t *buffer, bp_key_t key, value_t *result)
+{
+    if (buffer == NULL)
+        return false;
+    // the bits of the messages below n are set before n is stored
+    int n = atomic_load(&buffer->n);
+    uint32_t bit = buffer_filter_bit(key);
+    if ((__atomic_load_n(&buffer->filter[bit / 64], __ATOMIC_RELAXED) & (1ULL << bit % 64)) == 0)
+        return false;
+    for (int i = n - 1; i >= 0; i--)
+    {
+        if (buffer->keys[i] == key)
         {
-            node_t *free_after = NULL;
-            node_t *new_root = node_insert(tree->root, key, value, &free_after, &tree->inc_ops, tree->use_avx2);
-            swap_and_free(new_root, &tree->root, free_after, &tree->inc_ops);
+            *result = buffer->values[i];
+            return true;
         }
     }
-    pthread_spin_unlock(&tree->lock);
+    return false;
 }
 
-void bptree_free(bptree_t *tree)
+// finds a key among the inserts that are not applied to the tree yet.
+// Readers call it within the epoch before they search the tree: an
+// insert stays in its buffer until the flush of the buffer is done.
+// The active buffer is loaded first, it can only become the flushed one.
+static inline bool buffers_get(bptree_mem_t *mem, bp_key_t key, value_t *result)
 {
-    if (tree->root != NULL)
-        node_free(tree->root);
+    write_buffers_t *b = mem->buffers;
+    return b != NULL && (buffer_find(atomic_load(&b->active), key, result) || buffer_find(atomic_load(&b->flushing), key, result));
+}
+
+// writes of BPTREE_BUFFERED (defined below with the batch inserts they use)
+static void buffer_insert(bptree_t *tree, bp_key_t key, value_t value);
+static void buffers_lock(bptree_t *tree);
+static void buffers_unlock(bptree_t *tree);
+
+void bptree_init(bptree_t *tree, bptree_simd_t simd, bptree_write_mode_t write_mode)
+{
+    tree->root = NULL;
+    tree->root_latch = 0;
+    epoch_init(&tree->mem.epoch, &tree->mem);
+    pool_init(&tree->mem.nodes, sizeof(node_t), DCACHE_LINESIZE);
+    pool_init(&tree->mem.links, sizeof(leaf_link_t), sizeof(void *));
+    value_store_init(&tree->mem.values);
+    tree->mem.owns_values = false;
+    tree->mem.image = NULL;
+    tree->mem.image_size = 0;
+    tree->mem.wal = NULL;
+    tree->mem.checkpoint = NULL;
+    tree->mem.combine = NULL;
+    tree->mem.buffers = NULL;
+    tree->mem.tail = NULL;
+    if (write_mode == BPTREE_BUFFERED)
+    {
+        write_buffers_t *b = malloc(sizeof(write_buffers_t));
+        b->active = buffer_create();
+        b->flushing = NULL;
+        b->latch = 0;
+        b->num_flushes = b->num_messages = 0;
+        tree->mem.buffers = b;
+    }
+    tree->mem.generation = 0;
+    tree->mem.frozen = 0;
+    tree->mem.num_snapshots = 0;
+    tree->mem.writers = 0;
+    tree->mem.paused = false;
+    tree->simd = bptree_simd_resolve(simd);
+    tree->find = find_index_select(tree->simd);
+    tree->write_mode = write_mode;
+}
+
+bool bptree_get(bptree_t *tree, bp_key_t key, value_t *result)
+{
+    bool found = false;
+    epoch_enter(&tree->mem.epoch);
+    node_t *root;
+    if (buffers_get(&tree->mem, key, result))
+        found = true;
+    else if ((root = atomic_load(&tree->root)) != NULL)
+        found = node_get(root, key, result, tree->find);
+    epoch_exit(&tree->mem.epoch);
+    return found;
+}
+
+size_t bptree_get_batch(bptree_t *tree, const bp_key_t *keys, size_t n, value_t *results, bool *found)
+{
+    size_t count = 0;
+    epoch_enter(&tree->mem.epoch);
+    for (size_t offset = 0; offset < n; offset += BPTREE_GET_GROUP)
+    {
+        size_t group = n - offset < BPTREE_GET_GROUP ? n - offset : BPTREE_GET_GROUP;
+
+        // buffered inserts are newer than the tree (see buffers_get)
+        value_t buffered[BPTREE_GET_GROUP];
+        bool in_buffer[BPTREE_GET_GROUP] = {false};
+        for (size_t i = 0; i < group && tree->mem.buffers != NULL; i++)
+            in_buffer[i] = buffers_get(&tree->mem, keys[offset + i], &buffered[i]);
+
+        // loaded after the buffers, so it holds the keys of a buffer
+        // that was flushed since they were checked
+        node_t *root = atomic_load(&tree->root);
+        if (root == NULL)
+            memset(found + offset, 0, group * sizeof(bool));
+        else
+            count += node_get_group(root, keys + offset, group, results + offset, found + offset, tree->find);
+
+        for (size_t i = 0; i < group; i++)
+        {
+            if (!in_buffer[i])
+                continue;
+            count += !found[offset + i];
+            found[offset + i] = true;
+            results[offset + i] = buffered[i];
+        }
+    }
+    epoch_exit(&tree->mem.epoch);
+    return count;
+}
+
+// returns the leaf whose key range contains key
+static node_t *node_seek_leaf(node_t *n, bp_key_t key, find_index_fn find)
+{
+    while (!n->is_leaf)
+        n = atomic_load(&n->children.nodes[node_child_index(n, key, find)]);
+    return n;
+}
+
+// inserts a key or applies the update of info to it (see write_begin)
+static void tree_insert(bptree_t *tree, bp_key_t key, value_t value, write_info_t *info)
+{
+    node_t *root = tree->root;
+    if (root == NULL)
+    {
+        if (info->update != NULL && !update_apply(info, 0, false, &value))
+        {
+            latch_release(&tree->root_latch);
+            return;
+        }
+        log_write(&tree->mem, LOG_INSERT, key, value, info);
+        root = node_create(true, &tree->mem);
+        root->children.link = leaf_link_create(root, NULL, &tree->mem);
+        root->keys[0] = key;
+        root->children.values[0] = value;
+        root->n = 1;
+        atomic_store(&tree->root, root);
+        latch_release(&tree->root_latch);
+    }
+    else
+    {
+        info->right_edge = true;
+        info->split = false;
+        info->tail = NULL;
+        latch_acquire(&root->latch);
+        if (root->n == ORDER - 1)
+        {
+            bool append = root->keys[ORDER - 2] < key;
+            node_t *s = node_create(false, &tree->mem);
+            s->children.nodes[0] = node_clone(root, &tree->mem);
+            node_mark_obsolete(root);
+            latch_release(&root->latch);
+
+            node_split(s, 0, s->children.nodes[0], append, &tree->mem);
+            info->split = true;
+            int i = 0;
+            if (s->keys[0] <= key)
+                i++;
+            info->right_edge = i == s->n;
+            node_t *next = s->children.nodes[i];
+
+            // s is not reachable for other threads yet
+            latch_t *s_latch = NULL;
+            latch_acquire(&next->latch);
+
+            node_t *free_after = NULL;
+            node_t *new_next = node_insert(next, key, value, info, &free_after, &s_latch, &tree->mem, tree->write_mode, tree->find);
+            swap_and_retire(new_next, &s->children.nodes[i], free_after, &tree->mem);
+
+            // Change root
+            node_t *old_root = atomic_exchange(&tree->root, s);
+            node_retire(old_root, &tree->mem);
+            tail_publish(info, &tree->mem);
+            latch_release(&tree->root_latch);
+        }
+        else
+        {
+            latch_t *root_latch = &tree->root_latch;
+
+            node_t *free_after = NULL;
+            node_t *new_root = node_insert(root, key, value, info, &free_after, &root_latch, &tree->mem, tree->write_mode, tree->find);
+            swap_and_retire(new_root, &tree->root, free_after, &tree->mem);
+            tail_publish(info, &tree->mem);
+
+            if (root_latch != NULL)
+                latch_release(root_latch);
+        }
+    }
+}
+
+// number of published inserts a combiner sorts and applies at once
+#define COMBINE_BATCH 64
+
+// number of times a thread checks whether its insert was applied
+// before it yields to the combiner
+#define COMBINE_SPINS 256
+
+// insert published by a thread that waits for a combiner
+typedef struct combine_request_t
+{
+    bp_key_t key;
+    value_t value;
+    struct combine_request_t *next;
+
+    // set by the combiner once the insert is applied
+    bool done;
+} combine_request_t;
+
+static size_t batch_sort(const bp_key_t *keys, const value_t *values, size_t n, bp_key_t *sorted_keys, value_t *sorted_values, value_t *dropped, size_t *num_dropped);
+static void tree_insert_batch(bptree_t *tree, const bp_key_t *keys, const value_t *values, size_t n, write_info_t *info);
+
+// applies all published inserts as one sorted batch under one write (see
+// tree_insert_batch). Inserts that go to the same leaf share its descent
+// and its clone, and the log is synced once. Called by the combiner.
+static void combine_apply(bptree_t *tree)
+{
+    combine_t *c = tree->mem.combine;
+    combine_request_t *list = __atomic_exchange_n(&c->pending, NULL, __ATOMIC_ACQUIRE);
+    while (list != NULL)
+    {
+        combine_request_t *batch[COMBINE_BATCH];
+        bp_key_t keys[COMBINE_BATCH], sorted_keys[COMBINE_BATCH];
+        value_t values[COMBINE_BATCH], sorted_values[COMBINE_BATCH], dropped[COMBINE_BATCH];
+        int n = 0;
+        for (; list != NULL && n < COMBINE_BATCH; list = list->next, n++)
+        {
+            batch[n] = list;
+            keys[n] = list->key;
+            values[n] = list->value;
+        }
+        // inserts of the same key are concurrent, any of them can win
+        size_t num_dropped;
+        size_t m = batch_sort(keys, values, n, sorted_keys, sorted_values, dropped, &num_dropped);
+
+        write_info_t info;
+        write_begin(tree, &info);
+        // a single insert needs no state of a batch
+        if (m == 1)
+            tree_insert(tree, sorted_keys[0], sorted_values[0], &info);
+        else
+            tree_insert_batch(tree, sorted_keys, sorted_values, m, &info);
+        write_end(tree, &info);
+        for (size_t i = 0; i < num_dropped; i++)
+            value_retire(dropped[i], &tree->mem);
+
+        c->num_batches++;
+        c->num_requests += n;
+        // a request is on the stack of its thread, which returns once it is done
+        for (int i = 0; i < n; i++)
+            __atomic_store_n(&batch[i]->done, true, __ATOMIC_RELEASE);
+    }
+}
+
+// publishes an insert and waits until a combiner applied it.
+// The thread becomes the combiner if no other thread is.
+static void tree_insert_combined(bptree_t *tree, bp_key_t key, value_t value)
+{
+    combine_t *c = tree->mem.combine;
+    combine_request_t request = {key, value, NULL, false};
+    request.next = __atomic_load_n(&c->pending, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&c->pending, &request.next, &request, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+
+    for (int spins = 0; !__atomic_load_n(&request.done, __ATOMIC_ACQUIRE); spins++)
+    {
+        if (latch_try_acquire(&c->latch))
+        {
+            combine_apply(tree);
+            latch_release(&c->latch);
+        }
+        else if (spins < COMBINE_SPINS)
+            _mm_pause();
+        else
+            sched_yield();
+    }
+}
+
+void bptree_combining_enable(bptree_t *tree)
+{
+    combine_t *c = aligned_alloc(DCACHE_LINESIZE, sizeof(combine_t));
+    c->pending = NULL;
+    c->latch = 0;
+    c->num_batches = c->num_requests = 0;
+    tree->mem.combine = c;
+}
+
+/**
+ * @brief appends a key that is greater than all keys of the tree to the last
+ * leaf, which an insert of the previous key found (see bptree_mem_t.tail).
+ * Like tree_update_leaf only the latch of the leaf is taken, no inner node
+ * is visited and no key is searched.
+ * 
+ * @param tree a bptree that modifies leaves in place
+ * @param key key to insert
+ * @param value value of the key
+ * @return true if the key was appended
+ * @return false if the last leaf is unknown, full or part of a snapshot
+ * or key is not above its keys. The key is inserted from the root then.
+ */
+static bool tree_append(bptree_t *tree, bp_key_t key, value_t value)
+{
+    bool done = false;
+    write_info_t info;
+    info.old_value = 0;
+    info.lsn = 0;
+    info.num_retired = 0;
+    epoch_enter(&tree->mem.epoch);
+    // counts as a writer like tree_update_leaf
+    __atomic_fetch_add(&tree->mem.writers, 1, __ATOMIC_SEQ_CST);
+    node_t *leaf = __atomic_load_n(&tree->mem.paused, __ATOMIC_SEQ_CST) ? NULL : atomic_load(&tree->mem.tail);
+    if (leaf != NULL)
+    {
+        latch_acquire(&leaf->latch);
+        // a leaf that is split or merged is marked obsolete before its
+        // latch is released, the last leaf has no successor
+        if (!node_is_obsolete(leaf) && atomic_load(&leaf->children.link->next) == NULL && leaf->n > 0 && leaf->n < ORDER - 1 && leaf->keys[leaf->n - 1] < key && !node_frozen(leaf, &tree->mem))
+        {
+            done = true;
+            log_write(&tree->mem, LOG_INSERT, key, value, &info);
+            node_write_begin(leaf);
+            leaf->keys[leaf->n] = key;
+            leaf->children.values[leaf->n] = value;
+            leaf->n++;
+            node_write_end(leaf);
+        }
+        latch_release(&leaf->latch);
+    }
+    write_end(tree, &info);
+    return done;
+}
+
+void bptree_insert(bptree_t *tree, bp_key_t key, value_t value)
+{
+    if (tree->mem.buffers != NULL)
+    {
+        buffer_insert(tree, key, value);
+        return;
+    }
+    if (tree->mem.combine != NULL)
+    {
+        tree_insert_combined(tree, key, value);
+        return;
+    }
+    // sequential keys skip the descent (see tree_append)
+    if (tree->write_mode == BPTREE_IN_PLACE && atomic_load(&tree->mem.tail) != NULL && tree_append(tree, key, value))
+        return;
+
+    write_info_t info;
+    write_begin(tree, &info);
+    tree_insert(tree, key, value, &info);
+    write_end(tree, &info);
+}
+
+/**
+ * @brief applies an update to a key that exists in a leaf that can be
+ * modified in place. Only the latch of the leaf is taken and not the root
+ * latch, so updates of different leaves run in parallel.
+ * 
+ * @param tree a bptree
+ * @param key key to update
+ * @param info update (see write_begin)
+ * @return true if the update was applied or left the key unchanged
+ * @return false if the key does not exist or its leaf is part of a snapshot
+ */
+static bool tree_update_leaf(bptree_t *tree, bp_key_t key, write_info_t *info)
+{
+    bool done = false;
+    info->old_value = 0;
+    info->lsn = 0;
+    info->num_retired = 0;
+    epoch_enter(&tree->mem.epoch);
+    // counts as a writer, so a snapshot waits for the update. An update
+    // that starts while a snapshot waits takes the root latch instead.
+    __atomic_fetch_add(&tree->mem.writers, 1, __ATOMIC_SEQ_CST);
+    node_t *root = __atomic_load_n(&tree->mem.paused, __ATOMIC_SEQ_CST) ? NULL : atomic_load(&tree->root);
+    while (root != NULL)
+    {
+        node_t *leaf = node_seek_leaf(root, key, tree->find);
+        latch_acquire(&leaf->latch);
+        // writers mark a leaf obsolete before they release its latch
+        if (node_is_obsolete(leaf))
+        {
+            latch_release(&leaf->latch);
+            root = atomic_load(&tree->root);
+            continue;
+        }
+
+        uint16_t i = tree->find(leaf->keys, leaf->n, key);
+        value_t value;
+        if (i < leaf->n && leaf->keys[i] == key && !node_frozen(leaf, &tree->mem))
+        {
+            done = true;
+            if (update_apply(info, leaf->children.values[i], true, &value))
+            {
+                log_write(&tree->mem, LOG_INSERT, key, value, info);
+                info->old_value = leaf->children.values[i];
+                // readers see the old or the new value of the
+                // slot, so the version of the leaf is not changed
+                node_mark_dirty(leaf);
+                atomic_store(&leaf->children.values[i], value);
+            }
+        }
+        latch_release(&leaf->latch);
+        break;
+    }
+    write_end(tree, info);
+    return done;
+}
+
+bool bptree_update(bptree_t *tree, bp_key_t key, bptree_update_fn fn, void *ctx)
+{
+    write_info_t info;
+    info.update = fn;
+    info.update_ctx = ctx;
+    // the current value of a buffered key is applied to the tree first
+    buffers_lock(tree);
+    if (tree_update_leaf(tree, key, &info))
+    {
+        buffers_unlock(tree);
+        return true;
+    }
+
+    // the key is new, its leaf has to be cloned or a snapshot is taken
+    write_begin(tree, &info);
+    info.update = fn;
+    info.update_ctx = ctx;
+    tree_insert(tree, key, 0, &info);
+    write_end(tree, &info);
+    buffers_unlock(tree);
+    return info.found;
+}
+
+// arguments of the update of bptree_cas
+typedef struct cas_args_t
+{
+    value_t expected;
+    value_t desired;
+    bool swapped;
+} cas_args_t;
+
+static bool cas_update(value_t *value, bool found, void *ctx)
+{
+    cas_args_t *args = (cas_args_t *)ctx;
+    args->swapped = found && *value == args->expected;
+    if (args->swapped)
+        *value = args->desired;
+    return args->swapped;
+}
+
+bool bptree_cas(bptree_t *tree, bp_key_t key, value_t expected, value_t desired)
+{
+    cas_args_t args = {expected, desired, false};
+    bptree_update(tree, key, cas_update, &args);
+    return args.swapped;
+}
+
+// adds the delta in ctx and returns the previous value in it
+static bool fetch_add_update(value_t *value, bool found, void *ctx)
+{
+    value_t delta = *(value_t *)ctx;
+    *(value_t *)ctx = *value;
+    *value += delta;
+    return true;
+}
+
+value_t bptree_fetch_add(bptree_t *tree, bp_key_t key, value_t delta)
+{
+    bptree_update(tree, key, fetch_add_update, &delta);
+    return delta;
+}
+
+// nodes that replace a node after a batch insert (see node_insert_batch).
+// seps[j] is the smallest key in the subtree of nodes[j] (for j > 0).
+// The arrays can start in a buffer of the caller, they move to the heap once it is full.
+typedef struct batch_nodes_t
+{
+    node_t **nodes;
+    bp_key_t *seps;
+    size_t n;
+    size_t cap;
+    bool on_heap;
+} batch_nodes_t;
+
+static void batch_nodes_free(batch_nodes_t *b)
+{
+    if (b->on_heap)
+    {
+        free(b->nodes);
+        free(b->seps);
+    }
+}
+
+static void batch_nodes_add(batch_nodes_t *b, node_t *node, bp_key_t sep)
+{
+    if (b->n == b->cap)
+    {
+        b->cap = b->cap == 0 ? ORDER : b->cap * 2;
+        node_t **nodes = malloc(b->cap * sizeof(node_t *));
+        bp_key_t *seps = malloc(b->cap * sizeof(bp_key_t));
+        if (b->n > 0)
+        {
+            memcpy_sized(nodes, b->nodes, b->n);
+            memcpy_sized(seps, b->seps, b->n);
+        }
+        batch_nodes_free(b);
+        b->nodes = nodes;
+        b->seps = seps;
+        b->on_heap = true;
+    }
+    b->nodes[b->n] = node;
+    b->seps[b->n++] = sep;
+}
+
+// state of a batch insert
+typedef struct batch_t
+{
+    bptree_mem_t *mem;
+    bptree_write_mode_t mode;
+    find_index_fn find;
+    write_info_t *info;
+
+    // replaced nodes and values. They are retired once
+    // the new nodes are reachable from the root.
+    node_t **retired;
+    size_t num_retired;
+    size_t retired_cap;
+    value_t *old_values;
+    size_t num_old_values;
+} batch_t;
+
+// releases a latched node that is replaced by the batch and retires it
+// with the batch. The node is marked obsolete before its replacement is built.
+static void batch_replace(batch_t *batch, node_t *n)
+{
+    latch_release(&n->latch);
+    if (batch->num_retired == batch->retired_cap)
+    {
+        batch->retired_cap = batch->retired_cap == 0 ? 64 : batch->retired_cap * 2;
+        batch->retired = realloc(batch->retired, batch->retired_cap * sizeof(node_t *));
+    }
+    batch->retired[batch->num_retired++] = n;
+}
+
+/**
+ * @brief builds the leaves for m sorted entries. As many leaves as needed
+ * are created and the entries are distributed evenly among them.
+ * 
+ * @param keys keys of the entries
+ * @param values values of the entries
+ * @param m number of entries (at least 1)
+ * @param link cell of the replaced leaf, it links the first new leaf
+ * @param out receives the new leaves
+ * @param mem memory of the tree
+ */
+static void batch_build_leaves(const bp_key_t *keys, const value_t *values, size_t m, leaf_link_t *link, batch_nodes_t *out, bptree_mem_t *mem)
+{
+    size_t k = (m + ORDER - 2) / (ORDER - 1);
+    size_t first = out->n;
+    for (size_t j = 0; j < k; j++)
+    {
+        size_t from = j * m / k, to = (j + 1) * m / k;
+        node_t *leaf = node_create(true, mem);
+        memcpy_sized(leaf->keys, keys + from, to - from);
+        memcpy_sized(leaf->children.values, values + from, to - from);
+        leaf->n = to - from;
+        batch_nodes_add(out, leaf, keys[from]);
+    }
+
+    // the cells of the new leaves are linked before the first leaf
+    // is published, so a scan never skips the entries behind it
+    leaf_link_t *next = link->next;
+    for (size_t j = out->n - 1; j > first; j--)
+    {
+        out->nodes[j]->children.link = leaf_link_create(out->nodes[j], next, mem);
+        next = out->nodes[j]->children.link;
+    }
+    out->nodes[first]->children.link = link;
+    atomic_store(&link->next, next);
+    leaf_publish(out->nodes[first]);
+}
+
+// builds the inner nodes for c children, seps[j] is the smallest key below
+// children[j]. As many nodes as needed are created (see batch_build_leaves).
+static void batch_build_inner(node_t **children, const bp_key_t *seps, size_t c, batch_nodes_t *out, bptree_mem_t *mem)
+{
+    size_t k = (c + ORDER - 1) / ORDER;
+    for (size_t j = 0; j < k; j++)
+    {
+        size_t from = j * c / k, to = (j + 1) * c / k;
+        node_t *n = node_create(false, mem);
+        memcpy_sized(n->children.nodes, children + from, to - from);
+        memcpy_sized(n->keys, seps + from + 1, to - from - 1);
+        n->n = to - from - 1;
+        batch_nodes_add(out, n, seps[from]);
+    }
+}
+
+// merges sorted keys into a latched leaf (see node_insert_batch)
+static void leaf_insert_batch(node_t *n, const bp_key_t *keys, const value_t *values, size_t count, batch_t *batch, batch_nodes_t *out)
+{
+    // number of keys the leaf already holds
+    size_t existing = 0;
+    for (size_t i = 0, j = 0; i < n->n && j < count;)
+    {
+        existing += n->keys[i] == keys[j];
+        if (n->keys[i] < keys[j])
+            i++;
+        else
+            j++;
+    }
+    size_t m = n->n + count - existing;
+
+    for (size_t j = 0; j < count && batch->info != NULL; j++)
+        log_write(batch->mem, LOG_INSERT, keys[j], values[j], batch->info);
+
+    // the leaf is changed in place like by node_insert if it does not overflow
+    if (m <= ORDER - 1 && !node_frozen(n, batch->mem) && (batch->mode != BPTREE_COPY_ON_WRITE || existing == count))
+    {
+        node_write_begin(n);
+        // merges from the back, so no entry is overwritten before it moved
+        int i = n->n - 1;
+        for (int j = count - 1, w = m - 1; j >= 0; w--)
+        {
+            if (i >= 0 && n->keys[i] > keys[j])
+            {
+                n->keys[w] = n->keys[i];
+                n->children.values[w] = n->children.values[i--];
+                continue;
+            }
+            if (i >= 0 && n->keys[i] == keys[j])
+                batch->old_values[batch->num_old_values++] = n->children.values[i--];
+            n->keys[w] = keys[j];
+            n->children.values[w] = values[j--];
+        }
+        n->n = m;
+        node_write_end(n);
+        latch_release(&n->latch);
+        batch_nodes_add(out, n, 0);
+        return;
+    }
+
+    bp_key_t key_buf[2 * ORDER];
+    value_t value_buf[2 * ORDER];
+    bp_key_t *merged_keys = m <= 2 * ORDER ? key_buf : malloc(m * sizeof(bp_key_t));
+    value_t *merged_values = m <= 2 * ORDER ? value_buf : malloc(m * sizeof(value_t));
+    for (size_t i = 0, j = 0, w = 0; w < m; w++)
+    {
+        if (j == count || (i < n->n && n->keys[i] < keys[j]))
+        {
+            merged_keys[w] = n->keys[i];
+            merged_values[w] = n->children.values[i++];
+            continue;
+        }
+        if (i < n->n && n->keys[i] == keys[j])
+            batch->old_values[batch->num_old_values++] = n->children.values[i++];
+        merged_keys[w] = keys[j];
+        merged_values[w] = values[j++];
+    }
+    // a reader that validates the leaf after the new leaves are
+    // published retries, so it does not return replaced values
+    node_mark_obsolete(n);
+    batch_build_leaves(merged_keys, merged_values, m, n->children.link, out, batch->mem);
+    if (merged_keys != key_buf)
+    {
+        free(merged_keys);
+        free(merged_values);
+    }
+    batch_replace(batch, n);
+}
+
+/**
+ * @brief inserts sorted keys into the subtree of n with one pass. All keys
+ * that go to the same leaf are merged into it at once. A node is replaced
+ * only once no matter how many keys pass it, and only if one of its
+ * children was split or it is part of a snapshot. Children that are
+ * replaced by one node are swapped in place like by node_insert.
+ * 
+ * @param n latched node, replaced by the nodes added to out (n itself if it was not replaced)
+ * @param keys strictly ascending keys that belong to the subtree of n
+ * @param values values of the keys
+ * @param count number of keys (at least 1)
+ * @param batch state of the batch
+ * @param out receives the nodes that replace n
+ */
+static void node_insert_batch(node_t *n, const bp_key_t *keys, const value_t *values, size_t count, batch_t *batch, batch_nodes_t *out)
+{
+    if (n->is_leaf)
+    {
+        leaf_insert_batch(n, keys, values, count, batch, out);
+        return;
+    }
+
+    // the nodes from first[j] on replace the child idx[j] of n
+    node_t *node_buf[2 * ORDER];
+    bp_key_t sep_buf[2 * ORDER];
+    batch_nodes_t replaced = {node_buf, sep_buf, 0, 2 * ORDER, false};
+    uint16_t idx[ORDER];
+    size_t first[ORDER + 1];
+    int touched = 0;
+    bool split = false;
+    for (size_t from = 0, to; from < count; from = to)
+    {
+        // keys equal to a separator belong to its right child
+        uint16_t i = node_child_index(n, keys[from], batch->find);
+        for (to = from + 1; to < count && (i == n->n || keys[to] < n->keys[i]); to++)
+            ;
+        node_t *child = n->children.nodes[i];
+        latch_acquire(&child->latch);
+        idx[touched] = i;
+        first[touched++] = replaced.n;
+        node_insert_batch(child, keys + from, values + from, to - from, batch, &replaced);
+        split |= replaced.n - first[touched - 1] > 1;
+    }
+    first[touched] = replaced.n;
+
+    if (!split && !node_frozen(n, batch->mem))
+    {
+        for (int j = 0; j < touched; j++)
+        {
+            if (replaced.nodes[j] == n->children.nodes[idx[j]])
+                continue;
+            node_mark_dirty(n);
+            atomic_store(&n->children.nodes[idx[j]], replaced.nodes[j]);
+        }
+        latch_release(&n->latch);
+        batch_nodes_add(out, n, 0);
+    }
+    else
+    {
+        node_t *children_buf[2 * ORDER];
+        bp_key_t children_sep_buf[2 * ORDER];
+        batch_nodes_t children = {children_buf, children_sep_buf, 0, 2 * ORDER, false};
+        for (uint16_t i = 0, j = 0; i <= n->n; i++)
+        {
+            bp_key_t sep = i == 0 ? 0 : n->keys[i - 1];
+            if (j == touched || idx[j] != i)
+            {
+                batch_nodes_add(&children, n->children.nodes[i], sep);
+                continue;
+            }
+            batch_nodes_add(&children, replaced.nodes[first[j]], sep);
+            for (size_t r = first[j] + 1; r < first[j + 1]; r++)
+                batch_nodes_add(&children, replaced.nodes[r], replaced.seps[r]);
+            j++;
+        }
+        node_mark_obsolete(n);
+        batch_build_inner(children.nodes, children.seps, children.n, out, batch->mem);
+        batch_replace(batch, n);
+        batch_nodes_free(&children);
+    }
+    batch_nodes_free(&replaced);
+}
+
+/**
+ * @brief inserts sorted keys into the tree with one pass (see node_insert_batch).
+ * Called after write_begin, the root latch is released.
+ * 
+ * @param tree a bptree
+ * @param keys strictly ascending keys
+ * @param values values of the keys
+ * @param n number of keys
+ * @param info write that logs the keys (NULL if they were logged before)
+ */
+static void tree_insert_batch(bptree_t *tree, const bp_key_t *keys, const value_t *values, size_t n, write_info_t *info)
+{
+    if (n == 0)
+    {
+        latch_release(&tree->root_latch);
+        return;
+    }
+    batch_t batch = {&tree->mem, tree->write_mode, tree->find, info, NULL, 0, 0, malloc(n * sizeof(value_t)), 0};
+
+    node_t *root = tree->root;
+    if (root == NULL)
+    {
+        // the batch is merged into an empty leaf
+        root = node_create(true, &tree->mem);
+        root->children.link = leaf_link_create(root, NULL, &tree->mem);
+        atomic_store(&tree->root, root);
+    }
+    latch_acquire(&root->latch);
+    batch_nodes_t level = {NULL, NULL, 0, 0, false};
+    node_insert_batch(root, keys, values, n, &batch, &level);
+
+    // the root was split, the tree grows by as many levels as needed
+    while (level.n > 1)
+    {
+        batch_nodes_t up = {NULL, NULL, 0, 0, false};
+        batch_build_inner(level.nodes, level.seps, level.n, &up, &tree->mem);
+        batch_nodes_free(&level);
+        level = up;
+    }
+    if (level.nodes[0] != root)
+        atomic_store(&tree->root, level.nodes[0]);
+    latch_release(&tree->root_latch);
+    batch_nodes_free(&level);
+
+    for (size_t i = 0; i < batch.num_retired; i++)
+        node_retire(batch.retired[i], &tree->mem);
+    for (size_t i = 0; i < batch.num_old_values; i++)
+        value_retire(batch.old_values[i], &tree->mem);
+    free(batch.retired);
+    free(batch.old_values);
+}
+
+// entry of a batch insert
+typedef struct batch_entry_t
+{
+    bp_key_t key;
+    value_t value;
+} batch_entry_t;
+
+// sorts entries by key with a bottom-up merge sort. The sort is stable, so
+// entries of the same key keep their order. Returns the array that holds
+// the sorted entries (entries or tmp, both have room for n entries).
+static batch_entry_t *batch_entry_sort(batch_entry_t *entries, batch_entry_t *tmp, size_t n)
+{
+    for (size_t width = 1; width < n; width *= 2)
+    {
+        for (size_t lo = 0; lo < n; lo += 2 * width)
+        {
+            size_t mid = lo + width < n ? lo + width : n;
+            size_t hi = lo + 2 * width < n ? lo + 2 * width : n;
+            size_t i = lo, j = mid, w = lo;
+            while (i < mid && j < hi)
+                tmp[w++] = entries[j].key < entries[i].key ? entries[j++] : entries[i++];
+            while (i < mid)
+                tmp[w++] = entries[i++];
+            while (j < hi)
+                tmp[w++] = entries[j++];
+        }
+        batch_entry_t *swap = entries;
+        entries = tmp;
+        tmp = swap;
+    }
+    return entries;
+}
+
+/**
+ * @brief sorts entries by key. If a key occurs more than once its last value wins.
+ * 
+ * @param keys keys of the entries
+ * @param values values of the entries
+ * @param n number of entries
+ * @param sorted_keys receives the strictly ascending keys (n entries)
+ * @param sorted_values receives their values (n entries)
+ * @param dropped receives the values that lost against a later value of their key (n entries)
+ * @param num_dropped set to the number of dropped values
+ * @return size_t number of sorted keys
+ */
+static size_t batch_sort(const bp_key_t *keys, const value_t *values, size_t n, bp_key_t *sorted_keys, value_t *sorted_values, value_t *dropped, size_t *num_dropped)
+{
+    // batches of the buffers are sorted on the stack
+    batch_entry_t buf[2 * WRITE_BUFFER_SIZE];
+    batch_entry_t *entries = n <= WRITE_BUFFER_SIZE ? buf : malloc(2 * n * sizeof(batch_entry_t));
+    bool ascending = true;
+    for (size_t i = 0; i < n; i++)
+    {
+        entries[i] = (batch_entry_t){keys[i], values[i]};
+        ascending &= i == 0 || keys[i - 1] <= keys[i];
+    }
+    batch_entry_t *sorted = ascending ? entries : batch_entry_sort(entries, entries + n, n);
+
+    size_t m = 0;
+    *num_dropped = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        if (m > 0 && sorted_keys[m - 1] == sorted[i].key)
+            dropped[(*num_dropped)++] = sorted_values[--m];
+        sorted_keys[m] = sorted[i].key;
+        sorted_values[m++] = sorted[i].value;
+    }
+    if (entries != buf)
+        free(entries);
+    return m;
+}
+
+void bptree_insert_batch(bptree_t *tree, const bp_key_t *keys, const value_t *values, size_t n)
+{
+    bp_key_t *sorted_keys = malloc(n * sizeof(bp_key_t));
+    value_t *sorted_values = malloc(n * sizeof(value_t));
+    value_t *dropped = malloc(n * sizeof(value_t));
+    size_t num_dropped;
+    size_t m = batch_sort(keys, values, n, sorted_keys, sorted_values, dropped, &num_dropped);
+
+    write_info_t info;
+    buffers_lock(tree);
+    write_begin(tree, &info);
+    tree_insert_batch(tree, sorted_keys, sorted_values, m, &info);
+    write_end(tree, &info);
+    buffers_unlock(tree);
+    for (size_t i = 0; i < num_dropped; i++)
+        value_retire(dropped[i], &tree->mem);
+    free(sorted_keys);
+    free(sorted_values);
+    free(dropped);
+}
+
+/**
+ * @brief applies the inserts of the active buffer to the tree as one batch.
+ * A new buffer takes its place first, so other threads keep appending while
+ * the full one is flushed. Called with the latch of the buffers held while
+ * no other buffer is flushed.
+ * 
+ * @param tree a tree of BPTREE_BUFFERED
+ * @param release whether the latch of the buffers is released before the
+ * flush. It is kept to order a write of the caller after all buffered inserts.
+ */
+static void buffer_flush(bptree_t *tree, bool release)
+{
+    write_buffers_t *b = tree->mem.buffers;
+    write_buffer_t *full = b->active;
+    atomic_store(&b->flushing, full);
+    atomic_store(&b->active, buffer_create());
+    if (release)
+        latch_release(&b->latch);
+
+    bp_key_t keys[WRITE_BUFFER_SIZE];
+    value_t values[WRITE_BUFFER_SIZE];
+    value_t dropped[WRITE_BUFFER_SIZE];
+    size_t num_dropped;
+    size_t m = batch_sort(full->keys, full->values, full->n, keys, values, dropped, &num_dropped);
+
+    // the inserts were logged when they were buffered
+    write_info_t info;
+    write_begin(tree, &info);
+    tree_insert_batch(tree, keys, values, m, NULL);
+    write_end(tree, &info);
+
+    // readers find the inserts in the tree from now on
+    __atomic_fetch_add(&b->num_flushes, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&b->num_messages, full->n, __ATOMIC_RELAXED);
+    atomic_store(&b->flushing, NULL);
+    epoch_retire(&tree->mem.epoch, full, buffer_reclaim);
+    for (size_t i = 0; i < num_dropped; i++)
+        value_retire(dropped[i], &tree->mem);
+}
+
+// appends an insert to the active buffer. The thread that finds
+// the buffer full flushes it (see buffer_flush).
+static void buffer_insert(bptree_t *tree, bp_key_t key, value_t value)
+{
+    write_buffers_t *b = tree->mem.buffers;
+    latch_acquire(&b->latch);
+    while (b->active->n == WRITE_BUFFER_SIZE)
+    {
+        if (atomic_load(&b->flushing) == NULL)
+            buffer_flush(tree, true);
+        else
+        {
+            // the full buffer has to wait for the last flush
+            latch_release(&b->latch);
+            sched_yield();
+        }
+        latch_acquire(&b->latch);
+    }
+
+    // records are appended with the latch held, so they
+    // are in the order of the inserts in the buffers
+    write_info_t info;
+    info.lsn = 0;
+    log_write(&tree->mem, LOG_INSERT, key, value, &info);
+    write_buffer_t *active = b->active;
+    uint32_t bit = buffer_filter_bit(key);
+    __atomic_store_n(&active->filter[bit / 64], active->filter[bit / 64] | 1ULL << bit % 64, __ATOMIC_RELAXED);
+    active->keys[active->n] = key;
+    active->values[active->n] = value;
+    atomic_store(&active->n, active->n + 1);
+    latch_release(&b->latch);
+    // a failed log is reported by bptree_wal_error
+    if (info.lsn != 0)
+        wal_sync(tree->mem.wal, info.lsn);
+}
+
+// latches the buffers of a tree of BPTREE_BUFFERED (if it has them) and
+// applies all buffered inserts, so a write that bypasses the buffers is
+// ordered after them in the tree and in the log. Released by buffers_unlock.
+static void buffers_lock(bptree_t *tree)
+{
+    write_buffers_t *b = tree->mem.buffers;
+    if (b == NULL)
+        return;
+    latch_acquire(&b->latch);
+    while (atomic_load(&b->flushing) != NULL)
+        sched_yield();
+    if (b->active->n > 0)
+        buffer_flush(tree, false);
+}
+
+static void buffers_unlock(bptree_t *tree)
+{
+    if (tree->mem.buffers != NULL)
+        latch_release(&tree->mem.buffers->latch);
+}
+
+/**
+ * @brief copies the buffered inserts with lo <= key <= hi (see buffers_get).
+ * 
+ * @param mem memory of a tree, must be within its epoch
+ * @param lo smallest key
+ * @param hi largest key
+ * @param keys set to the strictly ascending keys (free it)
+ * @param values set to the last values of the keys (free it)
+ * @return size_t number of keys
+ */
+static size_t buffers_collect(bptree_mem_t *mem, bp_key_t lo, bp_key_t hi, bp_key_t **keys, value_t **values)
+{
+    *keys = NULL;
+    *values = NULL;
+    write_buffers_t *b = mem->buffers;
+    if (b == NULL)
+        return 0;
+
+    // the flushed buffer is older than the active one
+    write_buffer_t *active = atomic_load(&b->active);
+    write_buffer_t *parts[2] = {atomic_load(&b->flushing), active};
+    bp_key_t in_keys[2 * WRITE_BUFFER_SIZE];
+    value_t in_values[2 * WRITE_BUFFER_SIZE];
+    size_t n = 0;
+    for (int p = 0; p < 2; p++)
+    {
+        for (uint32_t i = 0, size = parts[p] == NULL ? 0 : atomic_load(&parts[p]->n); i < size; i++)
+        {
+            if (parts[p]->keys[i] < lo || parts[p]->keys[i] > hi)
+                continue;
+            in_keys[n] = parts[p]->keys[i];
+            in_values[n++] = parts[p]->values[i];
+        }
+    }
+    if (n == 0)
+        return 0;
+
+    value_t dropped[2 * WRITE_BUFFER_SIZE];
+    size_t num_dropped;
+    *keys = malloc(n * sizeof(bp_key_t));
+    *values = malloc(n * sizeof(value_t));
+    return batch_sort(in_keys, in_values, n, *keys, *values, dropped, &num_dropped);
+}
+
+bool bptree_delete(bptree_t *tree, bp_key_t key)
+{
+    bool found = false;
+    write_info_t info;
+    buffers_lock(tree);
+    write_begin(tree, &info);
+    node_t *root = tree->root;
+    if (root == NULL)
+    {
+        latch_release(&tree->root_latch);
+        write_end(tree, &info);
+        buffers_unlock(tree);
+        return false;
+    }
+
+    latch_acquire(&root->latch);
+    latch_t *root_latch = &tree->root_latch;
+
+    node_t *free_after[2] = {NULL, NULL};
+    node_t *new_root = node_delete(root, key, &found, &info, free_after, &root_latch, &tree->mem, tree->write_mode, tree->find);
+    if (new_root != NULL)
+    {
+        // shrink the tree if the root lost its last key
+        node_t *empty = NULL;
+        if (new_root->n == 0)
+        {
+            empty = new_root;
+            new_root = empty->is_leaf ? NULL : empty->children.nodes[0];
+            if (empty->is_leaf)
+                empty->children.link->dead = true;
+        }
+
+        node_t *old_root = atomic_exchange(&tree->root, new_root);
+        node_retire(old_root, &tree->mem);
+        if (empty != NULL)
+            node_retire(empty, &tree->mem);
+        for (int i = 0; i < 2; i++)
+            if (free_after[i] != NULL)
+                node_retire(free_after[i], &tree->mem);
+    }
+
+    if (root_latch != NULL)
+        latch_release(root_latch);
+    write_end(tree, &info);
+    buffers_unlock(tree);
+    return found;
+}
+
+value_t bptree_value_create(bptree_t *tree, const void *data, size_t len)
+{
+    if (!__atomic_load_n(&tree->mem.owns_values, __ATOMIC_RELAXED))
+        __atomic_store_n(&tree->mem.owns_values, true, __ATOMIC_RELAXED);
+    return value_store_put(&tree->mem.values, data, len);
+}
+
+void bptree_put(bptree_t *tree, bp_key_t key, const void *data, size_t len)
+{
+    bptree_insert(tree, key, bptree_value_create(tree, data, len));
+}
+
+bool bptree_get_view(bptree_t *tree, bp_key_t key, value_view_t *view)
+{
+    value_t value;
+    if (!bptree_get(tree, key, &value))
+        return false;
+    value_store_view(value, view);
+    return true;
+}
+
+void bptree_read_begin(bptree_t *tree)
+{
+    epoch_enter(&tree->mem.epoch);
+}
+
+void bptree_read_end(bptree_t *tree)
+{
+    epoch_exit(&tree->mem.epoch);
+}
+
+size_t bptree_scan(bptree_t *tree, bp_key_t lo, bp_key_t hi, bptree_scan_fn fn, void *ctx)
+{
+    size_t count = 0;
+    epoch_enter(&tree->mem.epoch);
+
+    // buffered inserts are merged into the entries of the leaves
+    bp_key_t *buffered_keys;
+    value_t *buffered_values;
+    size_t num_buffered = buffers_collect(&tree->mem, lo, hi, &buffered_keys, &buffered_values);
+    size_t b = 0;
+
+    node_t *root = atomic_load(&tree->root);
+    node_t *leaf = root == NULL ? NULL : node_seek_leaf(root, lo, tree->find);
+    bp_key_t from = lo;
+
+    while (leaf != NULL)
+    {
+        // take a consistent copy of the leaf, callbacks may be slow
+        node_t copy;
+        uint64_t version;
+        do
+        {
+            version = node_read_begin(leaf);
+            memcpy_sized(&copy, leaf, 1);
+        } while (!node_read_validate(leaf, version));
+
+        leaf_link_t *next_link = atomic_load(&copy.children.link->next);
+        node_t *next = next_link == NULL ? NULL : atomic_load(&next_link->leaf);
+        if (next != NULL)
+            node_prefetch(next);
+
+        for (int i = 0; i < copy.n; i++)
+        {
+            // skips entries visited before the leaf was split or merged
+            if (copy.keys[i] < from)
+                continue;
+            if (copy.keys[i] > hi)
+                goto rest;
+
+            value_t value = copy.children.values[i];
+            for (; b < num_buffered && buffered_keys[b] <= copy.keys[i]; b++)
+            {
+                // the buffered value of a key is newer
+                if (buffered_keys[b] == copy.keys[i])
+                {
+                    value = buffered_values[b];
+                    continue;
+                }
+                count++;
+                if (!fn(buffered_keys[b], buffered_values[b], ctx))
+                    goto done;
+            }
+
+            count++;
+            if (!fn(copy.keys[i], value, ctx))
+                goto done;
+        }
+
+        // a leaf found by a re-seek can end before from,
+        // so from must never move backwards
+        if (copy.n > 0 && copy.keys[copy.n - 1] >= from)
+        {
+            if (copy.keys[copy.n - 1] >= hi)
+                break;
+            from = copy.keys[copy.n - 1] + 1;
+        }
+
+        if (node_is_obsolete(leaf))
+        {
+            // the leaf was replaced after it was copied. Keys may
+            // have moved into the copied range. Restart from the root.
+            root = atomic_load(&tree->root);
+            leaf = root == NULL ? NULL : node_seek_leaf(root, from, tree->find);
+        }
+        else
+            leaf = next;
+    }
+
+rest:
+    for (; b < num_buffered; b++)
+    {
+        count++;
+        if (!fn(buffered_keys[b], buffered_values[b], ctx))
+            break;
+    }
+
+done:
+    epoch_exit(&tree->mem.epoch);
+    free(buffered_keys);
+    free(buffered_values);
+    return count;
+}
+
+// waits until all writers that passed the root latch are done.
+// Called with the root latch held, so no other writer can start.
+// Updates that bypass the root latch wait until writers_resume.
+static void writers_wait(bptree_t *tree)
+{
+    __atomic_store_n(&tree->mem.paused, true, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&tree->mem.writers, __ATOMIC_SEQ_CST) != 0)
+        _mm_pause();
+}
+
+static void writers_resume(bptree_t *tree)
+{
+    __atomic_store_n(&tree->mem.paused, false, __ATOMIC_RELEASE);
+}
+
+bptree_snapshot_t *bptree_snapshot(bptree_t *tree)
+{
+    bptree_snapshot_t *snapshot = malloc(sizeof(bptree_snapshot_t));
+    snapshot->tree = tree;
+    snapshot->pin = epoch_pin(&tree->mem.epoch);
+
+    // a running write may still modify nodes in place. Once it is done
+    // all nodes are frozen by starting a new generation. Buffered
+    // inserts are applied first, the snapshot only holds the tree.
+    buffers_lock(tree);
+    latch_acquire(&tree->root_latch);
+    writers_wait(tree);
+    tree->mem.generation++;
+    tree->mem.frozen = tree->mem.generation;
+    tree->mem.num_snapshots++;
+    snapshot->root = tree->root;
+    writers_resume(tree);
+    latch_release(&tree->root_latch);
+    buffers_unlock(tree);
+    return snapshot;
+}
+
+bool bptree_snapshot_get(bptree_snapshot_t *snapshot, bp_key_t key, value_t *result)
+{
+    // nodes of the snapshot are never modified, no validation is needed
+    if (snapshot->root == NULL)
+        return false;
+    node_t *leaf = node_seek_leaf(snapshot->root, key, snapshot->tree->find);
+    uint16_t i = snapshot->tree->find(leaf->keys, leaf->n, key);
+    if (i == leaf->n || leaf->keys[i] != key)
+        return false;
+    *result = leaf->children.values[i];
+    return true;
+}
+
+// visits the entries of the subtree of n with lo <= key <= hi in order
+// (see bptree_snapshot_scan). Returns false once the scan is done.
+static bool node_scan(node_t *n, bp_key_t lo, bp_key_t hi, bptree_scan_fn fn, void *ctx, size_t *count, find_index_fn find)
+{
+    if (n->is_leaf)
+    {
+        for (uint16_t i = find(n->keys, n->n, lo); i < n->n; i++)
+        {
+            if (n->keys[i] > hi)
+                return false;
+            (*count)++;
+            if (!fn(n->keys[i], n->children.values[i], ctx))
+                return false;
+        }
+        return true;
+    }
+
+    // the list of leaves links the current versions, so the
+    // leaves of the snapshot are reached through their parents
+    for (uint16_t i = node_child_index(n, lo, find); i <= n->n; i++)
+    {
+        if (!node_scan(n->children.nodes[i], lo, hi, fn, ctx, count, find))
+            return false;
+        if (i < n->n && n->keys[i] > hi)
+            return false;
+    }
+    return true;
+}
+
+size_t bptree_snapshot_scan(bptree_snapshot_t *snapshot, bp_key_t lo, bp_key_t hi, bptree_scan_fn fn, void *ctx)
+{
+    size_t count = 0;
+    if (snapshot->root != NULL)
+        node_scan(snapshot->root, lo, hi, fn, ctx, &count, snapshot->tree->find);
+    return count;
+}
+
+void bptree_snapshot_release(bptree_snapshot_t *snapshot)
+{
+    bptree_t *tree = snapshot->tree;
+    latch_acquire(&tree->root_latch);
+    writers_wait(tree);
+    if (--tree->mem.num_snapshots == 0)
+        tree->mem.frozen = 0;
+    writers_resume(tree);
+    latch_release(&tree->root_latch);
+
+    epoch_unpin(&tree->mem.epoch, snapshot->pin);
+    free(snapshot);
+}
+
+// part of a tree level that is built by one thread of a bulk load
+typedef struct bulk_job_t
+{
+    // built nodes and the smallest key within each node
+    node_t **nodes;
+    bp_key_t *mins;
+    size_t num_nodes;
+
+    // entries of the level below. Sorted keys and values
+    // for leaves, nodes and their smallest keys otherwise.
+    const bp_key_t *keys;
+    const value_t *values;
+    node_t **children;
+    size_t count;
+
+    bptree_mem_t *mem;
+
+    // range of nodes built by this job
+    size_t from;
+    size_t to;
+} bulk_job_t;
+
+// builds the nodes [from, to) of a level. The entries are distributed
+// evenly, so every node receives count / num_nodes entries (rounded).
+static void *bulk_build(void *arg)
+{
+    bulk_job_t *job = (bulk_job_t *)arg;
+    bool is_leaf = job->children == NULL;
+    for (size_t j = job->from; j < job->to; j++)
+    {
+        size_t start = j * job->count / job->num_nodes;
+        size_t end = (j + 1) * job->count / job->num_nodes;
+
+        node_t *n = node_create(is_leaf, job->mem);
+        if (is_leaf)
+        {
+            n->n = end - start;
+            memcpy_sized(n->keys, job->keys + start, n->n);
+            memcpy_sized(n->children.values, job->values + start, n->n);
+            n->children.link = leaf_link_create(n, NULL, job->mem);
+        }
+        else
+        {
+            // separators are the smallest keys of the right children
+            n->n = end - start - 1;
+            memcpy_sized(n->keys, job->keys + start + 1, n->n);
+            memcpy_sized(n->children.nodes, job->children + start, n->n + 1);
+        }
+        job->nodes[j] = n;
+        job->mins[j] = job->keys[start];
+    }
+    return NULL;
+}
+
+// builds a level with num_threads threads
+static void bulk_build_level(bulk_job_t *level, int num_threads)
+{
+    if ((size_t)num_threads > level->num_nodes)
+        num_threads = level->num_nodes;
+
+    pthread_t threads[num_threads];
+    bulk_job_t jobs[num_threads];
+    for (int t = 0; t < num_threads; t++)
+    {
+        jobs[t] = *level;
+        jobs[t].from = t * level->num_nodes / num_threads;
+        jobs[t].to = (t + 1) * level->num_nodes / num_threads;
+        // the calling thread builds the first part itself
+        if (t > 0)
+            pthread_create(&threads[t], NULL, bulk_build, &jobs[t]);
+    }
+    bulk_build(&jobs[0]);
+    for (int t = 1; t < num_threads; t++)
+        pthread_join(threads[t], NULL);
+}
+
+void bptree_bulk_load(bptree_t *tree, const bp_key_t *keys, const value_t *values, size_t n, float fill_factor)
+{
+    bptree_bulk_load_parallel(tree, keys, values, n, fill_factor, 1);
+}
+
+void bptree_bulk_load_parallel(bptree_t *tree, const bp_key_t *keys, const value_t *values, size_t n, float fill_factor, int num_threads)
+{
+    // buffered inserts are removed with the entries of the tree
+    buffers_lock(tree);
+    buffers_unlock(tree);
+    if (tree->root != NULL)
+    {
+        node_free(tree->root, &tree->mem);
+        tree->root = NULL;
+        tree->mem.tail = NULL;
+    }
+    if (n == 0)
+        return;
+
+    if (fill_factor <= 0 || fill_factor > 1)
+        fill_factor = 1;
+    if (num_threads < 1)
+        num_threads = 1;
+
+    // with a fanout of at least 3 the even distribution
+    // gives every inner node at least two children
+    size_t leaf_keys = fill_factor * (ORDER - 1) + 0.5;
+    size_t fanout = fill_factor * ORDER + 0.5;
+    leaf_keys = leaf_keys < 1 ? 1 : leaf_keys;
+    fanout = fanout < 3 ? 3 : fanout;
+
+    bulk_job_t level = {
+        .num_nodes = (n + leaf_keys - 1) / leaf_keys,
+        .keys = keys,
+        .values = values,
+        .children = NULL,
+        .count = n,
+        .mem = &tree->mem,
+    };
+    level.nodes = malloc(level.num_nodes * sizeof(node_t *));
+    level.mins = malloc(level.num_nodes * sizeof(bp_key_t));
+    bulk_build_level(&level, num_threads);
+
+    for (size_t j = 0; j + 1 < level.num_nodes; j++)
+        level.nodes[j]->children.link->next = level.nodes[j + 1]->children.link;
+
+    // build the inner levels until a single root remains
+    while (level.num_nodes > 1)
+    {
+        bulk_job_t parents = {
+            .num_nodes = (level.num_nodes + fanout - 1) / fanout,
+            .keys = level.mins,
+            .children = level.nodes,
+            .count = level.num_nodes,
+            .mem = &tree->mem,
+        };
+        parents.nodes = malloc(parents.num_nodes * sizeof(node_t *));
+        parents.mins = malloc(parents.num_nodes * sizeof(bp_key_t));
+        bulk_build_level(&parents, num_threads);
+
+        free(level.nodes);
+        free(level.mins);
+        level = parents;
+    }
+
+    atomic_store(&tree->root, level.nodes[0]);
+    free(level.nodes);
+    free(level.mins);
+}
+
+// first bytes of a snapshot ("BPTIMAGE")
+#define IMAGE_MAGIC 0x4547414d49544250ULL
+#define IMAGE_VERSION 2
+
+// snapshots are linked for a random 4 GiB slot above this address
+#define IMAGE_BASE 0x200000000000ULL
+#define IMAGE_SLOTS 4096
+
+// header of a snapshot. It is followed by the nodes (level by level, root
+// first), the cells of the leaves (in key order) and the blobs of the values.
+// Pointers within the image are absolute addresses for an image mapped at base.
+typedef struct image_header_t
+{
+    uint64_t magic;
+    uint32_t version;
+    uint16_t key_size;
+    uint16_t order;
+    uint64_t base;
+    uint64_t size;
+    uint64_t num_nodes;
+    uint64_t num_leaves;
+    uint64_t root;
+    bool owns_values;
+} __attribute__((aligned(DCACHE_LINESIZE))) image_header_t;
+
+// moves a pointer within an image by delta bytes
+#define image_move(ptr, delta) ((__typeof__(ptr))((uintptr_t)(ptr) + (delta)))
+
+static inline size_t image_links_offset(const image_header_t *h)
+{
+    return sizeof(image_header_t) + h->num_nodes * sizeof(node_t);
+}
+
+static inline size_t image_blobs_offset(const image_header_t *h)
+{
+    return image_links_offset(h) + h->num_leaves * sizeof(leaf_link_t);
+}
+
+static inline size_t image_blob_size(const value_blob_t *blob)
+{
+    return (sizeof(value_blob_t) + blob->len + sizeof(uintptr_t) - 1) & ~(sizeof(uintptr_t) - 1);
+}
+
+bool bptree_save(bptree_t *tree, const char *path)
+{
+    FILE *f = fopen(path, "wb");
+    if (f == NULL)
+        return false;
+    // the snapshot holds the buffered inserts
+    buffers_lock(tree);
+    buffers_unlock(tree);
+    epoch_enter(&tree->mem.epoch);
+
+    // all nodes in breadth first order. The children of a node
+    // follow the children of the nodes before it on its level.
+    node_t *root = atomic_load(&tree->root);
+    size_t num_nodes = root != NULL, cap = 1024;
+    node_t **nodes = malloc(cap * sizeof(node_t *));
+    nodes[0] = root;
+    size_t num_leaves = 0, blob_bytes = 0;
+    for (size_t i = 0; i < num_nodes; i++)
+    {
+        node_t *n = nodes[i];
+        if (n->is_leaf)
+        {
+            num_leaves++;
+            for (int j = 0; j < n->n && tree->mem.owns_values; j++)
+                if (value_store_blob(n->children.values[j]) != NULL)
+                    blob_bytes += image_blob_size(value_store_blob(n->children.values[j]));
+            continue;
+        }
+        if (num_nodes + n->n + 1 > cap)
+        {
+            cap *= 2;
+            nodes = realloc(nodes, cap * sizeof(node_t *));
+        }
+        memcpy_sized(nodes + num_nodes, n->children.nodes, n->n + 1);
+        num_nodes += n->n + 1;
+    }
+
+    unsigned int seed = getpid() ^ (uintptr_t)tree;
+    image_header_t header = {
+        .magic = IMAGE_MAGIC,
+        .version = IMAGE_VERSION,
+        .key_size = KEY_SIZE,
+        .order = ORDER,
+        .base = IMAGE_BASE + ((uint64_t)(rand_r(&seed) % IMAGE_SLOTS) << 32),
+        .num_nodes = num_nodes,
+        .num_leaves = num_leaves,
+        .owns_values = tree->mem.owns_values,
+    };
+    header.size = image_blobs_offset(&header) + blob_bytes;
+    header.root = root == NULL ? 0 : header.base + sizeof(image_header_t);
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+
+    uint64_t links = header.base + image_links_offset(&header);
+    uint64_t blobs = header.base + image_blobs_offset(&header);
+    size_t next_child = 1, leaf = 0;
+    for (size_t i = 0; i < num_nodes && ok; i++)
+    {
+        node_t copy;
+        memcpy_sized(&copy, nodes[i], 1);
+        copy.version = 0;
+        copy.latch = 0;
+        copy.checkpoint_id = 0;
+        copy.generation = 0;
+        if (copy.is_leaf)
+        {
+            copy.children.link = (leaf_link_t *)(links + leaf++ * sizeof(leaf_link_t));
+            for (int j = 0; j < copy.n && header.owns_values; j++)
+            {
+                value_blob_t *blob = value_store_blob(copy.children.values[j]);
+                if (blob == NULL)
+                    continue;
+                copy.children.values[j] = blobs;
+                blobs += image_blob_size(blob);
+            }
+        }
+        else
+        {
+            for (int j = 0; j <= copy.n; j++)
+                copy.children.nodes[j] = (node_t *)(header.base + sizeof(image_header_t) + next_child++ * sizeof(node_t));
+        }
+        ok = fwrite(&copy, sizeof(copy), 1, f) == 1;
+    }
+
+    // the leaves are the last level, in key order
+    size_t first_leaf = num_nodes - num_leaves;
+    for (size_t i = 0; i < num_leaves && ok; i++)
+    {
+        leaf_link_t link = {
+            .leaf = (node_t *)(header.base + sizeof(image_header_t) + (first_leaf + i) * sizeof(node_t)),
+            .next = i + 1 < num_leaves ? (leaf_link_t *)(links + (i + 1) * sizeof(leaf_link_t)) : NULL,
+            .dead = false,
+        };
+        ok = fwrite(&link, sizeof(link), 1, f) == 1;
+    }
+
+    for (size_t i = first_leaf; i < num_nodes && ok && header.owns_values; i++)
+        for (int j = 0; j < nodes[i]->n && ok; j++)
+        {
+            value_blob_t *blob = value_store_blob(nodes[i]->children.values[j]);
+            if (blob == NULL)
+                continue;
+            char padded[image_blob_size(blob)];
+            memset(padded, 0, sizeof(padded));
+            memcpy(padded, blob, sizeof(value_blob_t) + blob->len);
+            ok = fwrite(padded, sizeof(padded), 1, f) == 1;
+        }
+
+    epoch_exit(&tree->mem.epoch);
+    free(nodes);
+    if (fclose(f) != 0)
+        ok = false;
+    return ok;
+}
+
+// moves the pointers of an image that could not be mapped at its base.
+// Writes to every node, so all pages become private copies.
+static void image_relocate(char *image, const image_header_t *h, uintptr_t delta)
+{
+    node_t *nodes = (node_t *)(image + sizeof(image_header_t));
+    for (size_t i = 0; i < h->num_nodes; i++)
+    {
+        node_t *n = nodes + i;
+        if (!n->is_leaf)
+        {
+            for (int j = 0; j <= n->n; j++)
+                n->children.nodes[j] = image_move(n->children.nodes[j], delta);
+            continue;
+        }
+        n->children.link = image_move(n->children.link, delta);
+        for (int j = 0; j < n->n && h->owns_values; j++)
+            if (value_store_blob(n->children.values[j]) != NULL)
+                n->children.values[j] += delta;
+    }
+
+    leaf_link_t *links = (leaf_link_t *)(image + image_links_offset(h));
+    for (size_t i = 0; i < h->num_leaves; i++)
+    {
+        links[i].leaf = image_move(links[i].leaf, delta);
+        if (links[i].next != NULL)
+            links[i].next = image_move(links[i].next, delta);
+    }
+}
+
+bool bptree_open_mmap(bptree_t *tree, const char *path, bptree_simd_t simd, bptree_write_mode_t write_mode)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    image_header_t header;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+        header.magic != IMAGE_MAGIC || header.version != IMAGE_VERSION ||
+        header.key_size != KEY_SIZE || header.order != ORDER || (uint64_t)st.st_size < header.size)
+    {
+        close(fd);
+        errno = EINVAL;
+        return false;
+    }
+
+    // private mapping: writes to the image (latches, in place updates)
+    // copy the page. The kernel uses base if the range is free.
+    char *image = mmap((void *)header.base, header.size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED)
+        return false;
+
+    uintptr_t delta = (uintptr_t)image - header.base;
+    if (delta != 0)
+        image_relocate(image, &header, delta);
+
+    bptree_init(tree, simd, write_mode);
+    tree->mem.image = image;
+    tree->mem.image_size = header.size;
+    tree->mem.owns_values = header.owns_values;
+    tree->root = header.root == 0 ? NULL : (node_t *)(header.root + delta);
+    return true;
+}
+
+// wal_replay_fn that applies a record to the tree
+static void log_replay(const void *rec, size_t len, void *ctx)
+{
+    bptree_t *tree = ctx;
+    log_head_t head;
+    if (len < sizeof(head))
+        return;
+    memcpy(&head, rec, sizeof(head));
+    switch (head.op)
+    {
+    case LOG_INSERT:
+        bptree_insert(tree, head.key, head.value);
+        break;
+    case LOG_PUT:
+        bptree_put(tree, head.key, (const char *)rec + sizeof(head), len - sizeof(head));
+        break;
+    case LOG_DELETE:
+        bptree_delete(tree, head.key);
+        break;
+    }
+}
+
+bool bptree_wal_open(bptree_t *tree, const char *path)
+{
+    wal_t *wal = malloc(sizeof(wal_t));
+    // the records are applied before the log is attached, so they are not logged again
+    if (!wal_open(wal, path, log_replay, tree))
+    {
+        free(wal);
+        return false;
+    }
+    tree->mem.wal = wal;
+    return true;
+}
+
+int bptree_wal_error(bptree_t *tree)
+{
+    return tree->mem.wal == NULL ? 0 : wal_error(tree->mem.wal);
+}
+
+// layout of the records of the nodes in a checkpoint file
+#define CHECKPOINT_FORMAT ((KEY_SIZE << 16) | ORDER)
+
+// flag of the records of leaves whose values are held by the value store.
+// Values that are 0 are blobs, which follow the values as {uint32_t len; char data[len]}.
+#define RECORD_BLOBS 1
+
+#define record_align(x) (((x) + CHECKPOINT_ALIGN - 1) & ~(size_t)(CHECKPOINT_ALIGN - 1))
+
+// offset of the keys in the record of a node, they follow the ids of the children
+static inline size_t record_keys_offset(bool is_leaf, int n)
+{
+    return record_align(sizeof(checkpoint_record_t) + (is_leaf ? 0 : (n + 1) * sizeof(uint32_t)));
+}
+
+// offset of the values in the record of a leaf
+static inline size_t record_values_offset(int n)
+{
+    return record_align(record_keys_offset(true, n) + n * sizeof(bp_key_t));
+}
+
+// state of bptree_checkpoint
+typedef struct checkpoint_pass_t
+{
+    checkpoint_t *file;
+    bool owns_values;
+
+    // record that is built
+    char *rec;
+    size_t rec_cap;
+
+    // nodes that were written and their ids, set once the checkpoint is durable
+    node_t **nodes;
+    uint32_t *ids;
+    size_t num_nodes;
+    size_t cap;
+} checkpoint_pass_t;
+
+// adds the record of a node to the checkpoint
+static void node_record(node_t *n, uint32_t id, const uint32_t *child_ids, checkpoint_pass_t *pass)
+{
+    bool blobs = n->is_leaf && pass->owns_values;
+    size_t len = record_keys_offset(n->is_leaf, n->n) + n->n * sizeof(bp_key_t);
+    if (n->is_leaf)
+        len = record_values_offset(n->n) + n->n * sizeof(value_t);
+    for (int i = 0; i < n->n && blobs; i++)
+        if (value_store_blob(n->children.values[i]) != NULL)
+            len += sizeof(uint32_t) + value_store_blob(n->children.values[i])->len;
+    len = record_align(len);
+    if (len > pass->rec_cap)
+    {
+        pass->rec_cap = len * 2;
+        pass->rec = realloc(pass->rec, pass->rec_cap);
+    }
+
+    char *rec = pass->rec;
+    memset(rec, 0, len);
+    checkpoint_record_t *head = (checkpoint_record_t *)rec;
+    *head = (checkpoint_record_t){id, len, n->n, n->is_leaf, blobs ? RECORD_BLOBS : 0};
+    memcpy_sized((bp_key_t *)(rec + record_keys_offset(n->is_leaf, n->n)), n->keys, n->n);
+    if (!n->is_leaf)
+        memcpy_sized((uint32_t *)(head + 1), child_ids, n->n + 1);
+    else
+    {
+        value_t *values = (value_t *)(rec + record_values_offset(n->n));
+        char *data = (char *)(values + n->n);
+        for (int i = 0; i < n->n; i++)
+        {
+            value_blob_t *blob = blobs ? value_store_blob(n->children.values[i]) : NULL;
+            values[i] = blob == NULL ? n->children.values[i] : 0;
+            if (blob == NULL)
+                continue;
+            memcpy(data, &blob->len, sizeof(uint32_t));
+            memcpy(data + sizeof(uint32_t), blob->data, blob->len);
+            data += sizeof(uint32_t) + blob->len;
+        }
+    }
+    checkpoint_add(pass->file, head);
+}
+
+// returns the id of a node in the checkpoint. Nodes that are new, were
+// modified in place or have a child with a new id are written again.
+static uint32_t node_checkpoint(node_t *n, checkpoint_pass_t *pass)
+{
+    bool changed = n->checkpoint_id == 0 || (n->checkpoint_id & NODE_DIRTY);
+    uint32_t child_ids[ORDER];
+    for (int i = 0; !n->is_leaf && i <= n->n; i++)
+    {
+        node_t *child = n->children.nodes[i];
+        uint32_t old_id = child->checkpoint_id & ~NODE_DIRTY;
+        child_ids[i] = node_checkpoint(child, pass);
+        changed |= child_ids[i] != old_id;
+    }
+
+    uint32_t id = n->checkpoint_id & ~NODE_DIRTY;
+    if (!changed)
+    {
+        checkpoint_keep(pass->file, id);
+        return id;
+    }
+    if (id == 0)
+        id = checkpoint_new_id(pass->file);
+    node_record(n, id, child_ids, pass);
+
+    if (pass->num_nodes == pass->cap)
+    {
+        pass->cap = pass->cap == 0 ? 1024 : pass->cap * 2;
+        pass->nodes = realloc(pass->nodes, pass->cap * sizeof(node_t *));
+        pass->ids = realloc(pass->ids, pass->cap * sizeof(uint32_t));
+    }
+    pass->nodes[pass->num_nodes] = n;
+    pass->ids[pass->num_nodes++] = id;
+    return id;
+}
+
+// builds the node of a record and its children.
+// Leaves are linked behind *last in key order.
+static node_t *node_load(checkpoint_t *file, uint32_t id, leaf_link_t **last, bptree_mem_t *mem)
+{
+    const checkpoint_record_t *rec = checkpoint_record(file, id);
+    const char *base = (const char *)rec;
+    node_t *n = node_create(rec->is_leaf, mem);
+    n->n = rec->n;
+    n->checkpoint_id = id;
+    memcpy_sized(n->keys, (const bp_key_t *)(base + record_keys_offset(rec->is_leaf, rec->n)), rec->n);
+    if (!rec->is_leaf)
+    {
+        const uint32_t *children = (const uint32_t *)(rec + 1);
+        for (int i = 0; i <= rec->n; i++)
+            n->children.nodes[i] = node_load(file, children[i], last, mem);
+        return n;
+    }
+
+    const value_t *values = (const value_t *)(base + record_values_offset(rec->n));
+    const char *data = (const char *)(values + rec->n);
+    for (int i = 0; i < rec->n; i++)
+    {
+        n->children.values[i] = values[i];
+        if (values[i] != 0 || !(rec->flags & RECORD_BLOBS))
+            continue;
+        uint32_t len;
+        memcpy(&len, data, sizeof(len));
+        n->children.values[i] = value_store_put(&mem->values, data + sizeof(len), len);
+        data += sizeof(len) + len;
+    }
+    if (rec->flags & RECORD_BLOBS)
+        mem->owns_values = true;
+
+    n->children.link = leaf_link_create(n, NULL, mem);
+    if (*last != NULL)
+        (*last)->next = n->children.link;
+    *last = n->children.link;
+    return n;
+}
+
+bool bptree_checkpoint_open(bptree_t *tree, const char *path)
+{
+    checkpoint_t *file = malloc(sizeof(checkpoint_t));
+    if (!checkpoint_open(file, path, CHECKPOINT_FORMAT))
+    {
+        free(file);
+        return false;
+    }
+    if (file->root != 0)
+    {
+        leaf_link_t *last = NULL;
+        tree->root = node_load(file, file->root, &last, &tree->mem);
+    }
+    checkpoint_load_end(file);
+    tree->mem.checkpoint = file;
+    return true;
+}
+
+bool bptree_checkpoint(bptree_t *tree)
+{
+    checkpoint_pass_t pass = {.file = tree->mem.checkpoint, .owns_values = tree->mem.owns_values};
+    // the log is truncated, so the buffered inserts have to be in the checkpoint
+    buffers_lock(tree);
+    buffers_unlock(tree);
+    epoch_enter(&tree->mem.epoch);
+    checkpoint_begin(pass.file);
+    node_t *root = atomic_load(&tree->root);
+    uint32_t root_id = root == NULL ? 0 : node_checkpoint(root, &pass);
+    bool ok = checkpoint_commit(pass.file, root_id);
+    // the nodes are clean once their records are durable
+    for (size_t i = 0; i < pass.num_nodes && ok; i++)
+        pass.nodes[i]->checkpoint_id = pass.ids[i];
+    epoch_exit(&tree->mem.epoch);
+
+    // the log only has to hold the writes after the checkpoint
+    if (ok && tree->mem.wal != NULL)
+        ok = wal_truncate(tree->mem.wal);
+    free(pass.rec);
+    free(pass.nodes);
+    free(pass.ids);
+    return ok;
+}
+
+void bptree_free(bptree_t *tree)
+{
+    // buffered inserts are applied, so their values are freed with the tree
+    if (tree->mem.buffers != NULL)
+    {
+        buffers_lock(tree);
+        free(tree->mem.buffers->active);
+        free(tree->mem.buffers);
+        tree->mem.buffers = NULL;
+    }
+    if (tree->mem.checkpoint != NULL)
+    {
+        checkpoint_close(tree->mem.checkpoint);
+        free(tree->mem.checkpoint);
+        tree->mem.checkpoint = NULL;
+    }
+    if (tree->mem.wal != NULL)
+    {
+        wal_close(tree->mem.wal);
+        free(tree->mem.wal);
+        tree->mem.wal = NULL;
+    }
+    free(tree->mem.combine);
+    tree->mem.combine = NULL;
+    // retired nodes go back to the pools first
+    epoch_destroy(&tree->mem.epoch);
+    // values larger than the largest class of the store are not in a pool
+    if (tree->root != NULL && tree->mem.owns_values)
+        node_free(tree->root, &tree->mem);
+    pool_destroy(&tree->mem.nodes);
+    pool_destroy(&tree->mem.links);
+    value_store_destroy(&tree->mem.values);
+    if (tree->mem.image != NULL)
+        munmap(tree->mem.image, tree->mem.image_size);
+    tree->mem.image = NULL;
+    tree->mem.tail = NULL;
+    tree->root = NULL;
 }
\ No newline at end of file
@@ -0,0 +1,508 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <immintrin.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include "bptree.h"
+#include "bptree_shard.h"
+
+// macros for atomic operations
+#define atomic_store(a, b) __atomic_store_n(a, b, __ATOMIC_RELEASE)
+#define atomic_load(a) __atomic_load_n(a, __ATOMIC_ACQUIRE)
+
+// mixes the bits of a key (finalizer of MurmurHash3)
+static inline uint64_t shard_hash(bp_key_t key)
+{
+    uint64_t h = (uint64_t)key;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+// returns the index of the shard that holds key
+static inline int shard_of(bptree_sharded_t *s, bp_key_t key)
+{
+    if (s->mode == BPTREE_SHARD_HASH)
+        return shard_hash(key) % s->num_shards;
+
+    // number of bounds <= key. A move changes a single bound,
+    // so the bounds are sorted whichever version is read.
+    int lo = 0, hi = s->num_shards - 1;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (key < __atomic_load_n(&s->bounds[mid], __ATOMIC_RELAXED))
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return lo;
+}
+
+// smallest key of shard i (ranges only)
+static inline bp_key_t shard_lower(bptree_sharded_t *s, int i)
+{
+    return i == 0 ? KEY_T_MIN : atomic_load(&s->bounds[i - 1]);
+}
+
+void bptree_sharded_init(bptree_sharded_t *s, int num_shards, bptree_shard_mode_t mode, bool rebalance, bptree_simd_t simd, bptree_write_mode_t write_mode)
+{
+    if (num_shards < 1)
+        num_shards = 1;
+    s->shards = aligned_alloc(64, num_shards * sizeof(bptree_shard_t));
+    s->num_shards = num_shards;
+    s->mode = mode;
+    s->bounds = malloc(num_shards * sizeof(bp_key_t));
+    s->version = 0;
+    s->rebalance = rebalance && mode == BPTREE_SHARD_RANGE;
+    pthread_mutex_init(&s->lock, NULL);
+    s->checked = calloc(num_shards, sizeof(uint64_t));
+    s->num_moves = 0;
+
+    // even split of the key space
+    uint64_t width = ((uint64_t)KEY_T_MAX - (uint64_t)KEY_T_MIN) / num_shards;
+    for (int i = 0; i < num_shards - 1; i++)
+        s->bounds[i] = (bp_key_t)((uint64_t)KEY_T_MIN + (i + 1) * width);
+
+    for (int i = 0; i < num_shards; i++)
+    {
+        bptree_shard_t *shard = &s->shards[i];
+        bptree_init(&shard->tree, simd, write_mode);
+        shard->active = 0;
+        shard->moving = false;
+        shard->writes = 0;
+        memset(shard->samples, 0, sizeof(shard->samples));
+    }
+}
+
+void bptree_sharded_split(bptree_sharded_t *s, const bp_key_t *keys, size_t n)
+{
+    if (s->mode != BPTREE_SHARD_RANGE || n == 0)
+        return;
+    for (int i = 0; i < s->num_shards - 1; i++)
+    {
+        size_t j = (i + 1) * n / s->num_shards;
+        // a shard gets at least one key if there are enough keys
+        s->bounds[i] = keys[j < n ? j : n - 1];
+    }
+}
+
+// starts a get, returns the version that sharded_read_validate checks
+static inline uint64_t sharded_read_begin(bptree_sharded_t *s)
+{
+    uint64_t version;
+    while ((version = atomic_load(&s->version)) & 1)
+        _mm_pause();
+    return version;
+}
+
+// returns true if no key moved since sharded_read_begin returned version
+static inline bool sharded_read_validate(bptree_sharded_t *s, uint64_t version)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&s->version, __ATOMIC_RELAXED) == version;
+}
+
+bool bptree_sharded_get(bptree_sharded_t *s, bp_key_t key, value_t *result)
+{
+    while (true)
+    {
+        uint64_t version = sharded_read_begin(s);
+        value_t value;
+        bool found = bptree_get(&s->shards[shard_of(s, key)].tree, key, &value);
+        if (!sharded_read_validate(s, version))
+            continue;
+        if (found)
+            *result = value;
+        return found;
+    }
+}
+
+size_t bptree_sharded_get_batch(bptree_sharded_t *s, const bp_key_t *keys, size_t n, value_t *results, bool *found)
+{
+    // the keys of shard i are at [start[i], start[i + 1]) of shard_keys,
+    // pos maps them back to their index in keys
+    int *of = malloc(n * sizeof(int));
+    size_t *start = malloc((s->num_shards + 1) * sizeof(size_t));
+    size_t *pos = malloc(n * sizeof(size_t));
+    bp_key_t *shard_keys = malloc(n * sizeof(bp_key_t));
+    value_t *shard_results = malloc(n * sizeof(value_t));
+    bool *shard_found = malloc(n * sizeof(bool));
+    size_t count;
+    while (true)
+    {
+        uint64_t version = sharded_read_begin(s);
+        memset(start, 0, (s->num_shards + 1) * sizeof(size_t));
+        for (size_t i = 0; i < n; i++)
+        {
+            of[i] = shard_of(s, keys[i]);
+            start[of[i] + 1]++;
+        }
+        for (int i = 0; i < s->num_shards; i++)
+            start[i + 1] += start[i];
+        for (size_t i = 0; i < n; i++)
+        {
+            size_t j = start[of[i]]++;
+            pos[j] = i;
+            shard_keys[j] = keys[i];
+        }
+        // start[i] was moved to the end of shard i
+        count = 0;
+        for (int i = 0; i < s->num_shards; i++)
+        {
+            size_t from = i == 0 ? 0 : start[i - 1];
+            if (start[i] > from)
+                count += bptree_get_batch(&s->shards[i].tree, shard_keys + from, start[i] - from, shard_results + from, shard_found + from);
+        }
+        if (sharded_read_validate(s, version))
+            break;
+    }
+
+    for (size_t j = 0; j < n; j++)
+    {
+        found[pos[j]] = shard_found[j];
+        if (shard_found[j])
+            results[pos[j]] = shard_results[j];
+    }
+    free(of);
+    free(start);
+    free(pos);
+    free(shard_keys);
+    free(shard_results);
+    free(shard_found);
+    return count;
+}
+
+bool bptree_sharded_get_view(bptree_sharded_t *s, bp_key_t key, value_view_t *view)
+{
+    value_t value;
+    if (!bptree_sharded_get(s, key, &value))
+        return false;
+    value_store_view(value, view);
+    return true;
+}
+
+// a moved value is retired by its old shard, so
+// a read section covers the epochs of all shards
+void bptree_sharded_read_begin(bptree_sharded_t *s)
+{
+    for (int i = 0; i < s->num_shards; i++)
+        bptree_read_begin(&s->shards[i].tree);
+}
+
+void bptree_sharded_read_end(bptree_sharded_t *s)
+{
+    for (int i = 0; i < s->num_shards; i++)
+        bptree_read_end(&s->shards[i].tree);
+}
+
+/**
+ * @brief enters the shard that holds key for a write or scan.
+ * Waits while keys move from or to the shard.
+ *
+ * @param s store
+ * @param key key that is written
+ * @return bptree_shard_t* shard that has to be passed to shard_exit
+ */
+static bptree_shard_t *shard_enter(bptree_sharded_t *s, bp_key_t key)
+{
+    while (true)
+    {
+        bptree_shard_t *shard = &s->shards[shard_of(s, key)];
+        // sequentially consistent, so either the mover sees the
+        // writer as active or the writer sees the move
+        __atomic_fetch_add(&shard->active, 1, __ATOMIC_SEQ_CST);
+        if (!__atomic_load_n(&shard->moving, __ATOMIC_SEQ_CST) && shard == &s->shards[shard_of(s, key)])
+            return shard;
+
+        __atomic_fetch_sub(&shard->active, 1, __ATOMIC_RELEASE);
+        while (atomic_load(&shard->moving))
+            sched_yield();
+    }
+}
+
+static inline void shard_exit(bptree_shard_t *shard)
+{
+    __atomic_fetch_sub(&shard->active, 1, __ATOMIC_RELEASE);
+}
+
+static bool sharded_rebalance(bptree_sharded_t *s, bool wait);
+
+// leaves a shard after a write to key. Remembers the key
+// and checks for hot shards from time to time.
+static void shard_write_done(bptree_sharded_t *s, bptree_shard_t *shard, bp_key_t key)
+{
+    uint64_t writes = __atomic_fetch_add(&shard->writes, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&shard->samples[writes % SHARD_SAMPLES], key, __ATOMIC_RELAXED);
+    shard_exit(shard);
+    if (s->rebalance && (writes + 1) % SHARD_CHECK_WRITES == 0)
+        sharded_rebalance(s, false);
+}
+
+void bptree_sharded_insert(bptree_sharded_t *s, bp_key_t key, value_t value)
+{
+    bptree_shard_t *shard = shard_enter(s, key);
+    bptree_insert(&shard->tree, key, value);
+    shard_write_done(s, shard, key);
+}
+
+void bptree_sharded_put(bptree_sharded_t *s, bp_key_t key, const void *data, size_t len)
+{
+    bptree_shard_t *shard = shard_enter(s, key);
+    bptree_put(&shard->tree, key, data, len);
+    shard_write_done(s, shard, key);
+}
+
+bool bptree_sharded_delete(bptree_sharded_t *s, bp_key_t key)
+{
+    bptree_shard_t *shard = shard_enter(s, key);
+    bool found = bptree_delete(&shard->tree, key);
+    shard_write_done(s, shard, key);
+    return found;
+}
+
+// callback of a sharded scan, forwards the entries and remembers a stop
+typedef struct shard_scan_t
+{
+    bptree_scan_fn fn;
+    void *ctx;
+    bool stopped;
+} shard_scan_t;
+
+static bool shard_scan_visit(bp_key_t key, value_t value, void *ctx)
+{
+    shard_scan_t *scan = ctx;
+    if (!scan->fn(key, value, scan->ctx))
+        scan->stopped = true;
+    return !scan->stopped;
+}
+
+size_t bptree_sharded_scan(bptree_sharded_t *s, bp_key_t lo, bp_key_t hi, bptree_scan_fn fn, void *ctx)
+{
+    shard_scan_t scan = {fn, ctx, false};
+    size_t count = 0;
+    if (s->mode == BPTREE_SHARD_HASH)
+    {
+        // ranges of hashed shards never move
+        for (int i = 0; i < s->num_shards && !scan.stopped; i++)
+            count += bptree_scan(&s->shards[i].tree, lo, hi, shard_scan_visit, &scan);
+        return count;
+    }
+
+    // the entered shard keeps its range until the scan leaves it
+    bp_key_t from = lo;
+    while (from <= hi && !scan.stopped)
+    {
+        bptree_shard_t *shard = shard_enter(s, from);
+        int i = shard - s->shards;
+        bool last = i == s->num_shards - 1;
+        bp_key_t upper = last ? KEY_T_MAX : atomic_load(&s->bounds[i]);
+        count += bptree_scan(&shard->tree, from, last || upper > hi ? hi : upper - 1, shard_scan_visit, &scan);
+        shard_exit(shard);
+        if (last || upper > hi)
+            break;
+        from = upper;
+    }
+    return count;
+}
+
+value_t bptree_sharded_value_create(bptree_sharded_t *s, bp_key_t key, const void *data, size_t len)
+{
+    return bptree_value_create(&s->shards[shard_of(s, key)].tree, data, len);
+}
+
+void bptree_sharded_bulk_load(bptree_sharded_t *s, const bp_key_t *keys, const value_t *values, size_t n, float fill_factor, int num_threads)
+{
+    if (s->mode == BPTREE_SHARD_RANGE)
+    {
+        // the keys of a shard are consecutive
+        size_t start = 0;
+        for (int i = 0; i < s->num_shards; i++)
+        {
+            size_t end = start;
+            while (end < n && shard_of(s, keys[end]) == i)
+                end++;
+            bptree_bulk_load_parallel(&s->shards[i].tree, keys + start, values + start, end - start, fill_factor, num_threads);
+            start = end;
+        }
+        return;
+    }
+
+    bp_key_t *shard_keys = malloc(n * sizeof(bp_key_t));
+    value_t *shard_values = malloc(n * sizeof(value_t));
+    for (int i = 0; i < s->num_shards; i++)
+    {
+        size_t m = 0;
+        for (size_t j = 0; j < n; j++)
+            if (shard_of(s, keys[j]) == i)
+            {
+                shard_keys[m] = keys[j];
+                shard_values[m++] = values[j];
+            }
+        bptree_bulk_load_parallel(&s->shards[i].tree, shard_keys, shard_values, m, fill_factor, num_threads);
+    }
+    free(shard_keys);
+    free(shard_values);
+}
+
+// entries collected by shard_move
+typedef struct shard_entries_t
+{
+    bp_key_t *keys;
+    value_t *values;
+    size_t n;
+    size_t cap;
+} shard_entries_t;
+
+static bool shard_collect(bp_key_t key, value_t value, void *ctx)
+{
+    shard_entries_t *e = ctx;
+    if (e->n == e->cap)
+    {
+        e->cap = e->cap == 0 ? 1024 : e->cap * 2;
+        e->keys = realloc(e->keys, e->cap * sizeof(bp_key_t));
+        e->values = realloc(e->values, e->cap * sizeof(value_t));
+    }
+    e->keys[e->n] = key;
+    e->values[e->n++] = value;
+    return true;
+}
+
+/**
+ * @brief moves the keys at one end of a shard to its neighbour and sets the
+ * bound between both to bound. Called with s->lock held.
+ *
+ * @param s store with ranges
+ * @param from shard that loses keys
+ * @param to neighbour of from
+ * @param bound new bound between from and to
+ */
+static void shard_move(bptree_sharded_t *s, int from, int to, bp_key_t bound)
+{
+    bptree_shard_t *src = &s->shards[from];
+    bptree_shard_t *dst = &s->shards[to];
+    int b = from < to ? from : to;
+    bp_key_t lo = to < from ? s->bounds[b] : bound;
+    bp_key_t hi = to < from ? bound - 1 : s->bounds[b] - 1;
+
+    __atomic_store_n(&src->moving, true, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&dst->moving, true, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&src->active, __ATOMIC_SEQ_CST) != 0 || __atomic_load_n(&dst->active, __ATOMIC_SEQ_CST) != 0)
+        sched_yield();
+
+    // gets still find the keys in src while they are copied
+    shard_entries_t e = {NULL, NULL, 0, 0};
+    bptree_read_begin(&src->tree);
+    bptree_scan(&src->tree, lo, hi, shard_collect, &e);
+    if (src->tree.mem.owns_values)
+    {
+        // dst gets its own copies of the values
+        for (size_t i = 0; i < e.n; i++)
+        {
+            value_view_t view;
+            value_store_view(e.values[i], &view);
+            e.values[i] = bptree_value_create(&dst->tree, view.data, view.len);
+        }
+    }
+    bptree_insert_batch(&dst->tree, e.keys, e.values, e.n);
+    bptree_read_end(&src->tree);
+
+    // gets that overlap the rest of the move are repeated
+    __atomic_fetch_add(&s->version, 1, __ATOMIC_SEQ_CST);
+    atomic_store(&s->bounds[b], bound);
+    for (size_t i = 0; i < e.n; i++)
+        bptree_delete(&src->tree, e.keys[i]);
+    __atomic_fetch_add(&s->version, 1, __ATOMIC_RELEASE);
+
+    atomic_store(&src->moving, false);
+    atomic_store(&dst->moving, false);
+    s->num_moves++;
+    free(e.keys);
+    free(e.values);
+}
+
+static int key_compare(const void *a, const void *b)
+{
+    bp_key_t x = *(const bp_key_t *)a;
+    bp_key_t y = *(const bp_key_t *)b;
+    return (x > y) - (x < y);
+}
+
+static bool sharded_rebalance(bptree_sharded_t *s, bool wait)
+{
+    if (s->mode != BPTREE_SHARD_RANGE || s->num_shards < 2)
+        return false;
+    if (wait)
+        pthread_mutex_lock(&s->lock);
+    else if (pthread_mutex_trylock(&s->lock) != 0)
+        return false;
+
+    // writes since the last check
+    uint64_t total = 0, hot_writes = 0;
+    int hot = 0;
+    uint64_t delta[s->num_shards];
+    for (int i = 0; i < s->num_shards; i++)
+    {
+        uint64_t writes = __atomic_load_n(&s->shards[i].writes, __ATOMIC_RELAXED);
+        delta[i] = writes - s->checked[i];
+        s->checked[i] = writes;
+        total += delta[i];
+        if (delta[i] > hot_writes)
+        {
+            hot = i;
+            hot_writes = delta[i];
+        }
+    }
+
+    bool moved = false;
+    if (total > 0 && hot_writes * s->num_shards >= SHARD_HOT_FACTOR * total)
+    {
+        // the colder neighbour takes the keys on its side of the median
+        int to = hot == 0 ? 1 : hot == s->num_shards - 1 ? hot - 1 : delta[hot - 1] < delta[hot + 1] ? hot - 1 : hot + 1;
+        bp_key_t lower = shard_lower(s, hot);
+        bp_key_t upper = hot == s->num_shards - 1 ? KEY_T_MAX : s->bounds[hot];
+
+        // samples of the current range of the shard
+        bp_key_t samples[SHARD_SAMPLES];
+        int n = 0;
+        for (int i = 0; i < SHARD_SAMPLES && (uint64_t)i < s->checked[hot]; i++)
+        {
+            bp_key_t key = __atomic_load_n(&s->shards[hot].samples[i], __ATOMIC_RELAXED);
+            if (key >= lower && key < upper)
+                samples[n++] = key;
+        }
+        if (n > 0)
+        {
+            qsort(samples, n, sizeof(bp_key_t), key_compare);
+            bp_key_t median = samples[n / 2];
+            if (median > lower)
+            {
+                shard_move(s, hot, to, median);
+                moved = true;
+            }
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+    return moved;
+}
+
+bool bptree_sharded_rebalance(bptree_sharded_t *s)
+{
+    return sharded_rebalance(s, true);
+}
+
+void bptree_sharded_free(bptree_sharded_t *s)
+{
+    for (int i = 0; i < s->num_shards; i++)
+        bptree_free(&s->shards[i].tree);
+    free(s->shards);
+    free(s->bounds);
+    free(s->checked);
+    pthread_mutex_destroy(&s->lock);
+}
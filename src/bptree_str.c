@@ -0,0 +1,510 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "bptree.h"
+#include "bptree_str.h"
+#include "epoch.h"
+#include "pool.h"
+
+_Static_assert(KEY_SIZE == 8 && STR_ORDER == ORDER, "heads are searched with the kernels of the 64 bit tree");
+
+// macros for atomic operations
+#define atomic_store(a, b) __atomic_store_n(a, b, __ATOMIC_RELEASE)
+#define atomic_load(a) __atomic_load_n(a, __ATOMIC_ACQUIRE)
+
+#define memcpy_sized(dst, src, n) memcpy(dst, src, (n) * sizeof(*(dst)))
+#define memmove_sized(dst, src, n) memmove(dst, src, (n) * sizeof(*(dst)))
+
+// a node with less keys is merged with or borrows from a sibling
+#define STR_MIN_KEYS ((STR_ORDER - 1) / 2)
+
+// a write replaces at most 3 objects per level (node, sibling, separator)
+// and the tree never gets higher than 64 levels
+#define STR_MAX_RETIRED (3 * 64 + 1)
+
+// state of a write. Writers hold the latch of the tree.
+typedef struct str_write_t
+{
+    bptree_str_t *tree;
+
+    // the key that is inserted or deleted
+    const char *key;
+    size_t len;
+    int64_t head;
+
+    // nodes and keys that are unlinked by the write.
+    // They are retired once the new root is published.
+    epoch_entry_t retired[STR_MAX_RETIRED];
+    int num_retired;
+} str_write_t;
+
+// entries of a node while a writer rebuilds it.
+// Large enough for two nodes and the separator between them.
+typedef struct str_entries_t
+{
+    bptree_str_key_t *keys[2 * STR_ORDER];
+    union
+    {
+        value_t values[2 * STR_ORDER];
+        str_node_t *nodes[2 * STR_ORDER + 1];
+    } children;
+    int n;
+    bool is_leaf;
+} str_entries_t;
+
+// returns the head of a key: its first 8 bytes as big endian number
+// with the sign bit flipped, so signed compares order heads like memcmp
+static inline int64_t str_head(const char *key, size_t len)
+{
+    uint64_t head = 0;
+    memcpy(&head, key, len < 8 ? len : 8);
+    return (int64_t)(__builtin_bswap64(head) ^ (1ULL << 63));
+}
+
+// compares a stored key with a key like memcmp
+static inline int str_cmp(const bptree_str_key_t *a, const char *key, size_t len)
+{
+    int c = memcmp(a->data, key, a->len < len ? a->len : len);
+    if (c != 0)
+        return c;
+    return (a->len > len) - (a->len < len);
+}
+
+static bptree_str_key_t *str_key_create(const char *key, size_t len)
+{
+    bptree_str_key_t *k = malloc(sizeof(bptree_str_key_t) + len);
+    k->len = len;
+    memcpy(k->data, key, len);
+    return k;
+}
+
+// returns the shortest prefix of right that is larger than left (left < right)
+static bptree_str_key_t *str_separator(const bptree_str_key_t *left, const bptree_str_key_t *right)
+{
+    uint32_t p = 0;
+    while (p < left->len && left->data[p] == right->data[p])
+        p++;
+    return str_key_create(right->data, p + 1);
+}
+
+// epoch_free_fn for nodes, ctx is the tree
+static void str_node_reclaim(void *node, void *ctx)
+{
+    pool_free(&((bptree_str_t *)ctx)->nodes, node);
+}
+
+// epoch_free_fn for keys and separators
+static void str_key_reclaim(void *key, void *ctx)
+{
+    free(key);
+}
+
+/**
+ * @brief finds the position of a key within a node.
+ * The heads are searched with the SIMD kernel, keys with an
+ * equal head are compared in full.
+ *
+ * @param n a node
+ * @param key the key
+ * @param len length of the key
+ * @param head head of the key (see str_head)
+ * @param find kernel of the tree
+ * @param equal set if keys[i] is the key
+ * @return uint16_t first index i where keys[i] >= key
+ */
+static inline uint16_t str_node_find(const str_node_t *n, const char *key, size_t len, int64_t head, str_find_fn find, bool *equal)
+{
+    uint16_t i = find(n->heads, n->n, head);
+    int c = 1;
+    while (i < n->n && n->heads[i] == head && (c = str_cmp(n->keys[i], key, len)) < 0)
+        i++;
+    *equal = i < n->n && n->heads[i] == head && c == 0;
+    return i;
+}
+
+static inline void str_retire(str_write_t *w, void *ptr, epoch_free_fn free_fn)
+{
+    w->retired[w->num_retired].ptr = ptr;
+    w->retired[w->num_retired].free_fn = free_fn;
+    w->num_retired++;
+}
+
+static void str_write_begin(str_write_t *w, bptree_str_t *tree, const char *key, size_t len)
+{
+    w->tree = tree;
+    w->key = key;
+    w->len = len;
+    w->head = str_head(key, len);
+    w->num_retired = 0;
+    epoch_enter(&tree->epoch);
+    latch_acquire(&tree->latch);
+}
+
+// publishes the new root and retires everything the write replaced
+static void str_write_end(str_write_t *w, str_node_t *root)
+{
+    atomic_store(&w->tree->root, root);
+    for (int i = 0; i < w->num_retired; i++)
+        epoch_retire(&w->tree->epoch, w->retired[i].ptr, w->retired[i].free_fn);
+    latch_release(&w->tree->latch);
+    epoch_exit(&w->tree->epoch);
+}
+
+// appends the keys and children of a node to e
+static void str_entries_append(str_entries_t *e, const str_node_t *node)
+{
+    memcpy_sized(e->keys + e->n, node->keys, node->n);
+    if (node->is_leaf)
+        memcpy_sized(e->children.values + e->n, node->children.values, node->n);
+    else
+        memcpy_sized(e->children.nodes + e->n, node->children.nodes, node->n + 1);
+    e->n += node->n;
+}
+
+static void str_entries_load(str_entries_t *e, const str_node_t *node)
+{
+    e->n = 0;
+    e->is_leaf = node->is_leaf;
+    str_entries_append(e, node);
+}
+
+// inserts key at i with its value (leaves) or its right child (inner nodes)
+static void str_entries_insert(str_entries_t *e, int i, bptree_str_key_t *key, value_t value, str_node_t *right)
+{
+    memmove_sized(e->keys + i + 1, e->keys + i, e->n - i);
+    e->keys[i] = key;
+    if (e->is_leaf)
+    {
+        memmove_sized(e->children.values + i + 1, e->children.values + i, e->n - i);
+        e->children.values[i] = value;
+    }
+    else
+    {
+        memmove_sized(e->children.nodes + i + 2, e->children.nodes + i + 1, e->n - i);
+        e->children.nodes[i + 1] = right;
+    }
+    e->n++;
+}
+
+// removes the key at i with its value (leaves) or its right child (inner nodes)
+static void str_entries_remove(str_entries_t *e, int i)
+{
+    memmove_sized(e->keys + i, e->keys + i + 1, e->n - i - 1);
+    if (e->is_leaf)
+        memmove_sized(e->children.values + i, e->children.values + i + 1, e->n - i - 1);
+    else
+        memmove_sized(e->children.nodes + i + 1, e->children.nodes + i + 2, e->n - i - 1);
+    e->n--;
+}
+
+// creates a node from the keys [from, to) of e.
+// Inner nodes get the children [from, to].
+static str_node_t *str_node_build(bptree_str_t *tree, const str_entries_t *e, int from, int to)
+{
+    str_node_t *n = pool_alloc(&tree->nodes);
+    n->n = to - from;
+    n->is_leaf = e->is_leaf;
+    memcpy_sized(n->keys, e->keys + from, n->n);
+    for (int i = 0; i < STR_ORDER - 1; i++)
+        n->heads[i] = i < n->n ? str_head(n->keys[i]->data, n->keys[i]->len) : INT64_MAX;
+    if (n->is_leaf)
+        memcpy_sized(n->children.values, e->children.values + from, n->n);
+    else
+        memcpy_sized(n->children.nodes, e->children.nodes + from, n->n + 1);
+    return n;
+}
+
+// new version of a subtree after a write
+typedef struct str_update_t
+{
+    str_node_t *node;
+
+    // right half and its separator if the subtree was split
+    str_node_t *right;
+    bptree_str_key_t *sep;
+} str_update_t;
+
+// builds a node from e. Splits it in two if there are too many keys.
+static str_update_t str_node_rebuild(bptree_str_t *tree, const str_entries_t *e)
+{
+    str_update_t u = {NULL, NULL, NULL};
+    if (e->n <= STR_ORDER - 1)
+    {
+        u.node = str_node_build(tree, e, 0, e->n);
+        return u;
+    }
+
+    int m = e->n / 2;
+    u.node = str_node_build(tree, e, 0, m);
+    if (e->is_leaf)
+    {
+        u.sep = str_separator(e->keys[m - 1], e->keys[m]);
+        u.right = str_node_build(tree, e, m, e->n);
+    }
+    else
+    {
+        // the middle separator moves up
+        u.sep = e->keys[m];
+        u.right = str_node_build(tree, e, m + 1, e->n);
+    }
+    return u;
+}
+
+// inserts the key of the write into a copy of the subtree n
+static str_update_t str_node_insert(str_write_t *w, str_node_t *n, value_t value)
+{
+    bool equal;
+    uint16_t i = str_node_find(n, w->key, w->len, w->head, w->tree->find, &equal);
+
+    str_entries_t e;
+    str_entries_load(&e, n);
+    str_retire(w, n, str_node_reclaim);
+    if (n->is_leaf)
+    {
+        if (equal)
+            e.children.values[i] = value;
+        else
+            str_entries_insert(&e, i, str_key_create(w->key, w->len), value, NULL);
+    }
+    else
+    {
+        i += equal;
+        str_update_t u = str_node_insert(w, n->children.nodes[i], value);
+        e.children.nodes[i] = u.node;
+        if (u.right != NULL)
+            str_entries_insert(&e, i, u.sep, 0, u.right);
+    }
+    return str_node_rebuild(w->tree, &e);
+}
+
+// child i of the entries e has too few keys. Merges it with a
+// sibling or moves keys from the sibling into it.
+static void str_node_rebalance(str_write_t *w, str_entries_t *e, int i)
+{
+    int l = i > 0 ? i - 1 : i;
+    str_node_t *left = e->children.nodes[l];
+    str_node_t *right = e->children.nodes[l + 1];
+
+    str_entries_t pair;
+    pair.n = 0;
+    pair.is_leaf = left->is_leaf;
+    str_entries_append(&pair, left);
+    // the separator of inner nodes moves down, the one of leaves is dropped
+    if (pair.is_leaf)
+        str_retire(w, e->keys[l], str_key_reclaim);
+    else
+        pair.keys[pair.n++] = e->keys[l];
+    str_entries_append(&pair, right);
+
+    // the child was just built and is not reachable yet
+    str_node_t *sibling = l == i ? right : left;
+    pool_free(&w->tree->nodes, e->children.nodes[i]);
+    str_retire(w, sibling, str_node_reclaim);
+
+    str_update_t u = str_node_rebuild(w->tree, &pair);
+    e->children.nodes[l] = u.node;
+    if (u.right != NULL)
+    {
+        e->keys[l] = u.sep;
+        e->children.nodes[l + 1] = u.right;
+    }
+    else
+        str_entries_remove(e, l);
+}
+
+// deletes the key of the write from a copy of the subtree n.
+// Returns n itself if the key was not found.
+static str_node_t *str_node_delete(str_write_t *w, str_node_t *n)
+{
+    bool equal;
+    uint16_t i = str_node_find(n, w->key, w->len, w->head, w->tree->find, &equal);
+
+    str_entries_t e;
+    if (n->is_leaf)
+    {
+        if (!equal)
+            return n;
+        str_entries_load(&e, n);
+        str_retire(w, e.keys[i], str_key_reclaim);
+        str_entries_remove(&e, i);
+    }
+    else
+    {
+        i += equal;
+        str_node_t *child = str_node_delete(w, n->children.nodes[i]);
+        if (child == n->children.nodes[i])
+            return n;
+        str_entries_load(&e, n);
+        e.children.nodes[i] = child;
+        if (child->n < STR_MIN_KEYS)
+            str_node_rebalance(w, &e, i);
+    }
+    str_retire(w, n, str_node_reclaim);
+    return str_node_build(w->tree, &e, 0, e.n);
+}
+
+void bptree_str_init(bptree_str_t *tree, bptree_simd_t simd)
+{
+    tree->root = NULL;
+    tree->latch = 0;
+    epoch_init(&tree->epoch, tree);
+    pool_init(&tree->nodes, sizeof(str_node_t), DCACHE_LINESIZE);
+    tree->simd = bptree_simd_resolve(simd);
+    tree->find = find_index_select(tree->simd);
+}
+
+bool bptree_str_get(bptree_str_t *tree, const char *key, size_t len, value_t *result)
+{
+    int64_t head = str_head(key, len);
+    bool found = false;
+    bool equal;
+    epoch_enter(&tree->epoch);
+    str_node_t *n = atomic_load(&tree->root);
+    while (n != NULL && !n->is_leaf)
+    {
+        uint16_t i = str_node_find(n, key, len, head, tree->find, &equal);
+        n = n->children.nodes[i + equal];
+    }
+    if (n != NULL)
+    {
+        uint16_t i = str_node_find(n, key, len, head, tree->find, &equal);
+        if (equal)
+        {
+            *result = n->children.values[i];
+            found = true;
+        }
+    }
+    epoch_exit(&tree->epoch);
+    return found;
+}
+
+void bptree_str_insert(bptree_str_t *tree, const char *key, size_t len, value_t value)
+{
+    str_write_t w;
+    str_write_begin(&w, tree, key, len);
+    str_entries_t e;
+    str_node_t *root = tree->root;
+    if (root == NULL)
+    {
+        e.n = 0;
+        e.is_leaf = true;
+        str_entries_insert(&e, 0, str_key_create(key, len), value, NULL);
+        root = str_node_build(tree, &e, 0, 1);
+    }
+    else
+    {
+        str_update_t u = str_node_insert(&w, root, value);
+        root = u.node;
+        if (u.right != NULL)
+        {
+            e.n = 1;
+            e.is_leaf = false;
+            e.keys[0] = u.sep;
+            e.children.nodes[0] = u.node;
+            e.children.nodes[1] = u.right;
+            root = str_node_build(tree, &e, 0, 1);
+        }
+    }
+    str_write_end(&w, root);
+}
+
+bool bptree_str_delete(bptree_str_t *tree, const char *key, size_t len)
+{
+    str_write_t w;
+    str_write_begin(&w, tree, key, len);
+    str_node_t *root = tree->root;
+    bool found = false;
+    if (root != NULL)
+    {
+        str_node_t *new_root = str_node_delete(&w, root);
+        found = new_root != root;
+        // shrink the tree if the root lost its last key
+        if (found && new_root->n == 0)
+        {
+            str_node_t *empty = new_root;
+            new_root = empty->is_leaf ? NULL : empty->children.nodes[0];
+            pool_free(&tree->nodes, empty);
+        }
+        root = new_root;
+    }
+    str_write_end(&w, root);
+    return found;
+}
+
+// state of a scan
+typedef struct str_scan_t
+{
+    const char *lo;
+    size_t lo_len;
+    int64_t lo_head;
+    const char *hi;
+    size_t hi_len;
+    str_find_fn find;
+    bptree_str_scan_fn fn;
+    void *ctx;
+    size_t count;
+} str_scan_t;
+
+// scans the subtree n. Returns false once the scan is done.
+static bool str_node_scan(str_scan_t *s, const str_node_t *n)
+{
+    bool equal;
+    uint16_t i = str_node_find(n, s->lo, s->lo_len, s->lo_head, s->find, &equal);
+    if (n->is_leaf)
+    {
+        for (; i < n->n; i++)
+        {
+            const bptree_str_key_t *k = n->keys[i];
+            if (str_cmp(k, s->hi, s->hi_len) > 0)
+                return false;
+            s->count++;
+            if (!s->fn(k->data, k->len, n->children.values[i], s->ctx))
+                return false;
+        }
+        return true;
+    }
+
+    for (i += equal; i <= n->n; i++)
+    {
+        // the keys of child i are not smaller than keys[i - 1]
+        if (i > 0 && str_cmp(n->keys[i - 1], s->hi, s->hi_len) > 0)
+            return false;
+        if (!str_node_scan(s, n->children.nodes[i]))
+            return false;
+    }
+    return true;
+}
+
+size_t bptree_str_scan(bptree_str_t *tree, const char *lo, size_t lo_len, const char *hi, size_t hi_len,
+                       bptree_str_scan_fn fn, void *ctx)
+{
+    str_scan_t s = {lo, lo_len, str_head(lo, lo_len), hi, hi_len, tree->find, fn, ctx, 0};
+    epoch_enter(&tree->epoch);
+    str_node_t *root = atomic_load(&tree->root);
+    if (root != NULL)
+        str_node_scan(&s, root);
+    epoch_exit(&tree->epoch);
+    return s.count;
+}
+
+// frees the keys of a subtree, the nodes are released with the pool
+static void str_node_free_keys(str_node_t *n)
+{
+    for (int i = 0; i < n->n; i++)
+        free(n->keys[i]);
+    if (!n->is_leaf)
+        for (int i = 0; i <= n->n; i++)
+            str_node_free_keys(n->children.nodes[i]);
+}
+
+void bptree_str_free(bptree_str_t *tree)
+{
+    // retired nodes and keys are freed first
+    epoch_destroy(&tree->epoch);
+    if (tree->root != NULL)
+        str_node_free_keys(tree->root);
+    pool_destroy(&tree->nodes);
+    tree->root = NULL;
+}
@@ -0,0 +1,437 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "checkpoint.h"
+
+#define CHECKPOINT_MAGIC 0x31305450434b5042ULL // "BPCKPT01"
+
+// size of the write buffers
+#define CHECKPOINT_BUFFER (1 << 20)
+
+// files smaller than this are not compacted
+#define CHECKPOINT_COMPACT_MIN (1 << 20)
+
+#define CHECKPOINT_CHECKSUM_SEED 2166136261u
+
+// FNV-1a over the records of a segment
+static uint32_t checkpoint_checksum(uint32_t hash, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++)
+        hash = (hash ^ p[i]) * 16777619u;
+    return hash;
+}
+
+// writes len bytes at offset, returns false on an error (see errno)
+static bool checkpoint_pwrite(int fd, const void *data, size_t len, uint64_t offset)
+{
+    const char *p = data;
+    while (len > 0)
+    {
+        ssize_t n = pwrite(fd, p, len, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return false;
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return true;
+}
+
+static void writer_init(checkpoint_writer_t *w, int fd, uint64_t start)
+{
+    w->fd = fd;
+    w->start = start;
+    w->len = 0;
+    w->buf_len = 0;
+    w->checksum = CHECKPOINT_CHECKSUM_SEED;
+    w->ok = true;
+}
+
+static void writer_flush(checkpoint_writer_t *w)
+{
+    if (w->ok && w->buf_len > 0)
+        w->ok = checkpoint_pwrite(w->fd, w->buf, w->buf_len, w->start + w->len - w->buf_len);
+    w->buf_len = 0;
+}
+
+static void writer_add(checkpoint_writer_t *w, const void *data, size_t len)
+{
+    w->checksum = checkpoint_checksum(w->checksum, data, len);
+    if (w->buf_len + len > CHECKPOINT_BUFFER)
+        writer_flush(w);
+    w->len += len;
+    if (len > CHECKPOINT_BUFFER)
+    {
+        if (w->ok)
+            w->ok = checkpoint_pwrite(w->fd, data, len, w->start + w->len - len);
+        return;
+    }
+    memcpy(w->buf + w->buf_len, data, len);
+    w->buf_len += len;
+}
+
+// makes room for ids below next_id in the arrays indexed by id
+static void checkpoint_reserve(checkpoint_t *c, size_t next_id)
+{
+    if (next_id <= c->cap)
+        return;
+    size_t cap = c->cap == 0 ? 1024 : c->cap;
+    while (cap < next_id)
+        cap *= 2;
+    c->sizes = realloc(c->sizes, cap * sizeof(uint32_t));
+    c->seen = realloc(c->seen, cap * sizeof(uint32_t));
+    memset(c->sizes + c->cap, 0, (cap - c->cap) * sizeof(uint32_t));
+    memset(c->seen + c->cap, 0, (cap - c->cap) * sizeof(uint32_t));
+    c->cap = cap;
+}
+
+// appends x to a growable array of ids
+static void id_push(uint32_t **ids, size_t *num, size_t *cap, uint32_t x)
+{
+    if (*num == *cap)
+    {
+        *cap = *cap == 0 ? 1024 : *cap * 2;
+        *ids = realloc(*ids, *cap * sizeof(uint32_t));
+    }
+    (*ids)[(*num)++] = x;
+}
+
+/**
+ * @brief reads the complete segments of a mapped file.
+ *
+ * @param map the file
+ * @param size size of the file
+ * @param offsets set to the position of the last record of every id
+ * @param last set to the header of the last complete segment (unchanged if there is none)
+ * @return uint64_t end of the last complete segment
+ */
+static uint64_t checkpoint_scan(const char *map, uint64_t size, uint64_t **offsets, checkpoint_segment_t *last)
+{
+    uint64_t pos = 0;
+    size_t num_offsets = 0;
+    while (pos + sizeof(checkpoint_segment_t) <= size)
+    {
+        checkpoint_segment_t seg;
+        memcpy(&seg, map + pos, sizeof(seg));
+        uint64_t body = pos + sizeof(seg);
+        if (seg.magic != CHECKPOINT_MAGIC || seg.len > size - body ||
+            checkpoint_checksum(CHECKPOINT_CHECKSUM_SEED, map + body, seg.len) != seg.checksum)
+            break;
+
+        if (seg.next_id > num_offsets)
+        {
+            *offsets = realloc(*offsets, seg.next_id * sizeof(uint64_t));
+            memset(*offsets + num_offsets, 0, (seg.next_id - num_offsets) * sizeof(uint64_t));
+            num_offsets = seg.next_id;
+        }
+        for (uint64_t r = body; r + sizeof(checkpoint_record_t) <= body + seg.len;)
+        {
+            const checkpoint_record_t *rec = (const checkpoint_record_t *)(map + r);
+            if (rec->len < sizeof(checkpoint_record_t) || rec->id >= num_offsets)
+                break;
+            (*offsets)[rec->id] = r;
+            r += rec->len;
+        }
+        *last = seg;
+        pos = body + seg.len;
+    }
+    return pos;
+}
+
+// called by checkpoint_reach for every reachable record
+typedef void (*checkpoint_reach_fn)(const checkpoint_record_t *rec, void *ctx);
+
+// visits the records reachable from root, parents before their children
+static void checkpoint_reach(const char *map, const uint64_t *offsets, uint32_t root, checkpoint_reach_fn fn, void *ctx)
+{
+    if (root == 0)
+        return;
+    uint32_t *stack = NULL;
+    size_t top = 0, cap = 0;
+    id_push(&stack, &top, &cap, root);
+    while (top > 0)
+    {
+        const checkpoint_record_t *rec = (const checkpoint_record_t *)(map + offsets[stack[--top]]);
+        fn(rec, ctx);
+        if (rec->is_leaf)
+            continue;
+        // the children follow the header, the leftmost is visited first
+        const uint32_t *children = (const uint32_t *)(rec + 1);
+        for (int i = rec->n; i >= 0; i--)
+            id_push(&stack, &top, &cap, children[i]);
+    }
+    free(stack);
+}
+
+// checkpoint_reach_fn of checkpoint_open
+static void checkpoint_mark(const checkpoint_record_t *rec, void *ctx)
+{
+    checkpoint_t *c = ctx;
+    c->sizes[rec->id] = rec->len;
+    c->seen[rec->id] = c->stamp;
+    c->live_bytes += rec->len;
+}
+
+bool checkpoint_open(checkpoint_t *c, const char *path, uint32_t format)
+{
+    memset(c, 0, sizeof(*c));
+    c->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (c->fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(c->fd, &st) != 0)
+    {
+        close(c->fd);
+        return false;
+    }
+    if (st.st_size > 0)
+    {
+        c->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, c->fd, 0);
+        if (c->map == MAP_FAILED)
+        {
+            close(c->fd);
+            return false;
+        }
+        c->map_size = st.st_size;
+    }
+
+    checkpoint_segment_t last = {.format = format, .root = 0, .next_id = 1};
+    c->size = checkpoint_scan(c->map, st.st_size, &c->offsets, &last);
+    // a partly written segment is cut off
+    if (last.format != format || ftruncate(c->fd, c->size) != 0)
+    {
+        if (last.format != format)
+            errno = EINVAL;
+        checkpoint_load_end(c);
+        close(c->fd);
+        return false;
+    }
+
+    c->path = strdup(path);
+    c->format = format;
+    c->root = last.root;
+    c->next_id = last.next_id;
+    c->stamp = 1;
+    checkpoint_reserve(c, c->next_id);
+    checkpoint_reach(c->map, c->offsets, c->root, checkpoint_mark, c);
+    for (uint32_t id = 1; id < c->next_id; id++)
+        if (c->sizes[id] == 0)
+            id_push(&c->free_ids, &c->num_free, &c->free_cap, id);
+
+    pthread_mutex_init(&c->lock, NULL);
+    c->segment.buf = malloc(CHECKPOINT_BUFFER);
+    return true;
+}
+
+const checkpoint_record_t *checkpoint_record(checkpoint_t *c, uint32_t id)
+{
+    return (const checkpoint_record_t *)(c->map + c->offsets[id]);
+}
+
+void checkpoint_load_end(checkpoint_t *c)
+{
+    if (c->map != NULL)
+        munmap(c->map, c->map_size);
+    free(c->offsets);
+    c->map = NULL;
+    c->offsets = NULL;
+}
+
+void checkpoint_begin(checkpoint_t *c)
+{
+    pthread_mutex_lock(&c->lock);
+    c->stamp++;
+    c->num_new = 0;
+    writer_init(&c->segment, c->fd, c->size + sizeof(checkpoint_segment_t));
+}
+
+uint32_t checkpoint_new_id(checkpoint_t *c)
+{
+    uint32_t id = c->num_free > 0 ? c->free_ids[--c->num_free] : c->next_id++;
+    checkpoint_reserve(c, c->next_id);
+    id_push(&c->new_ids, &c->num_new, &c->new_cap, id);
+    return id;
+}
+
+void checkpoint_add(checkpoint_t *c, const checkpoint_record_t *rec)
+{
+    writer_add(&c->segment, rec, rec->len);
+    c->live_bytes += rec->len;
+    c->live_bytes -= c->sizes[rec->id];
+    c->sizes[rec->id] = rec->len;
+    c->seen[rec->id] = c->stamp;
+}
+
+void checkpoint_keep(checkpoint_t *c, uint32_t id)
+{
+    c->seen[id] = c->stamp;
+}
+
+// checkpoint_reach_fn of the compaction, ctx is the writer of the new file
+static void checkpoint_copy(const checkpoint_record_t *rec, void *ctx)
+{
+    writer_add(ctx, rec, rec->len);
+}
+
+// syncs the directory of path, so a rename in it is durable
+static bool checkpoint_sync_dir(const char *path)
+{
+    char dir[strlen(path) + 2];
+    strcpy(dir, path);
+    char *slash = strrchr(dir, '/');
+    if (slash == NULL)
+        strcpy(dir, ".");
+    else if (slash == dir)
+        slash[1] = '\0';
+    else
+        *slash = '\0';
+    int fd = open(dir, O_RDONLY);
+    if (fd < 0)
+        return false;
+    bool ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+}
+
+// copies the reachable records of the file into a new file, which replaces it
+static void *checkpoint_compact(void *arg)
+{
+    checkpoint_t *c = arg;
+    pthread_mutex_lock(&c->lock);
+    uint64_t end = c->size;
+    int old_fd = c->fd;
+    pthread_mutex_unlock(&c->lock);
+
+    // the file is only appended to, so its first end bytes can be read without the lock
+    char *map = mmap(NULL, end, PROT_READ, MAP_PRIVATE, old_fd, 0);
+    char tmp[strlen(c->path) + sizeof(".compact")];
+    sprintf(tmp, "%s.compact", c->path);
+    int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    bool ok = map != MAP_FAILED && fd >= 0;
+
+    checkpoint_writer_t out;
+    out.buf = malloc(CHECKPOINT_BUFFER);
+    writer_init(&out, fd, sizeof(checkpoint_segment_t));
+    if (ok)
+    {
+        uint64_t *offsets = NULL;
+        checkpoint_segment_t last = {.format = c->format, .root = 0, .next_id = 1};
+        checkpoint_scan(map, end, &offsets, &last);
+        checkpoint_reach(map, offsets, last.root, checkpoint_copy, &out);
+        writer_flush(&out);
+        free(offsets);
+
+        checkpoint_segment_t seg = last;
+        seg.len = out.len;
+        seg.checksum = out.checksum;
+        ok = out.ok && checkpoint_pwrite(fd, &seg, sizeof(seg), 0);
+    }
+    if (map != MAP_FAILED)
+        munmap(map, end);
+
+    pthread_mutex_lock(&c->lock);
+    // the segments written in the meantime reference records by their id,
+    // so they are valid behind the copied records
+    uint64_t pos = sizeof(checkpoint_segment_t) + out.len;
+    for (uint64_t off = end; off < c->size && ok;)
+    {
+        size_t len = c->size - off < CHECKPOINT_BUFFER ? c->size - off : CHECKPOINT_BUFFER;
+        ok = pread(old_fd, out.buf, len, off) == (ssize_t)len &&
+             checkpoint_pwrite(fd, out.buf, len, pos);
+        off += len;
+        pos += len;
+    }
+    ok = ok && fdatasync(fd) == 0 && rename(tmp, c->path) == 0;
+    if (ok)
+    {
+        checkpoint_sync_dir(c->path);
+        c->fd = fd;
+        c->size = pos;
+        c->num_compactions++;
+        close(old_fd);
+    }
+    else if (fd >= 0)
+    {
+        close(fd);
+        unlink(tmp);
+    }
+    c->compact_done = true;
+    pthread_mutex_unlock(&c->lock);
+    free(out.buf);
+    return NULL;
+}
+
+bool checkpoint_commit(checkpoint_t *c, uint32_t root)
+{
+    checkpoint_writer_t *w = &c->segment;
+    writer_flush(w);
+    checkpoint_segment_t seg = {
+        .magic = CHECKPOINT_MAGIC,
+        .len = w->len,
+        .checksum = w->checksum,
+        .format = c->format,
+        .root = root,
+        .next_id = c->next_id,
+    };
+    if (!w->ok || !checkpoint_pwrite(c->fd, &seg, sizeof(seg), c->size) || fdatasync(c->fd) != 0)
+    {
+        // the ids of the new nodes are free again
+        for (size_t i = 0; i < c->num_new; i++)
+        {
+            c->live_bytes -= c->sizes[c->new_ids[i]];
+            c->sizes[c->new_ids[i]] = 0;
+            id_push(&c->free_ids, &c->num_free, &c->free_cap, c->new_ids[i]);
+        }
+        pthread_mutex_unlock(&c->lock);
+        return false;
+    }
+    c->size += sizeof(seg) + seg.len;
+    c->root = root;
+
+    // nodes that were not reached were replaced or deleted
+    for (uint32_t id = 1; id < c->next_id; id++)
+        if (c->sizes[id] != 0 && c->seen[id] != c->stamp)
+        {
+            c->live_bytes -= c->sizes[id];
+            c->sizes[id] = 0;
+            id_push(&c->free_ids, &c->num_free, &c->free_cap, id);
+        }
+
+    if (c->compacting && c->compact_done)
+    {
+        pthread_join(c->compactor, NULL);
+        c->compacting = false;
+    }
+    if (!c->compacting && c->size > CHECKPOINT_COMPACT_MIN && c->size > 2 * c->live_bytes)
+    {
+        c->compact_done = false;
+        c->compacting = pthread_create(&c->compactor, NULL, checkpoint_compact, c) == 0;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return true;
+}
+
+void checkpoint_close(checkpoint_t *c)
+{
+    if (c->compacting)
+        pthread_join(c->compactor, NULL);
+    close(c->fd);
+    pthread_mutex_destroy(&c->lock);
+    free(c->path);
+    free(c->sizes);
+    free(c->seen);
+    free(c->free_ids);
+    free(c->new_ids);
+    free(c->segment.buf);
+}
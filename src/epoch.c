@@ -0,0 +1,271 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "epoch.h"
+
+#define EPOCH_ACTIVE 1
+
+// source for unique domain ids. 0 marks an empty tls slot
+static uint64_t next_domain_id = 1;
+
+// per thread cache of records (indexed by domain id)
+static __thread struct
+{
+    uint64_t id;
+    epoch_record_t *record;
+} tls_records[EPOCH_TLS_SLOTS];
+
+// live domains. Protects the list and the owner of released records.
+static pthread_mutex_t domains_lock = PTHREAD_MUTEX_INITIALIZER;
+static epoch_t *domains = NULL;
+
+// its destructor releases the records of an exiting thread
+static pthread_key_t exit_key;
+static pthread_once_t exit_key_once = PTHREAD_ONCE_INIT;
+static __thread bool exit_registered = false;
+
+static void epoch_thread_exit(void *arg);
+
+static void exit_key_create(void)
+{
+    pthread_key_create(&exit_key, epoch_thread_exit);
+}
+
+void epoch_init(epoch_t *e, void *ctx)
+{
+    e->global = 0;
+    e->records = NULL;
+    e->id = __atomic_fetch_add(&next_domain_id, 1, __ATOMIC_RELAXED);
+    e->ctx = ctx;
+
+    pthread_mutex_lock(&domains_lock);
+    e->next = domains;
+    domains = e;
+    pthread_mutex_unlock(&domains_lock);
+}
+
+// returns the record of the calling thread. Takes over a released
+// record or creates a new one if the thread has none yet.
+static epoch_record_t *epoch_record(epoch_t *e)
+{
+    int slot = e->id % EPOCH_TLS_SLOTS;
+    if (tls_records[slot].id == e->id)
+        return tls_records[slot].record;
+
+    if (!exit_registered)
+    {
+        // the destructor only runs for a key with a value
+        pthread_once(&exit_key_once, exit_key_create);
+        pthread_setspecific(exit_key, (void *)1);
+        exit_registered = true;
+    }
+
+    // the owner of a record is set before it is no longer released
+    pthread_t self = pthread_self();
+    epoch_record_t *rec = __atomic_load_n(&e->records, __ATOMIC_ACQUIRE);
+    while (rec != NULL && (rec->is_pin || __atomic_load_n(&rec->released, __ATOMIC_ACQUIRE) || !pthread_equal(__atomic_load_n(&rec->owner, __ATOMIC_RELAXED), self)))
+        rec = rec->next;
+
+    if (rec == NULL)
+    {
+        pthread_mutex_lock(&domains_lock);
+        rec = __atomic_load_n(&e->records, __ATOMIC_ACQUIRE);
+        while (rec != NULL && !(rec->released && !rec->is_pin))
+            rec = rec->next;
+        if (rec != NULL)
+        {
+            __atomic_store_n(&rec->owner, self, __ATOMIC_RELAXED);
+            __atomic_store_n(&rec->released, false, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&domains_lock);
+    }
+
+    if (rec == NULL)
+    {
+        rec = aligned_alloc(64, sizeof(epoch_record_t));
+        memset(rec, 0, sizeof(epoch_record_t));
+        rec->owner = self;
+        rec->next = __atomic_load_n(&e->records, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&e->records, &rec->next, rec, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+
+    tls_records[slot].id = e->id;
+    tls_records[slot].record = rec;
+    return rec;
+}
+
+void epoch_enter(epoch_t *e)
+{
+    epoch_record_t *rec = epoch_record(e);
+    if (rec->nesting++ == 0)
+    {
+        uint64_t global = __atomic_load_n(&e->global, __ATOMIC_RELAXED);
+        // sequentially consistent so the announcement is visible
+        // before any shared pointer is loaded
+        __atomic_store_n(&rec->local, (global << 1) | EPOCH_ACTIVE, __ATOMIC_SEQ_CST);
+    }
+}
+
+void epoch_exit(epoch_t *e)
+{
+    epoch_record_t *rec = epoch_record(e);
+    if (--rec->nesting == 0)
+        __atomic_store_n(&rec->local, 0, __ATOMIC_RELEASE);
+}
+
+epoch_record_t *epoch_pin(epoch_t *e)
+{
+    // reuse a released pin. Pins only block the global epoch,
+    // they never retire objects, so their limbo lists stay empty.
+    epoch_record_t *pin = __atomic_load_n(&e->records, __ATOMIC_ACQUIRE);
+    while (pin != NULL && !(pin->is_pin && __atomic_exchange_n(&pin->nesting, 1, __ATOMIC_ACQUIRE) == 0))
+        pin = pin->next;
+
+    if (pin == NULL)
+    {
+        pin = aligned_alloc(64, sizeof(epoch_record_t));
+        memset(pin, 0, sizeof(epoch_record_t));
+        pin->is_pin = true;
+        pin->nesting = 1;
+        pin->next = __atomic_load_n(&e->records, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&e->records, &pin->next, pin, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+
+    // same announcement as epoch_enter
+    uint64_t global = __atomic_load_n(&e->global, __ATOMIC_RELAXED);
+    __atomic_store_n(&pin->local, (global << 1) | EPOCH_ACTIVE, __ATOMIC_SEQ_CST);
+    return pin;
+}
+
+void epoch_unpin(epoch_t *e, epoch_record_t *pin)
+{
+    __atomic_store_n(&pin->local, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&pin->nesting, 0, __ATOMIC_RELEASE);
+}
+
+// frees all objects within a limbo list
+static void limbo_free(epoch_limbo_t *limbo, void *ctx)
+{
+    for (size_t i = 0; i < limbo->n; i++)
+        limbo->entries[i].free_fn(limbo->entries[i].ptr, ctx);
+    limbo->n = 0;
+}
+
+/**
+ * @brief advances the global epoch if all active threads observed it
+ *
+ * @param e epoch domain
+ * @return uint64_t the (possibly new) global epoch
+ */
+static uint64_t epoch_try_advance(epoch_t *e)
+{
+    uint64_t global = __atomic_load_n(&e->global, __ATOMIC_SEQ_CST);
+    for (epoch_record_t *rec = __atomic_load_n(&e->records, __ATOMIC_ACQUIRE); rec != NULL; rec = rec->next)
+    {
+        uint64_t local = __atomic_load_n(&rec->local, __ATOMIC_SEQ_CST);
+        if ((local & EPOCH_ACTIVE) && (local >> 1) != global)
+            return global;
+    }
+    if (__atomic_compare_exchange_n(&e->global, &global, global + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+        return global + 1;
+    return global;
+}
+
+// frees all limbo lists of a record that are at least two epochs old
+static void epoch_reclaim(epoch_t *e, epoch_record_t *rec, uint64_t global)
+{
+    for (int i = 0; i < EPOCH_LIMBO_LISTS; i++)
+    {
+        epoch_limbo_t *limbo = &rec->limbo[i];
+        if (limbo->n > 0 && limbo->epoch + 2 <= global)
+        {
+            rec->pending -= limbo->n;
+            limbo_free(limbo, e->ctx);
+        }
+    }
+}
+
+// releases the records of an exiting thread in all live domains, so the
+// record lists do not grow with every thread. The objects that can be
+// freed already are freed, the others by the thread that takes the record.
+static void epoch_thread_exit(void *arg)
+{
+    pthread_t self = pthread_self();
+    pthread_mutex_lock(&domains_lock);
+    for (epoch_t *e = domains; e != NULL; e = e->next)
+    {
+        for (epoch_record_t *rec = __atomic_load_n(&e->records, __ATOMIC_ACQUIRE); rec != NULL; rec = rec->next)
+        {
+            if (rec->is_pin || rec->released || !pthread_equal(rec->owner, self))
+                continue;
+            // the free functions can return the objects to pools. The
+            // thread then gets pool caches again, which are released by
+            // the destructor of the pools when it runs (again) after this one.
+            epoch_reclaim(e, rec, epoch_try_advance(e));
+            __atomic_store_n(&rec->released, true, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&domains_lock);
+}
+
+void epoch_retire(epoch_t *e, void *ptr, epoch_free_fn free_fn)
+{
+    epoch_record_t *rec = epoch_record(e);
+
+    // the object was unlinked before. Make sure we do not
+    // read an epoch that is older than the unlink.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    uint64_t global = __atomic_load_n(&e->global, __ATOMIC_SEQ_CST);
+
+    epoch_limbo_t *limbo = &rec->limbo[global % EPOCH_LIMBO_LISTS];
+    if (limbo->epoch != global)
+    {
+        // list contains objects of epoch global - 3 (or older)
+        rec->pending -= limbo->n;
+        limbo_free(limbo, e->ctx);
+        limbo->epoch = global;
+    }
+
+    if (limbo->n == limbo->cap)
+    {
+        limbo->cap = limbo->cap == 0 ? EPOCH_BATCH_SIZE : limbo->cap * 2;
+        limbo->entries = realloc(limbo->entries, limbo->cap * sizeof(epoch_entry_t));
+    }
+    limbo->entries[limbo->n].ptr = ptr;
+    limbo->entries[limbo->n].free_fn = free_fn;
+    limbo->n++;
+
+    if (++rec->pending >= EPOCH_BATCH_SIZE)
+        epoch_reclaim(e, rec, epoch_try_advance(e));
+}
+
+void epoch_destroy(epoch_t *e)
+{
+    // exiting threads must not find the records anymore
+    pthread_mutex_lock(&domains_lock);
+    epoch_t **prev = &domains;
+    while (*prev != NULL && *prev != e)
+        prev = &(*prev)->next;
+    if (*prev != NULL)
+        *prev = e->next;
+    pthread_mutex_unlock(&domains_lock);
+
+    epoch_record_t *rec = e->records;
+    while (rec != NULL)
+    {
+        epoch_record_t *next = rec->next;
+        for (int i = 0; i < EPOCH_LIMBO_LISTS; i++)
+        {
+            limbo_free(&rec->limbo[i], e->ctx);
+            free(rec->limbo[i].entries);
+        }
+        free(rec);
+        rec = next;
+    }
+    e->records = NULL;
+}
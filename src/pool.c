@@ -0,0 +1,249 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "pool.h"
+
+// source for unique pool ids. 0 marks an empty tls slot
+static uint64_t next_pool_id = 1;
+
+// per thread cache of caches (indexed by pool id)
+static __thread struct
+{
+    uint64_t id;
+    pool_cache_t *cache;
+} tls_caches[POOL_TLS_SLOTS];
+
+// live pools. Protects the list.
+static pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;
+static pool_t *pools = NULL;
+
+// its destructor releases the caches of an exiting thread
+static pthread_key_t exit_key;
+static pthread_once_t exit_key_once = PTHREAD_ONCE_INIT;
+static __thread bool exit_registered = false;
+
+static void pool_thread_exit(void *arg);
+
+static void exit_key_create(void)
+{
+    pthread_key_create(&exit_key, pool_thread_exit);
+}
+
+void pool_init(pool_t *p, size_t obj_size, size_t align)
+{
+    if (obj_size < sizeof(pool_object_t))
+        obj_size = sizeof(pool_object_t);
+    if (align < sizeof(void *))
+        align = sizeof(void *);
+
+    p->align = align;
+    p->slot_size = (obj_size + align - 1) & ~(align - 1);
+    p->slabs = NULL;
+    p->batches = NULL;
+    pthread_spin_init(&p->lock, PTHREAD_PROCESS_PRIVATE);
+    p->caches = NULL;
+    p->id = __atomic_fetch_add(&next_pool_id, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&pools_lock);
+    p->next = pools;
+    pools = p;
+    pthread_mutex_unlock(&pools_lock);
+}
+
+// returns the cache of the calling thread. Takes over a released
+// cache or creates a new one if the thread has none yet.
+static pool_cache_t *pool_cache(pool_t *p)
+{
+    int slot = p->id % POOL_TLS_SLOTS;
+    if (tls_caches[slot].id == p->id)
+        return tls_caches[slot].cache;
+
+    if (!exit_registered)
+    {
+        // the destructor only runs for a key with a value. A thread
+        // that frees objects in other destructors after its caches
+        // were released registers again, so they are released again.
+        pthread_once(&exit_key_once, exit_key_create);
+        pthread_setspecific(exit_key, (void *)1);
+        exit_registered = true;
+    }
+
+    // the owner of a cache is set before it is no longer released
+    pthread_t self = pthread_self();
+    pool_cache_t *cache = __atomic_load_n(&p->caches, __ATOMIC_ACQUIRE);
+    while (cache != NULL && (__atomic_load_n(&cache->released, __ATOMIC_ACQUIRE) || !pthread_equal(__atomic_load_n(&cache->owner, __ATOMIC_RELAXED), self)))
+        cache = cache->next;
+
+    if (cache == NULL)
+    {
+        pthread_spin_lock(&p->lock);
+        cache = p->caches;
+        while (cache != NULL && !cache->released)
+            cache = cache->next;
+        if (cache != NULL)
+        {
+            __atomic_store_n(&cache->owner, self, __ATOMIC_RELAXED);
+            __atomic_store_n(&cache->released, false, __ATOMIC_RELEASE);
+        }
+        pthread_spin_unlock(&p->lock);
+    }
+
+    if (cache == NULL)
+    {
+        cache = aligned_alloc(64, sizeof(pool_cache_t));
+        memset(cache, 0, sizeof(pool_cache_t));
+        cache->owner = self;
+        cache->next = __atomic_load_n(&p->caches, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&p->caches, &cache->next, cache, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+
+    tls_caches[slot].id = p->id;
+    tls_caches[slot].cache = cache;
+    return cache;
+}
+
+// releases the caches of an exiting thread
+static void pool_thread_exit(void *arg)
+{
+    pthread_t self = pthread_self();
+    pthread_mutex_lock(&pools_lock);
+    for (pool_t *p = pools; p != NULL; p = p->next)
+    {
+        pthread_spin_lock(&p->lock);
+        for (pool_cache_t *cache = p->caches; cache != NULL; cache = cache->next)
+            if (!cache->released && pthread_equal(cache->owner, self))
+                __atomic_store_n(&cache->released, true, __ATOMIC_RELEASE);
+        pthread_spin_unlock(&p->lock);
+    }
+    pthread_mutex_unlock(&pools_lock);
+
+    // objects freed by later destructors go to a cache taken over again
+    memset(tls_caches, 0, sizeof(tls_caches));
+    exit_registered = false;
+}
+
+// refills an empty cache with a batch of the pool, the objects and
+// the slab rest of a released cache or a new slab
+static void pool_refill(pool_t *p, pool_cache_t *cache)
+{
+    pthread_spin_lock(&p->lock);
+    pool_object_t *batch = p->batches;
+    if (batch != NULL)
+        p->batches = batch->next_batch;
+
+    pool_cache_t *orphan = NULL;
+    if (batch == NULL)
+    {
+        orphan = p->caches;
+        while (orphan != NULL && !(orphan->released && (orphan->free != NULL || (size_t)(orphan->end - orphan->bump) >= p->slot_size)))
+            orphan = orphan->next;
+        if (orphan != NULL)
+        {
+            cache->free = orphan->free;
+            cache->n = orphan->n;
+            cache->bump = orphan->bump;
+            cache->end = orphan->end;
+            orphan->free = NULL;
+            orphan->n = 0;
+            orphan->bump = NULL;
+            orphan->end = NULL;
+        }
+    }
+    pthread_spin_unlock(&p->lock);
+
+    if (batch != NULL)
+    {
+        cache->free = batch;
+        cache->n = POOL_BATCH_SIZE;
+        return;
+    }
+    if (orphan != NULL)
+        return;
+
+    char *slab = aligned_alloc(p->align < 64 ? 64 : p->align, POOL_SLAB_SIZE);
+    if (slab == NULL)
+    {
+        perror("pool: can not allocate slab");
+        exit(1);
+    }
+
+    // the first slot links the slabs
+    void **link = (void **)slab;
+    *link = __atomic_load_n(&p->slabs, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&p->slabs, link, slab, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+
+    cache->bump = slab + p->slot_size;
+    cache->end = slab + POOL_SLAB_SIZE;
+}
+
+void *pool_alloc(pool_t *p)
+{
+    pool_cache_t *cache = pool_cache(p);
+    if (cache->free == NULL && (size_t)(cache->end - cache->bump) < p->slot_size)
+        pool_refill(p, cache);
+
+    if (cache->free != NULL)
+    {
+        pool_object_t *obj = cache->free;
+        cache->free = obj->next;
+        cache->n--;
+        return obj;
+    }
+
+    void *obj = cache->bump;
+    cache->bump += p->slot_size;
+    return obj;
+}
+
+void pool_free(pool_t *p, void *ptr)
+{
+    pool_cache_t *cache = pool_cache(p);
+    pool_object_t *obj = (pool_object_t *)ptr;
+    obj->next = cache->free;
+    cache->free = obj;
+
+    if (++cache->n == POOL_BATCH_SIZE)
+    {
+        // hand the whole list to other threads
+        pthread_spin_lock(&p->lock);
+        obj->next_batch = p->batches;
+        p->batches = obj;
+        pthread_spin_unlock(&p->lock);
+        cache->free = NULL;
+        cache->n = 0;
+    }
+}
+
+void pool_destroy(pool_t *p)
+{
+    pthread_mutex_lock(&pools_lock);
+    pool_t **prev = &pools;
+    while (*prev != p)
+        prev = &(*prev)->next;
+    *prev = p->next;
+    pthread_mutex_unlock(&pools_lock);
+
+    void *slab = p->slabs;
+    while (slab != NULL)
+    {
+        void *next = *(void **)slab;
+        free(slab);
+        slab = next;
+    }
+    p->slabs = NULL;
+    p->batches = NULL;
+
+    pool_cache_t *cache = p->caches;
+    while (cache != NULL)
+    {
+        pool_cache_t *next = cache->next;
+        free(cache);
+        cache = next;
+    }
+    p->caches = NULL;
+}
@@ -0,0 +1,70 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "value_store.h"
+
+#define VALUE_CLASS_SIZE(c) ((size_t)16 << (c))
+
+// returns the smallest class whose slots fit a blob of len bytes
+// (VALUE_CLASSES if the blob is allocated with malloc)
+static inline int value_class(size_t len)
+{
+    int c = 0;
+    while (c < VALUE_CLASSES && VALUE_CLASS_SIZE(c) < sizeof(value_blob_t) + len)
+        c++;
+    return c;
+}
+
+void value_store_init(value_store_t *s)
+{
+    for (int c = 0; c < VALUE_CLASSES; c++)
+        pool_init(&s->classes[c], VALUE_CLASS_SIZE(c), sizeof(uintptr_t));
+}
+
+uintptr_t value_store_put(value_store_t *s, const void *data, size_t len)
+{
+    if (len <= VALUE_INLINE_MAX)
+    {
+        // lowest byte: (len << 1) | 1, the data follows in the higher bytes
+        uintptr_t value = 0;
+        memcpy((char *)&value + 1, data, len);
+        return value | (len << 1) | 1;
+    }
+
+    int c = value_class(len);
+    value_blob_t *blob = c < VALUE_CLASSES ? pool_alloc(&s->classes[c]) : malloc(sizeof(value_blob_t) + len);
+    blob->len = len;
+    memcpy(blob->data, data, len);
+    return (uintptr_t)blob;
+}
+
+void value_store_view(uintptr_t value, value_view_t *view)
+{
+    value_blob_t *blob = value_store_blob(value);
+    if (blob != NULL)
+    {
+        view->data = blob->data;
+        view->len = blob->len;
+        return;
+    }
+    view->len = (value & 0xff) >> 1;
+    memcpy(view->inline_data, (char *)&value + 1, view->len);
+    view->data = view->inline_data;
+}
+
+void value_store_free(value_store_t *s, value_blob_t *blob)
+{
+    int c = value_class(blob->len);
+    if (c < VALUE_CLASSES)
+        pool_free(&s->classes[c], blob);
+    else
+        free(blob);
+}
+
+void value_store_destroy(value_store_t *s)
+{
+    for (int c = 0; c < VALUE_CLASSES; c++)
+        pool_destroy(&s->classes[c]);
+}
@@ -0,0 +1,211 @@
+#include <stdio.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "wal.h"
+
+// initial size of the buffers
+#define WAL_BUFFER_SIZE (1 << 16)
+
+// FNV-1a over the record
+static uint32_t wal_checksum(uint32_t hash, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++)
+        hash = (hash ^ p[i]) * 16777619u;
+    return hash;
+}
+
+// replays the records of the file and returns the length of the valid part
+static size_t wal_replay(int fd, wal_replay_fn fn, void *ctx)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0)
+        return 0;
+    char *log = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (log == MAP_FAILED)
+        return 0;
+
+    size_t pos = 0;
+    while (pos + sizeof(wal_record_t) <= (size_t)st.st_size)
+    {
+        wal_record_t rec;
+        memcpy(&rec, log + pos, sizeof(rec));
+        const char *data = log + pos + sizeof(rec);
+        if (rec.len > st.st_size - pos - sizeof(rec) || wal_checksum(2166136261u ^ rec.len, data, rec.len) != rec.checksum)
+            break;
+        fn(data, rec.len, ctx);
+        pos += sizeof(rec) + rec.len;
+    }
+    munmap(log, st.st_size);
+    return pos;
+}
+
+bool wal_open(wal_t *w, const char *path, wal_replay_fn fn, void *ctx)
+{
+    w->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (w->fd < 0)
+        return false;
+
+    size_t valid = wal_replay(w->fd, fn, ctx);
+    if (ftruncate(w->fd, valid) != 0 || lseek(w->fd, valid, SEEK_SET) < 0)
+    {
+        close(w->fd);
+        return false;
+    }
+
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->synced, NULL);
+    w->cap = w->spare_cap = WAL_BUFFER_SIZE;
+    w->buf = malloc(w->cap);
+    w->spare = malloc(w->spare_cap);
+    w->len = 0;
+    w->appended = w->durable = valid;
+    w->flushing = false;
+    w->error = 0;
+    w->num_records = w->num_syncs = 0;
+    return true;
+}
+
+uint64_t wal_append(wal_t *w, const void *head, size_t head_len, const void *data, size_t data_len)
+{
+    wal_record_t rec;
+    rec.len = head_len + data_len;
+    rec.checksum = wal_checksum(wal_checksum(2166136261u ^ rec.len, head, head_len), data, data_len);
+    size_t size = sizeof(rec) + rec.len;
+
+    pthread_mutex_lock(&w->lock);
+    if (w->error != 0)
+    {
+        // the record can not become durable anymore, only its lsn is counted
+        w->appended += size;
+        uint64_t lsn = w->appended;
+        pthread_mutex_unlock(&w->lock);
+        return lsn;
+    }
+    if (w->len + size > w->cap)
+    {
+        while (w->len + size > w->cap)
+            w->cap *= 2;
+        w->buf = realloc(w->buf, w->cap);
+    }
+    char *dst = w->buf + w->len;
+    memcpy(dst, &rec, sizeof(rec));
+    memcpy(dst + sizeof(rec), head, head_len);
+    if (data_len > 0)
+        memcpy(dst + sizeof(rec) + head_len, data, data_len);
+    w->len += size;
+    w->appended += size;
+    w->num_records++;
+    uint64_t lsn = w->appended;
+    pthread_mutex_unlock(&w->lock);
+    return lsn;
+}
+
+// writes len bytes, returns false on an error (see errno)
+static bool wal_write(int fd, const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return false;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool wal_sync(wal_t *w, uint64_t lsn)
+{
+    pthread_mutex_lock(&w->lock);
+    while (w->durable < lsn && w->error == 0)
+    {
+        if (w->flushing)
+        {
+            pthread_cond_wait(&w->synced, &w->lock);
+            continue;
+        }
+
+        // become the leader: write everything that was appended so far.
+        // Other writers append to the swapped buffer in the meantime.
+        w->flushing = true;
+        char *data = w->buf;
+        size_t len = w->len;
+        size_t cap = w->cap;
+        uint64_t end = w->appended;
+        w->buf = w->spare;
+        w->cap = w->spare_cap;
+        w->len = 0;
+        pthread_mutex_unlock(&w->lock);
+
+        bool ok = wal_write(w->fd, data, len) && fdatasync(w->fd) == 0;
+        int error = errno;
+
+        pthread_mutex_lock(&w->lock);
+        w->spare = data;
+        w->spare_cap = cap;
+        // the records of a failed write are lost, as are all later ones
+        if (ok)
+            w->durable = end;
+        else
+            w->error = error;
+        w->flushing = false;
+        w->num_syncs++;
+        pthread_cond_broadcast(&w->synced);
+    }
+    bool durable = w->durable >= lsn;
+    pthread_mutex_unlock(&w->lock);
+    return durable;
+}
+
+bool wal_truncate(wal_t *w)
+{
+    pthread_mutex_lock(&w->lock);
+    uint64_t lsn = w->appended;
+    pthread_mutex_unlock(&w->lock);
+    if (!wal_sync(w, lsn))
+        return false;
+
+    if (ftruncate(w->fd, 0) != 0 || lseek(w->fd, 0, SEEK_SET) < 0)
+    {
+        // the records may still be replayed on top of the checkpoint
+        pthread_mutex_lock(&w->lock);
+        w->error = errno;
+        pthread_mutex_unlock(&w->lock);
+        return false;
+    }
+    return true;
+}
+
+bool wal_close(wal_t *w)
+{
+    pthread_mutex_lock(&w->lock);
+    uint64_t lsn = w->appended;
+    pthread_mutex_unlock(&w->lock);
+    bool durable = wal_sync(w, lsn);
+
+    close(w->fd);
+    free(w->buf);
+    free(w->spare);
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->synced);
+    return durable;
+}
+
+int wal_error(wal_t *w)
+{
+    pthread_mutex_lock(&w->lock);
+    int error = w->error;
+    pthread_mutex_unlock(&w->lock);
+    return error;
+}
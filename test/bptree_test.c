@@ -1,5 +1,11 @@
 #include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #include "bptree.h"
+#include "bptree_typed.h"
+#include "bptree_str.h"
+#include "bptree_shard.h"
 #include "pthread.h"
 
 typedef struct args_t
@@ -11,10 +17,10 @@ typedef struct args_t
 void *rand_insert(void *args)
 {
     args_t *t_args = (args_t *)args;
-    srand(0);
+    unsigned int seed = 0;
     for (int i = 0; i < t_args->tests; i++)
     {
-        bp_key_t x = rand();
+        bp_key_t x = rand_r(&seed);
         bptree_insert(t_args->tree, x, (value_t)x);
     }
     return NULL;
@@ -23,10 +29,10 @@ void *rand_insert(void *args)
 void *rand_get(void *args)
 {
     args_t *t_args = (args_t *)args;
-    srand(0);
+    unsigned int seed = 0;
     for (int i = 0; i < t_args->tests; i++)
     {
-        bp_key_t x = rand();
+        bp_key_t x = rand_r(&seed);
         value_t v;
         bool found = bptree_get(t_args->tree, x, &v);
         if (found && x != v)
@@ -37,34 +43,1486 @@ void *rand_get(void *args)
     return NULL;
 }
 
-int main(int argc, char *argv[])
+// checks that every key inserted by rand_insert is found
+void check_inserted(bptree_t *tree, int tests)
 {
-    int tests = 1000;
-    bool use_avx2 = false;
-    switch (argc)
+    unsigned int seed = 0;
+    for (int i = 0; i < tests; i++)
     {
-    case 3:
-        use_avx2 = atoi(argv[2]);
-        if (use_avx2 != 1 && use_avx2 != 0)
+        bp_key_t x = rand_r(&seed);
+        value_t v;
+        if (!bptree_get(tree, x, &v))
+            printf("ERROR: %ld not found\n", x);
+        else if (x != v)
+            printf("ERROR: %ld != %ld\n", x, v);
+    }
+}
+
+// looks up the keys inserted by rand_insert (and some missing ones) with bptree_get_batch
+void check_get_batch(bptree_t *tree, int tests)
+{
+    bp_key_t *keys = malloc(2 * tests * sizeof(bp_key_t));
+    value_t *results = malloc(2 * tests * sizeof(value_t));
+    bool *found = malloc(2 * tests * sizeof(bool));
+
+    unsigned int seed = 0;
+    for (int i = 0; i < tests; i++)
+    {
+        keys[2 * i] = rand_r(&seed);
+        // rand_r never returns negative keys
+        keys[2 * i + 1] = -keys[2 * i] - 1;
+    }
+
+    size_t count = bptree_get_batch(tree, keys, 2 * tests, results, found);
+    if (count != (size_t)tests)
+        printf("ERROR: batch found %zu of %d keys\n", count, tests);
+    for (int i = 0; i < 2 * tests; i++)
+    {
+        if (found[i] != (i % 2 == 0))
+            printf("ERROR: batch lookup of %ld returned %d\n", keys[i], found[i]);
+        else if (found[i] && results[i] != (value_t)keys[i])
+            printf("ERROR: %ld != %ld\n", keys[i], results[i]);
+    }
+
+    free(keys);
+    free(results);
+    free(found);
+}
+
+// deletes the even keys inserted by rand_insert and checks the result
+void check_delete(bptree_t *tree, int tests)
+{
+    unsigned int seed = 0;
+    for (int i = 0; i < tests; i++)
+    {
+        bp_key_t x = rand_r(&seed);
+        if (x % 2 == 0)
+            bptree_delete(tree, x);
+    }
+
+    seed = 0;
+    for (int i = 0; i < tests; i++)
+    {
+        bp_key_t x = rand_r(&seed);
+        value_t v;
+        bool found = bptree_get(tree, x, &v);
+        if (x % 2 == 0 && found)
+            printf("ERROR: %ld not deleted\n", x);
+        else if (x % 2 == 1 && !found)
+            printf("ERROR: %ld deleted\n", x);
+    }
+}
+
+typedef struct scan_state_t
+{
+    bp_key_t last;
+    size_t count;
+} scan_state_t;
+
+// checks the order and values of the entries passed by bptree_scan
+bool scan_visit(bp_key_t key, value_t value, void *ctx)
+{
+    scan_state_t *state = (scan_state_t *)ctx;
+    if (state->count > 0 && key <= state->last)
+        printf("ERROR: scan visited %ld after %ld\n", key, state->last);
+    if (key != value)
+        printf("ERROR: %ld != %ld\n", key, value);
+    if (key % 2 == 0)
+        printf("ERROR: scan visited deleted key %ld\n", key);
+    state->last = key;
+    state->count++;
+    return true;
+}
+
+// counts the entries and checks their order
+bool scan_count(bp_key_t key, value_t value, void *ctx)
+{
+    scan_state_t *state = (scan_state_t *)ctx;
+    if (state->count > 0 && key <= state->last)
+        printf("ERROR: scan visited %ld after %ld\n", key, state->last);
+    state->last = key;
+    state->count++;
+    return true;
+}
+
+// counts the entries without checking their order
+bool scan_any(bp_key_t key, value_t value, void *ctx)
+{
+    ((scan_state_t *)ctx)->count++;
+    return true;
+}
+
+// scans the keys left by check_delete
+void check_scan(bptree_t *tree, int tests)
+{
+    scan_state_t state = {0, 0};
+    bptree_scan(tree, 0, KEY_T_MAX, scan_visit, &state);
+
+    unsigned int seed = 0;
+    for (int i = 0; i < tests; i++)
+    {
+        bp_key_t x = rand_r(&seed);
+        if (x % 2 == 1 && bptree_scan(tree, x, x, scan_visit, &(scan_state_t){0, 0}) != 1)
+            printf("ERROR: scan missed %ld\n", x);
+    }
+}
+
+// compares all kernels the cpu supports with the scalar find_index
+void check_find_index(int tests)
+{
+    unsigned int seed = 0;
+    bp_key_t keys[ORDER - 1] __attribute__((aligned(64)));
+    for (int t = 0; t < tests; t++)
+    {
+        int size = rand_r(&seed) % ORDER;
+        bp_key_t k = 0;
+        for (int i = 0; i < ORDER - 1; i++)
         {
-            printf("cannot convert '%s' to bool (0 or 1)\n", argv[2]);
-            exit(1);
+            k += rand_r(&seed) % 4 + 1;
+            keys[i] = i < size ? k : KEY_T_MAX;
         }
-        if (use_avx2)
-            printf("avx2 is on!\n");
-        else
-            printf("avx2 is off!\n");
-    case 2:
-        tests = atoi(argv[1]);
-        if (tests == 0)
+        bp_key_t key = rand_r(&seed) % (k + 2);
+        uint16_t expected = find_index(keys, size, key);
+        for (bptree_simd_t simd = BPTREE_SIMD_AVX2; simd <= bptree_simd_resolve(BPTREE_SIMD_BEST); simd++)
         {
-            printf("cannot convert '%s' to integer\n", argv[1]);
-            exit(1);
+            uint16_t i = find_index_select(simd)(keys, size, key);
+            if (i != expected)
+                printf("ERROR: kernel %d returned %d instead of %d\n", simd, i, expected);
+        }
+    }
+}
+
+// bulk loads every third key and checks the tree before and after more inserts
+void check_bulk_load(bptree_simd_t simd, bptree_write_mode_t mode, int tests)
+{
+    bptree_t tree;
+    bptree_init(&tree, simd, mode);
+
+    bp_key_t *keys = malloc(tests * sizeof(bp_key_t));
+    value_t *values = malloc(tests * sizeof(value_t));
+    for (int i = 0; i < tests; i++)
+    {
+        keys[i] = 3 * i;
+        values[i] = 3 * i;
+    }
+    bptree_bulk_load_parallel(&tree, keys, values, tests, 0.7, 4);
+
+    for (int i = 0; i < tests; i++)
+        bptree_insert(&tree, 3 * i + 1, 3 * i + 1);
+
+    scan_state_t state = {0, 0};
+    for (int i = 0; i < 3 * tests; i++)
+    {
+        value_t v;
+        bool found = bptree_get(&tree, i, &v);
+        if (found != (i % 3 != 2))
+            printf("ERROR: bulk loaded tree returned %d for %d\n", found, i);
+        else if (found && v != i)
+            printf("ERROR: %d != %ld\n", i, v);
+    }
+    if (bptree_scan(&tree, 0, KEY_T_MAX, scan_count, &state) != 2 * (size_t)tests)
+        printf("ERROR: bulk loaded tree has %zu entries\n", state.count);
+
+    bptree_free(&tree);
+    free(keys);
+    free(values);
+}
+
+// writes the value of key i with a length that depends on round to buf.
+// Covers inline values, all size classes and values allocated with malloc.
+static size_t test_value(char *buf, int i, int round)
+{
+    size_t len = (i * 7 + round * 13) % 300;
+    if (i % 101 == 0)
+        len = 5000;
+    for (size_t j = 0; j < len; j++)
+        buf[j] = (char)(i + j + round);
+    return len;
+}
+
+// variable size values: puts, overwrites, views, deletes and a bulk load
+void check_values(bptree_simd_t simd, bptree_write_mode_t mode, int tests)
+{
+    bptree_t tree;
+    bptree_init(&tree, simd, mode);
+    char buf[5000];
+
+    int n = tests < 20000 ? tests : 20000;
+    for (int round = 0; round < 2; round++)
+        for (int i = 0; i < n; i++)
+            bptree_put(&tree, i, buf, test_value(buf, i, round));
+    for (int i = 0; i < n; i += 3)
+        bptree_delete(&tree, i);
+
+    bptree_read_begin(&tree);
+    for (int i = 0; i < n; i++)
+    {
+        value_view_t view;
+        bool found = bptree_get_view(&tree, i, &view);
+        size_t len = test_value(buf, i, 1);
+        if (found != (i % 3 != 0))
+            printf("ERROR: get_view returned %d for %d\n", found, i);
+        else if (found && (view.len != len || memcmp(view.data, buf, len) != 0))
+            printf("ERROR: wrong value of %zu bytes for %d\n", view.len, i);
+    }
+    bptree_read_end(&tree);
+
+    // replaces the tree, the old values are freed
+    bp_key_t *keys = malloc(n * sizeof(bp_key_t));
+    value_t *values = malloc(n * sizeof(value_t));
+    for (int i = 0; i < n; i++)
+    {
+        keys[i] = i;
+        values[i] = bptree_value_create(&tree, buf, test_value(buf, i, 2));
+    }
+    bptree_bulk_load(&tree, keys, values, n, 0.7);
+    value_view_t view;
+    bptree_read_begin(&tree);
+    if (!bptree_get_view(&tree, n / 2, &view) || view.len != test_value(buf, n / 2, 2) || memcmp(view.data, buf, view.len) != 0)
+        printf("ERROR: bulk loaded value of %d is wrong\n", n / 2);
+    bptree_read_end(&tree);
+
+    bptree_free(&tree);
+    free(keys);
+    free(values);
+}
+
+// checks the keys [0, n) of a tree loaded from a snapshot. Even keys
+// have the value 2 * key, odd keys a value of test_value.
+static void check_snapshot_keys(bptree_t *tree, int n, const char *name)
+{
+    char buf[5000];
+    bptree_read_begin(tree);
+    for (int i = 0; i < n; i++)
+    {
+        value_view_t view;
+        size_t len = test_value(buf, i, 0);
+        if (!bptree_get_view(tree, i, &view) || view.len != len || memcmp(view.data, buf, len) != 0)
+            printf("ERROR: %s snapshot has a wrong value for %d\n", name, i);
+    }
+    bptree_read_end(tree);
+    scan_state_t state = {0, 0};
+    if (bptree_scan(tree, 0, KEY_T_MAX, scan_count, &state) != (size_t)n)
+        printf("ERROR: scan of %s snapshot returned %zu entries\n", name, state.count);
+}
+
+// saves a tree, maps the snapshot twice (the second mapping is relocated)
+// and modifies one of the trees
+void check_snapshot(bptree_simd_t simd, bptree_write_mode_t mode, int tests)
+{
+    char path[] = "/tmp/bptree_test_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0)
+    {
+        printf("ERROR: can not create snapshot file\n");
+        return;
+    }
+    close(fd);
+
+    bptree_t tree, mapped, relocated;
+    bptree_init(&tree, simd, mode);
+    char buf[5000];
+    int n = tests < 20000 ? tests : 20000;
+    for (int i = 0; i < n; i++)
+        bptree_put(&tree, i, buf, test_value(buf, i, 0));
+    if (!bptree_save(&tree, path))
+        printf("ERROR: can not save snapshot\n");
+    bptree_free(&tree);
+
+    if (!bptree_open_mmap(&mapped, path, simd, mode) || !bptree_open_mmap(&relocated, path, simd, mode))
+    {
+        printf("ERROR: can not open snapshot\n");
+        unlink(path);
+        return;
+    }
+    if (mapped.mem.image == relocated.mem.image)
+        printf("ERROR: snapshot was mapped twice at the same address\n");
+    check_snapshot_keys(&mapped, n, "mapped");
+    check_snapshot_keys(&relocated, n, "relocated");
+
+    // writes clone the mapped nodes, the other mapping does not see them
+    for (int i = 0; i < n; i += 2)
+        bptree_delete(&mapped, i);
+    for (int i = 1; i < n; i += 2)
+        bptree_put(&mapped, i, buf, test_value(buf, i, 1));
+    for (int i = n; i < 2 * n; i++)
+        bptree_put(&mapped, i, buf, test_value(buf, i, 1));
+    bptree_read_begin(&mapped);
+    for (int i = 0; i < 2 * n; i++)
+    {
+        value_view_t view;
+        size_t len = test_value(buf, i, 1);
+        bool found = bptree_get_view(&mapped, i, &view);
+        if (found != (i >= n || i % 2 == 1) || (found && (view.len != len || memcmp(view.data, buf, len) != 0)))
+            printf("ERROR: modified snapshot returned %d for %d\n", found, i);
+    }
+    bptree_read_end(&mapped);
+    check_snapshot_keys(&relocated, n, "unmodified");
+
+    bptree_free(&mapped);
+    bptree_free(&relocated);
+    unlink(path);
+}
+
+// keys [0, n) of a writer of check_wal and check_read_snapshot,
+// every num_threads-th key belongs to it
+typedef struct wal_args_t
+{
+    bptree_t *tree;
+    int n, t, num_threads;
+} wal_args_t;
+
+void *wal_write(void *args)
+{
+    wal_args_t *w = args;
+    char buf[5000];
+    for (int round = 0; round < 2; round++)
+        for (int i = w->t; i < w->n; i += w->num_threads)
+            bptree_put(w->tree, i, buf, test_value(buf, i, round));
+    for (int i = w->t; i < w->n; i += w->num_threads)
+        if (i % 3 == 0)
+            bptree_delete(w->tree, i);
+    return NULL;
+}
+
+// checks a tree recovered by check_wal
+static void check_wal_keys(bptree_t *tree, int n, const char *name)
+{
+    char buf[5000];
+    bptree_read_begin(tree);
+    for (int i = 0; i < n; i++)
+    {
+        value_view_t view;
+        size_t len = test_value(buf, i, 1);
+        bool found = bptree_get_view(tree, i, &view);
+        if (found != (i % 3 != 0) || (found && (view.len != len || memcmp(view.data, buf, len) != 0)))
+            printf("ERROR: %s tree returned %d for %d\n", name, found, i);
+    }
+    bptree_read_end(tree);
+}
+
+// writes with concurrent threads to a logged tree, recovers the tree from
+// the log and cuts off a torn record at the end of the log
+void check_wal(bptree_simd_t simd, bptree_write_mode_t mode, int tests)
+{
+    char path[] = "/tmp/bptree_wal_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0)
+    {
+        printf("ERROR: can not create log file\n");
+        return;
+    }
+    close(fd);
+
+    bptree_t tree;
+    bptree_init(&tree, simd, mode);
+    if (!bptree_wal_open(&tree, path))
+    {
+        printf("ERROR: can not open log\n");
+        unlink(path);
+        return;
+    }
+    int num_threads = 4;
+    int n = tests < 4000 ? tests : 4000;
+    pthread_t threads[num_threads];
+    wal_args_t args[num_threads];
+    for (int t = 0; t < num_threads; t++)
+    {
+        args[t] = (wal_args_t){&tree, n, t, num_threads};
+        pthread_create(threads + t, NULL, wal_write, args + t);
+    }
+    for (int t = 0; t < num_threads; t++)
+        pthread_join(threads[t], NULL);
+    check_wal_keys(&tree, n, "logged");
+    bptree_free(&tree);
+
+    bptree_init(&tree, simd, mode);
+    if (!bptree_wal_open(&tree, path))
+        printf("ERROR: can not reopen log\n");
+    check_wal_keys(&tree, n, "recovered");
+    bptree_free(&tree);
+
+    // a record that was written only partly is dropped
+    struct stat st;
+    stat(path, &st);
+    FILE *f = fopen(path, "a");
+    fwrite("\x20\0\0\0torn", 1, 8, f);
+    fclose(f);
+    bptree_init(&tree, simd, mode);
+    bptree_wal_open(&tree, path);
+    check_wal_keys(&tree, n, "torn");
+    bptree_free(&tree);
+    struct stat torn;
+    stat(path, &torn);
+    if (torn.st_size != st.st_size)
+        printf("ERROR: torn record was not cut off (%ld -> %ld bytes)\n", (long)st.st_size, (long)torn.st_size);
+
+    // a log that can not be written fails for all later writes, which
+    // are applied to the tree but not recovered
+    bptree_init(&tree, simd, mode);
+    bptree_wal_open(&tree, path);
+    int full = open("/dev/full", O_WRONLY);
+    if (full >= 0)
+    {
+        dup2(full, tree.mem.wal->fd);
+        close(full);
+        char buf[5000];
+        bptree_put(&tree, n, buf, test_value(buf, n, 1));
+        bptree_put(&tree, n + 1, buf, test_value(buf, n + 1, 1));
+        value_view_t view;
+        bptree_read_begin(&tree);
+        bool found = bptree_get_view(&tree, n + 1, &view);
+        bptree_read_end(&tree);
+        if (bptree_wal_error(&tree) != ENOSPC || !found)
+            printf("ERROR: full log returned error %d\n", bptree_wal_error(&tree));
+        bptree_free(&tree);
+        bptree_init(&tree, simd, mode);
+        bptree_wal_open(&tree, path);
+        bptree_read_begin(&tree);
+        found = bptree_get_view(&tree, n, &view);
+        bptree_read_end(&tree);
+        if (bptree_wal_error(&tree) != 0 || found)
+            printf("ERROR: write to a full log was recovered\n");
+        check_wal_keys(&tree, n, "failed");
+    }
+    bptree_free(&tree);
+    unlink(path);
+}
+
+// checks a tree loaded from a checkpoint. rounds[i] is the round of
+// test_value of key i, -1 if it was deleted.
+static void check_checkpoint_keys(bptree_t *tree, int n, const int *rounds, const char *name)
+{
+    char buf[5000];
+    size_t count = 0;
+    bptree_read_begin(tree);
+    for (int i = 0; i < n; i++)
+    {
+        value_view_t view;
+        bool found = bptree_get_view(tree, i, &view);
+        size_t len = rounds[i] < 0 ? 0 : test_value(buf, i, rounds[i]);
+        count += found;
+        if (found != (rounds[i] >= 0) || (found && (view.len != len || memcmp(view.data, buf, len) != 0)))
+            printf("ERROR: %s checkpoint returned %d for %d\n", name, found, i);
+    }
+    bptree_read_end(tree);
+    scan_state_t state = {0, 0};
+    if (bptree_scan(tree, 0, KEY_T_MAX, scan_count, &state) != count)
+        printf("ERROR: scan of %s checkpoint returned %zu entries instead of %zu\n", name, state.count, count);
+}
+
+// writes checkpoints of a tree, checks that a checkpoint after few changes
+// is small, loads the checkpoints again and lets the file be compacted
+void check_checkpoint(bptree_simd_t simd, bptree_write_mode_t mode, int tests)
+{
+    char path[] = "/tmp/bptree_ckpt_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0)
+    {
+        printf("ERROR: can not create checkpoint file\n");
+        return;
+    }
+    close(fd);
+
+    bptree_t tree;
+    bptree_init(&tree, simd, mode);
+    if (!bptree_checkpoint_open(&tree, path))
+    {
+        printf("ERROR: can not open checkpoint file\n");
+        unlink(path);
+        return;
+    }
+    char buf[5000];
+    int n = tests < 20000 ? tests : 20000;
+    int *rounds = malloc(n * sizeof(int));
+    for (int i = 0; i < n; i++)
+    {
+        rounds[i] = 0;
+        bptree_put(&tree, i, buf, test_value(buf, i, 0));
+    }
+    bptree_checkpoint(&tree);
+    struct stat full, incremental;
+    stat(path, &full);
+
+    // two percent of the keys change, they are in few leaves
+    for (int i = 0; i < n / 50; i += 2)
+    {
+        rounds[i] = 1;
+        bptree_put(&tree, i, buf, test_value(buf, i, 1));
+        if (bptree_delete(&tree, i + 1))
+            rounds[i + 1] = -1;
+    }
+    if (!bptree_checkpoint(&tree))
+        printf("ERROR: can not write checkpoint\n");
+    stat(path, &incremental);
+    if (n >= 10000 && incremental.st_size - full.st_size > full.st_size / 4)
+        printf("ERROR: incremental checkpoint has %ld bytes, the first one %ld\n",
+               (long)(incremental.st_size - full.st_size), (long)full.st_size);
+    bptree_free(&tree);
+
+    bptree_init(&tree, simd, mode);
+    if (!bptree_checkpoint_open(&tree, path))
+        printf("ERROR: can not reopen checkpoint file\n");
+    check_checkpoint_keys(&tree, n, rounds, "loaded");
+
+    // the file grows with every checkpoint until it is compacted
+    unsigned int seed = 1;
+    for (int round = 2; round < 12; round++)
+    {
+        for (int j = 0; j < n / 5; j++)
+        {
+            int i = rand_r(&seed) % n;
+            rounds[i] = round;
+            bptree_put(&tree, i, buf, test_value(buf, i, round));
+        }
+        bptree_checkpoint(&tree);
+    }
+    bptree_free(&tree);
+    struct stat compacted;
+    stat(path, &compacted);
+    if (n >= 10000 && compacted.st_size > 4 * full.st_size)
+        printf("ERROR: checkpoint file was not compacted (%ld bytes)\n", (long)compacted.st_size);
+
+    // a segment that was written only partly is cut off
+    FILE *f = fopen(path, "a");
+    fwrite("\x31\x30\x54\x50torn", 1, 8, f);
+    fclose(f);
+    bptree_init(&tree, simd, mode);
+    bptree_checkpoint_open(&tree, path);
+    check_checkpoint_keys(&tree, n, rounds, "compacted");
+    bptree_free(&tree);
+    struct stat torn;
+    stat(path, &torn);
+    if (torn.st_size != compacted.st_size)
+        printf("ERROR: torn checkpoint was not cut off\n");
+    unlink(path);
+
+    // values that are not held by the value store
+    bptree_init(&tree, simd, mode);
+    bptree_checkpoint_open(&tree, path);
+    for (int i = 0; i < n; i++)
+        bptree_insert(&tree, i, 2 * i);
+    bptree_checkpoint(&tree);
+    bptree_free(&tree);
+    bptree_init(&tree, simd, mode);
+    bptree_checkpoint_open(&tree, path);
+    for (int i = 0; i < n; i++)
+    {
+        value_t v;
+        if (!bptree_get(&tree, i, &v) || v != (value_t)(2 * i))
+            printf("ERROR: checkpoint lost value of %d\n", i);
+    }
+    bptree_free(&tree);
+    unlink(path);
+    free(rounds);
+}
+
+// count the entries of a scan
+static bool scan_count16(int16_t key, value_t value, void *ctx)
+{
+    (*(size_t *)ctx)++;
+    return true;
+}
+
+static bool scan_count32(int32_t key, value_t value, void *ctx)
+{
+    (*(size_t *)ctx)++;
+    return true;
+}
+
+// 16 and 32 bit trees in one program. Inserts keys of both signs
+// into both trees, deletes every third and checks gets and scans.
+// checks the snapshot taken by check_read_snapshot before the writers started
+static void check_read_snapshot_keys(bptree_snapshot_t *snapshot, int n)
+{
+    char buf[5000];
+    size_t in_range = 0;
+    for (int i = 0; i < n; i++)
+    {
+        value_t value;
+        value_view_t view;
+        bool found = bptree_snapshot_get(snapshot, i, &value);
+        if (found != (i % 2 == 0))
+            printf("ERROR: snapshot returned %d for %d\n", found, i);
+        if (!found)
+            continue;
+        size_t len = test_value(buf, i, 0);
+        value_store_view(value, &view);
+        if (view.len != len || memcmp(view.data, buf, len) != 0)
+            printf("ERROR: snapshot has a wrong value for %d\n", i);
+        in_range += i >= n / 4 && i <= n / 2;
+    }
+
+    scan_state_t state = {0, 0};
+    if (bptree_snapshot_scan(snapshot, 0, KEY_T_MAX, scan_count, &state) != (size_t)(n + 1) / 2)
+        printf("ERROR: scan of snapshot returned %zu entries\n", state.count);
+    state = (scan_state_t){0, 0};
+    if (bptree_snapshot_scan(snapshot, n / 4, n / 2, scan_count, &state) != in_range)
+        printf("ERROR: range scan of snapshot returned %zu entries\n", state.count);
+}
+
+// reads snapshots while threads insert, overwrite and delete keys
+void check_read_snapshot(bptree_simd_t simd, bptree_write_mode_t mode, int tests)
+{
+    bptree_t tree;
+    bptree_init(&tree, simd, mode);
+    char buf[5000];
+    int n = tests < 20000 ? tests : 20000;
+    for (int i = 0; i < n; i += 2)
+        bptree_put(&tree, i, buf, test_value(buf, i, 0));
+    bptree_snapshot_t *before = bptree_snapshot(&tree);
+
+    int num_threads = 4;
+    pthread_t threads[num_threads];
+    wal_args_t args[num_threads];
+    for (int t = 0; t < num_threads; t++)
+    {
+        args[t] = (wal_args_t){&tree, n, t, num_threads};
+        pthread_create(threads + t, NULL, wal_write, args + t);
+    }
+
+    // snapshots taken during the writes see a consistent state as well
+    for (int round = 0; round < 3; round++)
+    {
+        check_read_snapshot_keys(before, n);
+        bptree_snapshot_t *during = bptree_snapshot(&tree);
+        size_t found = 0;
+        for (int i = 0; i < n; i++)
+        {
+            value_t value;
+            found += bptree_snapshot_get(during, i, &value);
+        }
+        scan_state_t state = {0, 0};
+        if (bptree_snapshot_scan(during, 0, KEY_T_MAX, scan_count, &state) != found)
+            printf("ERROR: scan of snapshot returned %zu entries, gets found %zu\n", state.count, found);
+        bptree_snapshot_release(during);
+    }
+
+    for (int t = 0; t < num_threads; t++)
+        pthread_join(threads[t], NULL);
+    check_read_snapshot_keys(before, n);
+    bptree_snapshot_release(before);
+    check_wal_keys(&tree, n, "snapshotted");
+    bptree_free(&tree);
+}
+
+// writes with many threads to a logged tree whose inserts are combined
+void check_combining(bptree_simd_t simd, bptree_write_mode_t mode, int tests)
+{
+    char path[] = "/tmp/bptree_combine_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0)
+    {
+        printf("ERROR: can not create log file\n");
+        return;
+    }
+    close(fd);
+
+    bptree_t tree;
+    bptree_init(&tree, simd, mode);
+    bptree_combining_enable(&tree);
+    if (!bptree_wal_open(&tree, path))
+    {
+        printf("ERROR: can not open log\n");
+        unlink(path);
+        return;
+    }
+    int num_threads = 8;
+    int n = tests < 4000 ? tests : 4000;
+    pthread_t threads[num_threads];
+    wal_args_t args[num_threads];
+    for (int t = 0; t < num_threads; t++)
+    {
+        args[t] = (wal_args_t){&tree, n, t, num_threads};
+        pthread_create(threads + t, NULL, wal_write, args + t);
+    }
+    for (int t = 0; t < num_threads; t++)
+        pthread_join(threads[t], NULL);
+    check_wal_keys(&tree, n, "combined");
+    // buffered inserts bypass the combiner
+    combine_t *c = tree.mem.combine;
+    if (mode != BPTREE_BUFFERED && (c->num_requests != (uint64_t)(2 * n) || c->num_batches == 0 || c->num_batches > c->num_requests))
+        printf("ERROR: combiners applied %lu inserts in %lu batches\n", c->num_requests, c->num_batches);
+    bptree_free(&tree);
+
+    bptree_init(&tree, simd, mode);
+    if (!bptree_wal_open(&tree, path))
+        printf("ERROR: can not reopen log\n");
+    check_wal_keys(&tree, n, "recovered combined");
+    bptree_free(&tree);
+    unlink(path);
+}
+
+// even keys [0, 2n) of a writer of check_insert_batch, every
+// num_threads-th key belongs to it
+typedef struct batch_args_t
+{
+    bptree_t *tree;
+    int n, t, num_threads;
+} batch_args_t;
+
+// inserts the keys in descending batches of random size. Every batch
+// holds the first key twice, its last value has to be stored.
+// Odd threads insert one key after another in between.
+void *batch_write(void *args)
+{
+    batch_args_t *b = args;
+    unsigned int seed = b->t;
+    bp_key_t keys[1001];
+    value_t values[1001];
+    int i = 2 * b->t, step = 2 * b->num_threads;
+    while (i < 2 * b->n)
+    {
+        if (b->t % 2 == 1)
+        {
+            bptree_insert(b->tree, i, i);
+            i += step;
+            continue;
+        }
+        int count = 1 + rand_r(&seed) % 1000;
+        int last = i + (count - 1) * step;
+        if (last >= 2 * b->n)
+        {
+            count = (2 * b->n - 1 - i) / step + 1;
+            last = i + (count - 1) * step;
+        }
+        keys[0] = i;
+        values[0] = 1;
+        for (int j = 0; j < count; j++)
+        {
+            keys[j + 1] = last - j * step;
+            values[j + 1] = last - j * step;
+        }
+        bptree_insert_batch(b->tree, keys, values, count + 1);
+        i = last + step;
+    }
+    return NULL;
+}
+
+// counts the odd keys and checks the order of a scan
+static bool scan_odd(bp_key_t key, value_t value, void *ctx)
+{
+    scan_state_t *state = (scan_state_t *)ctx;
+    if (state->last != -1 && key <= state->last)
+        printf("ERROR: scan visited %ld after %ld\n", key, state->last);
+    state->last = key;
+    state->count += key % 2;
+    return true;
+}
+
+// inserts batches while other threads insert single keys and scans
+// and a snapshot run. The odd keys are inserted before.
+void check_insert_batch(bptree_simd_t simd, bptree_write_mode_t mode, int tests)
+{
+    bptree_t tree;
+    bptree_init(&tree, simd, mode);
+    int n = tests < 50000 ? tests : 50000;
+    for (int i = 1; i < 2 * n; i += 2)
+        bptree_insert(&tree, i, i);
+    bptree_snapshot_t *before = bptree_snapshot(&tree);
+
+    int num_threads = 4;
+    pthread_t threads[num_threads];
+    batch_args_t args[num_threads];
+    for (int t = 0; t < num_threads; t++)
+    {
+        args[t] = (batch_args_t){&tree, n, t, num_threads};
+        pthread_create(threads + t, NULL, batch_write, args + t);
+    }
+    // keys that exist during a whole scan are visited
+    for (int round = 0; round < 20; round++)
+    {
+        scan_state_t state = {-1, 0};
+        bptree_scan(&tree, 0, KEY_T_MAX, scan_odd, &state);
+        if (state.count != (size_t)n)
+            printf("ERROR: scan during batches visited %zu of %d keys\n", state.count, n);
+    }
+    for (int t = 0; t < num_threads; t++)
+        pthread_join(threads[t], NULL);
+
+    for (int i = 0; i < 2 * n; i++)
+    {
+        value_t value;
+        if (!bptree_get(&tree, i, &value) || value != (value_t)i)
+            printf("ERROR: key %d of a batch is missing or wrong\n", i);
+    }
+    scan_state_t state = {-1, 0};
+    if (bptree_scan(&tree, 0, KEY_T_MAX, scan_odd, &state) != (size_t)(2 * n))
+        printf("ERROR: scan after batches visited %zu keys\n", state.count);
+    scan_state_t old = {-1, 0};
+    if (bptree_snapshot_scan(before, 0, KEY_T_MAX, scan_odd, &old) != (size_t)n)
+        printf("ERROR: batches changed a snapshot\n");
+    bptree_snapshot_release(before);
+    bptree_free(&tree);
+
+    // a batch into an empty tree that grows it by several levels
+    bptree_init(&tree, simd, mode);
+    bp_key_t *keys = malloc(n * sizeof(bp_key_t));
+    value_t *values = malloc(n * sizeof(value_t));
+    for (int i = 0; i < n; i++)
+    {
+        keys[i] = n - 1 - i;
+        values[i] = n - 1 - i;
+    }
+    bptree_insert_batch(&tree, keys, values, n);
+    state = (scan_state_t){-1, 0};
+    if (bptree_scan(&tree, 0, KEY_T_MAX, scan_count, &state) != (size_t)n)
+        printf("ERROR: batch into an empty tree stored %zu of %d keys\n", state.count, n);
+    free(keys);
+    free(values);
+    bptree_free(&tree);
+}
+
+// checks the values of check_buffered, the first 10 keys hold key + n
+static bool scan_replaced(bp_key_t key, value_t value, void *ctx)
+{
+    int n = *(int *)ctx;
+    if (value != (value_t)(key < 10 ? key + n : key))
+        printf("ERROR: scan returned %lu for key %ld\n", value, key);
+    return true;
+}
+
+// keys inserted by buffer_fill
+typedef struct fill_args_t
+{
+    bptree_t *tree;
+    int n;
+
+    // keys below are inserted
+    int done;
+} fill_args_t;
+
+void *buffer_fill(void *args)
+{
+    fill_args_t *f = args;
+    for (int i = 0; i < f->n; i++)
+    {
+        bptree_insert(f->tree, i, i);
+        __atomic_store_n(&f->done, i + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+// replaces keys by inserts that are still buffered with BPTREE_BUFFERED.
+// Gets and scans have to return the last value of a key, whether it is in
+// the buffer, in the buffer that is flushed or in the tree.
+void check_buffered(bptree_simd_t simd, bptree_write_mode_t mode, int tests)
+{
+    bptree_t tree;
+    bptree_init(&tree, simd, mode);
+    int n = tests < 50000 ? tests : 50000;
+    for (int i = 0; i < n; i++)
+        bptree_insert(&tree, i, i);
+    for (int i = 0; i < 10; i++)
+    {
+        bptree_insert(&tree, i, 1);
+        bptree_insert(&tree, i, i + n);
+    }
+
+    for (int i = 0; i < n; i++)
+    {
+        value_t value;
+        if (!bptree_get(&tree, i, &value) || value != (value_t)(i < 10 ? i + n : i))
+            printf("ERROR: replaced key %d is missing or wrong\n", i);
+    }
+    bp_key_t keys[20];
+    value_t values[20];
+    bool found[20];
+    for (int i = 0; i < 20; i++)
+        keys[i] = 2 * i;
+    if (bptree_get_batch(&tree, keys, 20, values, found) != 20 || values[3] != (value_t)(6 + n) || values[10] != 20)
+        printf("ERROR: batch of gets returned wrong values of replaced keys\n");
+    if (bptree_scan(&tree, 0, KEY_T_MAX, scan_replaced, &n) != (size_t)n || bptree_scan(&tree, 5, 14, scan_replaced, &n) != 10)
+        printf("ERROR: scan of replaced keys returned wrong number of keys\n");
+
+    // a delete applies all buffered inserts to the tree first
+    bptree_delete(&tree, n - 1);
+    write_buffers_t *b = tree.mem.buffers;
+    if (b != NULL && (b->num_messages != (uint64_t)(n + 20) || b->num_flushes == 0))
+        printf("ERROR: buffers flushed %lu inserts in %lu flushes\n", b->num_messages, b->num_flushes);
+    bptree_free(&tree);
+
+    // batches of gets while the buffer is filled and flushed into an
+    // empty tree. Every key inserted before a batch started is found.
+    bptree_init(&tree, simd, mode);
+    fill_args_t fill = {&tree, n, 0};
+    pthread_t writer;
+    pthread_create(&writer, NULL, buffer_fill, &fill);
+    for (int done = 0; done < n;)
+    {
+        done = __atomic_load_n(&fill.done, __ATOMIC_ACQUIRE);
+        int from = done < 2048 ? 0 : done - 2048;
+        bp_key_t batch[2048];
+        value_t batch_values[2048];
+        bool batch_found[2048];
+        for (int i = from; i < done; i++)
+            batch[i - from] = i;
+        if (bptree_get_batch(&tree, batch, done - from, batch_values, batch_found) != (size_t)(done - from))
+            printf("ERROR: batch of gets missed keys below %d during flushes\n", done);
+    }
+    pthread_join(writer, NULL);
+    bptree_free(&tree);
+}
+
+// find_index returns ORDER - 1 for a key above all keys of a full node.
+// The word behind the keys is the version of the node, a key equal to it
+// must not be found there.
+void check_full_leaf(bptree_simd_t simd, bptree_write_mode_t mode)
+{
+    bptree_t tree;
+    bptree_init(&tree, simd, mode);
+    for (int i = 1; i < ORDER; i++)
+        bptree_insert(&tree, -i, -i);
+    // applies the buffered inserts
+    bptree_delete(&tree, -ORDER);
+
+    bp_key_t key = (bp_key_t)tree.root->version;
+    value_t value;
+    if (tree.root->n != ORDER - 1 || !tree.root->is_leaf)
+        printf("ERROR: root of %d keys is not a full leaf\n", ORDER - 1);
+    if (bptree_get(&tree, key, &value))
+        printf("ERROR: get found key %ld above a full leaf\n", key);
+    if (bptree_delete(&tree, key))
+        printf("ERROR: delete found key %ld above a full leaf\n", key);
+    bptree_insert(&tree, key, 1);
+    if (!bptree_get(&tree, key, &value) || value != 1 || !bptree_get(&tree, -1, &value) || value != (value_t)-1)
+        printf("ERROR: insert above a full leaf stored wrong values\n");
+    scan_state_t state = {0, 0};
+    if (bptree_scan(&tree, -ORDER, KEY_T_MAX, scan_count, &state) != ORDER)
+        printf("ERROR: scan after insert above a full leaf visited %zu keys\n", state.count);
+    bptree_free(&tree);
+}
+
+// runs rand_insert and rand_get by new threads in every round. The
+// records of the threads that exited are taken over by the next ones,
+// so the domain keeps a record per concurrent thread and not per thread.
+void check_epoch_records(bptree_simd_t simd, bptree_write_mode_t mode, int tests)
+{
+    bptree_t tree;
+    bptree_init(&tree, simd, mode);
+    args_t args = {tests < 10000 ? tests : 10000, &tree};
+    int num_threads = 4;
+    pthread_t threads[num_threads];
+    for (int round = 0; round < 10; round++)
+    {
+        // stacks of another size are not reused, so the threads get new ids
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setstacksize(&attr, (256 + 64 * round) << 10);
+        for (int t = 0; t < num_threads; t++)
+            pthread_create(threads + t, &attr, t % 2 == 0 ? rand_insert : rand_get, &args);
+        for (int t = 0; t < num_threads; t++)
+            pthread_join(threads[t], NULL);
+        pthread_attr_destroy(&attr);
+    }
+    int num_records = 0;
+    for (epoch_record_t *rec = tree.mem.epoch.records; rec != NULL; rec = rec->next)
+        num_records += !rec->is_pin;
+    if (num_records > num_threads)
+        printf("ERROR: %d threads in rounds of %d left %d epoch records\n", 10 * num_threads, num_threads, num_records);
+    bptree_free(&tree);
+}
+
+// returns the number of slabs of a pool
+static int pool_slabs(pool_t *p)
+{
+    int slabs = 0;
+    for (void *slab = p->slabs; slab != NULL; slab = *(void **)slab)
+        slabs++;
+    return slabs;
+}
+
+// keys of a thread of check_pool_caches
+typedef struct churn_args_t
+{
+    bptree_t *tree;
+    int from, to;
+} churn_args_t;
+
+// inserts and deletes the keys of a thread
+void *churn_keys(void *args)
+{
+    churn_args_t *a = args;
+    for (int i = a->from; i < a->to; i++)
+        bptree_insert(a->tree, i, i);
+    for (int i = a->from; i < a->to; i++)
+        bptree_delete(a->tree, i);
+    return NULL;
+}
+
+// runs churn_keys by new threads in every round. The caches of the
+// threads that exited are taken over by the next ones, so the node pool
+// keeps a cache per concurrent thread and needs hardly more slabs than
+// in the first round, not one per thread.
+void check_pool_caches(bptree_simd_t simd, bptree_write_mode_t mode, int tests)
+{
+    bptree_t tree;
+    bptree_init(&tree, simd, mode);
+    int keys = tests < 2000 ? tests : 2000;
+    int num_threads = 4, num_rounds = 50;
+    size_t stack_size = 256 << 10;
+    // threads on stacks that are still allocated get new ids
+    char *stacks = malloc(num_rounds * num_threads * stack_size);
+    pthread_t threads[num_threads];
+    churn_args_t args[num_threads];
+    int first_slabs = 0;
+    for (int round = 0; round < num_rounds; round++)
+    {
+        for (int t = 0; t < num_threads; t++)
+        {
+            args[t] = (churn_args_t){&tree, t * keys, (t + 1) * keys};
+            pthread_attr_t attr;
+            pthread_attr_init(&attr);
+            pthread_attr_setstack(&attr, stacks + (round * num_threads + t) * stack_size, stack_size);
+            pthread_create(threads + t, &attr, churn_keys, args + t);
+            pthread_attr_destroy(&attr);
+        }
+        for (int t = 0; t < num_threads; t++)
+            pthread_join(threads[t], NULL);
+        // the slabs of the first round hold the keys of all threads
+        if (round == 0)
+            first_slabs = pool_slabs(&tree.mem.nodes);
+    }
+    int num_caches = 0;
+    for (pool_cache_t *cache = tree.mem.nodes.caches; cache != NULL; cache = cache->next)
+        num_caches++;
+    int num_slabs = pool_slabs(&tree.mem.nodes);
+    free(stacks);
+    // every thread of a round can start a slab while others are reclaimed
+    if (num_caches > num_threads || num_slabs > first_slabs + 2 * num_threads)
+        printf("ERROR: %d threads in rounds of %d left %d node caches and %d node slabs\n", num_rounds * num_threads, num_threads, num_caches, num_slabs);
+    bptree_free(&tree);
+}
+
+// keys of a thread of check_append
+typedef struct append_args_t
+{
+    bptree_t *tree;
+    int from, to, t, num_threads;
+} append_args_t;
+
+// inserts the keys of a thread in ascending order. The threads take
+// turns, so most keys are appended to the last leaf.
+void *append_keys(void *args)
+{
+    append_args_t *a = args;
+    for (int i = a->from + a->t; i < a->to; i += a->num_threads)
+        bptree_insert(a->tree, i, i);
+    return NULL;
+}
+
+// returns the share of the slots of all leaves that hold a key
+static double leaf_fill(bptree_t *tree)
+{
+    node_t *n = tree->root;
+    while (!n->is_leaf)
+        n = n->children.nodes[0];
+    size_t keys = 0, leaves = 0;
+    for (leaf_link_t *link = n->children.link; link != NULL; link = link->next, leaves++)
+        keys += link->leaf->n;
+    return (double)keys / (leaves * (ORDER - 1));
+}
+
+// inserts ascending keys, which are appended to the last leaf. Its leaves
+// have to be about as full as the ones of a bulk load. Keys appended during
+// a snapshot, after deletes at the end and by several threads are checked.
+void check_append(bptree_simd_t simd, bptree_write_mode_t mode, int tests)
+{
+    bptree_t tree;
+    bptree_init(&tree, simd, mode);
+    int n = tests < 50000 ? tests : 50000;
+    for (int i = 0; i < n; i++)
+        bptree_insert(&tree, i, i);
+    // applies the buffered inserts
+    bptree_delete(&tree, n);
+    if (n > 1000 && leaf_fill(&tree) < 0.8)
+        printf("ERROR: ascending inserts filled leaves by %.2f\n", leaf_fill(&tree));
+
+    // the last leaf is part of the snapshot
+    bptree_snapshot_t *before = bptree_snapshot(&tree);
+    for (int i = n; i < n + 100; i++)
+        bptree_insert(&tree, i, i);
+    scan_state_t state = {0, 0};
+    if (bptree_snapshot_scan(before, 0, KEY_T_MAX, scan_count, &state) != (size_t)n)
+        printf("ERROR: appends changed a snapshot\n");
+    bptree_snapshot_release(before);
+
+    for (int i = n + 50; i < n + 100; i++)
+        bptree_delete(&tree, i);
+    for (int i = n + 50; i < n + 100; i++)
+        bptree_insert(&tree, i, i);
+
+    int num_threads = 4;
+    pthread_t threads[num_threads];
+    append_args_t args[num_threads];
+    for (int t = 0; t < num_threads; t++)
+    {
+        args[t] = (append_args_t){&tree, n + 100, 2 * n + 100, t, num_threads};
+        pthread_create(threads + t, NULL, append_keys, args + t);
+    }
+    for (int t = 0; t < num_threads; t++)
+        pthread_join(threads[t], NULL);
+
+    for (int i = 0; i < 2 * n + 100; i++)
+    {
+        value_t value;
+        if (!bptree_get(&tree, i, &value) || value != (value_t)i)
+            printf("ERROR: appended key %d is missing or wrong\n", i);
+    }
+    state = (scan_state_t){0, 0};
+    if (bptree_scan(&tree, 0, KEY_T_MAX, scan_count, &state) != (size_t)(2 * n + 100))
+        printf("ERROR: scan after appends visited %zu keys\n", state.count);
+    bptree_free(&tree);
+}
+
+// counters of check_update and the keys of a thread between them
+typedef struct update_args_t
+{
+    bptree_t *tree;
+    int n, t, num_threads, rounds;
+} update_args_t;
+
+// counts up every counter once per round. The thread inserts and deletes
+// its own keys next to the counters, so their leaves are split, merged
+// and cloned while they are updated.
+void *update_count(void *args)
+{
+    update_args_t *u = args;
+    int stride = u->num_threads + 1;
+    for (int round = 0; round < u->rounds; round++)
+        for (int i = 0; i < u->n; i++)
+        {
+            bptree_fetch_add(u->tree, i * stride, 1);
+            if (round % 2 == 0)
+                bptree_insert(u->tree, i * stride + 1 + u->t, i);
+            else
+                bptree_delete(u->tree, i * stride + 1 + u->t);
+        }
+    return NULL;
+}
+
+// update of check_update that never changes a key
+static bool update_none(value_t *value, bool found, void *ctx)
+{
+    return false;
+}
+
+// counts up the counters of update_count concurrently while snapshots are taken
+void check_update(bptree_simd_t simd, bptree_write_mode_t mode, int tests)
+{
+    bptree_t tree;
+    bptree_init(&tree, simd, mode);
+    int n = tests < 2000 ? tests : 2000;
+    int num_threads = 4, rounds = 20, stride = num_threads + 1;
+    // half of the counters are inserted by their first update
+    for (int i = 0; i < n; i += 2)
+        bptree_insert(&tree, i * stride, 0);
+
+    pthread_t threads[num_threads];
+    update_args_t args[num_threads];
+    for (int t = 0; t < num_threads; t++)
+    {
+        args[t] = (update_args_t){&tree, n, t, num_threads, rounds};
+        pthread_create(threads + t, NULL, update_count, args + t);
+    }
+
+    // leaves of a snapshot are cloned by the updates, counters never go back
+    for (int round = 0; round < 10; round++)
+    {
+        bptree_snapshot_t *during = bptree_snapshot(&tree);
+        for (int i = 0; i < n; i++)
+        {
+            value_t before = 0, value = 0;
+            bptree_snapshot_get(during, i * stride, &before);
+            bptree_get(&tree, i * stride, &value);
+            if (value < before)
+                printf("ERROR: counter %d went back from %lu to %lu\n", i, before, value);
         }
+        bptree_snapshot_release(during);
+    }
+
+    for (int t = 0; t < num_threads; t++)
+        pthread_join(threads[t], NULL);
+    for (int i = 0; i < n; i++)
+    {
+        value_t value = 0;
+        if (!bptree_get(&tree, i * stride, &value) || value != (value_t)(num_threads * rounds))
+            printf("ERROR: counter %d is %lu instead of %d\n", i, value, num_threads * rounds);
+    }
+
+    value_t value = 0;
+    if (bptree_cas(&tree, 0, 1, 7) || !bptree_cas(&tree, 0, num_threads * rounds, 7) || !bptree_get(&tree, 0, &value) || value != 7)
+        printf("ERROR: compare and swap of an existing key failed\n");
+    if (bptree_cas(&tree, -1, 0, 7) || bptree_update(&tree, -1, update_none, NULL) || bptree_get(&tree, -1, &value))
+        printf("ERROR: a failed update inserted a key\n");
+    if (bptree_fetch_add(&tree, -1, 3) != 0 || bptree_fetch_add(&tree, -1, 4) != 3 || !bptree_get(&tree, -1, &value) || value != 7)
+        printf("ERROR: fetch and add returned %lu\n", value);
+    bptree_free(&tree);
+}
+
+// keys [0, n) of a writer of check_sharded, every num_threads-th key belongs to it
+typedef struct sharded_args_t
+{
+    bptree_sharded_t *store;
+    int n, t, num_threads;
+} sharded_args_t;
+
+// the writes of wal_write on a sharded store
+void *sharded_write(void *args)
+{
+    sharded_args_t *w = args;
+    char buf[5000];
+    for (int round = 0; round < 2; round++)
+        for (int i = w->t; i < w->n; i += w->num_threads)
+            bptree_sharded_put(w->store, i, buf, test_value(buf, i, round));
+    for (int i = w->t; i < w->n; i += w->num_threads)
+        if (i % 3 == 0)
+            bptree_sharded_delete(w->store, i);
+    return NULL;
+}
+
+// checks the keys written by sharded_write and the order of a scan
+static void check_sharded_keys(bptree_sharded_t *store, int n, bool ordered, const char *name)
+{
+    char buf[5000];
+    bptree_sharded_read_begin(store);
+    for (int i = 0; i < n; i++)
+    {
+        value_view_t view;
+        size_t len = test_value(buf, i, 1);
+        bool found = bptree_sharded_get_view(store, i, &view);
+        if (found != (i % 3 != 0) || (found && (view.len != len || memcmp(view.data, buf, len) != 0)))
+            printf("ERROR: %s store returned %d for %d\n", name, found, i);
+    }
+
+    // all keys in batches, in descending order
+    size_t num_found = 0;
+    for (int from = 0; from < n; from += 256)
+    {
+        int m = n - from < 256 ? n - from : 256;
+        bp_key_t keys[256];
+        value_t values[256];
+        bool found[256];
+        for (int j = 0; j < m; j++)
+            keys[j] = n - 1 - from - j;
+        num_found += bptree_sharded_get_batch(store, keys, m, values, found);
+        for (int j = 0; j < m; j++)
+        {
+            value_view_t view;
+            size_t len = test_value(buf, keys[j], 1);
+            if (found[j])
+                value_store_view(values[j], &view);
+            if (found[j] != (keys[j] % 3 != 0) || (found[j] && (view.len != len || memcmp(view.data, buf, len) != 0)))
+                printf("ERROR: batch of gets of %s store returned %d for %ld\n", name, found[j], (long)keys[j]);
+        }
+    }
+    if (num_found != (size_t)(n - (n + 2) / 3))
+        printf("ERROR: batch of gets of %s store found %zu keys\n", name, num_found);
+    bptree_sharded_read_end(store);
+
+    scan_state_t state = {0, 0};
+    size_t count = bptree_sharded_scan(store, 0, KEY_T_MAX, ordered ? scan_count : scan_any, &state);
+    if (count != (size_t)(n - (n + 2) / 3))
+        printf("ERROR: scan of %s store returned %zu entries\n", name, count);
+}
+
+// writes to sharded stores while hot ranges move between shards
+void check_sharded(bptree_simd_t simd, bptree_write_mode_t mode, int tests)
+{
+    int n = tests < 20000 ? tests : 20000;
+    int num_threads = 4;
+    for (int hashed = 0; hashed < 2; hashed++)
+    {
+        bptree_sharded_t store;
+        bptree_sharded_init(&store, 4, hashed ? BPTREE_SHARD_HASH : BPTREE_SHARD_RANGE, true, simd, mode);
+
+        // all keys fall into one shard of the even split
+        char buf[5000];
+        for (int i = 0; i < n; i++)
+            bptree_sharded_put(&store, i, buf, test_value(buf, i, 0));
+        if (bptree_sharded_rebalance(&store) == hashed)
+            printf("ERROR: rebalance of %s store moved %d ranges\n", hashed ? "hashed" : "ranged", !hashed);
+
+        pthread_t threads[num_threads];
+        sharded_args_t args[num_threads];
+        for (int t = 0; t < num_threads; t++)
+        {
+            args[t] = (sharded_args_t){&store, n, t, num_threads};
+            pthread_create(threads + t, NULL, sharded_write, args + t);
+        }
+        for (int round = 0; round < 20; round++)
+        {
+            bptree_sharded_rebalance(&store);
+            for (int i = 0; i < n; i += 7)
+            {
+                value_t value;
+                bool found = bptree_sharded_get(&store, i, &value);
+                if (!found && i % 3 != 0)
+                    printf("ERROR: %d is missing during a rebalance\n", i);
+            }
+
+            // the same keys as one batch, in descending order
+            bp_key_t keys[n / 7 + 1];
+            value_t values[n / 7 + 1];
+            bool found[n / 7 + 1];
+            int m = 0;
+            for (int i = (n - 1) / 7 * 7; i >= 0; i -= 7)
+                keys[m++] = i;
+            bptree_sharded_get_batch(&store, keys, m, values, found);
+            for (int j = 0; j < m; j++)
+                if (!found[j] && keys[j] % 3 != 0)
+                    printf("ERROR: %ld is missing from a batch during a rebalance\n", (long)keys[j]);
+        }
+        for (int t = 0; t < num_threads; t++)
+            pthread_join(threads[t], NULL);
+        check_sharded_keys(&store, n, !hashed, hashed ? "hashed" : "ranged");
+        bptree_sharded_free(&store);
+    }
+
+    // bulk load with ranges at the quantiles of the keys
+    bptree_sharded_t store;
+    bptree_sharded_init(&store, 8, BPTREE_SHARD_RANGE, false, simd, mode);
+    bp_key_t *keys = malloc(n * sizeof(bp_key_t));
+    value_t *values = malloc(n * sizeof(value_t));
+    for (int i = 0; i < n; i++)
+        keys[i] = i;
+    bptree_sharded_split(&store, keys, n);
+    char buf[5000];
+    for (int i = 0; i < n; i++)
+        values[i] = bptree_sharded_value_create(&store, i, buf, test_value(buf, i, 1));
+    bptree_sharded_bulk_load(&store, keys, values, n, 1.0, 2);
+    for (int i = 0; i < n; i += 3)
+        bptree_sharded_delete(&store, i);
+    for (int i = 0; i < 8; i++)
+        if (store.shards[i].tree.root == NULL)
+            printf("ERROR: shard %d of the bulk load is empty\n", i);
+    check_sharded_keys(&store, n, true, "bulk loaded");
+    bptree_sharded_free(&store);
+    free(keys);
+    free(values);
+}
+
+void check_key_widths(int tests)
+{
+    bptree16_t tree16;
+    bptree32_t tree32;
+    bptree16_init(&tree16, BPTREE_SIMD_BEST, BPTREE_IN_PLACE);
+    bptree32_init(&tree32, BPTREE_SIMD_BEST, BPTREE_COPY_ON_WRITE);
+
+    int n = tests < 30000 ? tests : 30000;
+    for (int i = 0; i < n; i++)
+    {
+        int32_t key = (i % 2 ? -1 : 1) * i * 1000;
+        bptree16_insert(&tree16, (int16_t)(i - n / 2), i);
+        bptree32_insert(&tree32, key, i);
+    }
+    for (int i = 0; i < n; i += 3)
+    {
+        bptree16_delete(&tree16, (int16_t)(i - n / 2));
+        bptree32_delete(&tree32, (i % 2 ? -1 : 1) * i * 1000);
+    }
+
+    for (int i = 0; i < n; i++)
+    {
+        value_t v16, v32;
+        bool found16 = bptree16_get(&tree16, (int16_t)(i - n / 2), &v16);
+        bool found32 = bptree32_get(&tree32, (i % 2 ? -1 : 1) * i * 1000, &v32);
+        if (found16 != (i % 3 != 0) || (found16 && v16 != (value_t)i))
+            printf("ERROR: 16 bit tree returned %d for %d\n", found16, i - n / 2);
+        if (found32 != (i % 3 != 0) || (found32 && v32 != (value_t)i))
+            printf("ERROR: 32 bit tree returned %d for %d\n", found32, i);
+    }
+
+    size_t count16 = 0, count32 = 0;
+    bptree16_scan(&tree16, INT16_MIN, INT16_MAX - 1, scan_count16, &count16);
+    bptree32_scan(&tree32, INT32_MIN, INT32_MAX - 1, scan_count32, &count32);
+    size_t expected = n - (n + 2) / 3;
+    if (count16 != expected || count32 != expected)
+        printf("ERROR: scans of the 16/32 bit trees returned %zu/%zu entries instead of %zu\n", count16, count32, expected);
+
+    bptree16_free(&tree16);
+    bptree32_free(&tree32);
+}
+
+// writes the i-th key of check_string_keys to buf. Long keys share
+// their first 8 bytes, so they are only ordered by their full key.
+static int string_key(char *buf, int i)
+{
+    if (i % 2)
+        return sprintf(buf, "%x", i);
+    return sprintf(buf, "https://example.com/item/%d", i);
+}
+
+typedef struct string_scan_t
+{
+    char last[64];
+    int last_len;
+    size_t count;
+} string_scan_t;
+
+// checks that a scan returns the keys in ascending order
+static bool scan_strings(const char *key, size_t len, value_t value, void *ctx)
+{
+    string_scan_t *state = (string_scan_t *)ctx;
+    char buf[64];
+    int n = string_key(buf, value);
+    if ((size_t)n != len || memcmp(buf, key, len) != 0)
+        printf("ERROR: scan returned value %ld for key %.*s\n", value, (int)len, key);
+    int c = memcmp(state->last, key, len < state->last_len ? len : state->last_len);
+    if (state->count > 0 && (c > 0 || (c == 0 && (int)len <= state->last_len)))
+        printf("ERROR: scan returned %.*s after %.*s\n", (int)len, key, state->last_len, state->last);
+    memcpy(state->last, key, len);
+    state->last_len = len;
+    state->count++;
+    return true;
+}
+
+// string keys: inserts, deletes every third key, checks gets and scans
+// and deletes all keys
+void check_string_keys(int tests, bptree_simd_t simd)
+{
+    bptree_str_t tree;
+    bptree_str_init(&tree, simd);
+    char buf[64];
+
+    int n = tests < 30000 ? tests : 30000;
+    for (int i = 0; i < n; i++)
+        bptree_str_insert(&tree, buf, string_key(buf, i), i);
+    for (int i = 0; i < n; i += 3)
+        if (!bptree_str_delete(&tree, buf, string_key(buf, i)))
+            printf("ERROR: string key %d was not deleted\n", i);
+
+    for (int i = 0; i < n; i++)
+    {
+        value_t v;
+        bool found = bptree_str_get(&tree, buf, string_key(buf, i), &v);
+        if (found != (i % 3 != 0) || (found && v != (value_t)i))
+            printf("ERROR: string tree returned %d for %s\n", found, buf);
     }
+    // prefixes of stored keys are not found
+    value_t v;
+    if (bptree_str_get(&tree, "https://example.com/item/", 25, &v))
+        printf("ERROR: string tree found a prefix of a key\n");
+
+    string_scan_t state = {"", 0, 0};
+    size_t count = bptree_str_scan(&tree, "", 0, "\xff", 1, scan_strings, &state);
+    size_t expected = n - (n + 2) / 3;
+    if (count != expected || state.count != expected)
+        printf("ERROR: scan of the string tree returned %zu entries instead of %zu\n", count, expected);
+
+    for (int i = 0; i < n; i++)
+        bptree_str_delete(&tree, buf, string_key(buf, i));
+    if (tree.root != NULL)
+        printf("ERROR: string tree is not empty\n");
 
+    bptree_str_free(&tree);
+}
+
+// concurrent inserts and gets followed by the checks above
+void run_tests(int tests, bptree_simd_t simd, bptree_write_mode_t mode)
+{
     bptree_t *tree = malloc(sizeof(bptree_t));
-    bptree_init(tree, use_avx2);
+    bptree_init(tree, simd, mode);
 
     float insert_ratio = 0.05;
 
@@ -100,9 +1558,64 @@ int main(int argc, char *argv[])
     for (int t = 0; t < num_threads; t++)
         pthread_join(threads[t], NULL);
 
-    printf("done!\n");
+    check_inserted(tree, args_insert->tests);
+    check_get_batch(tree, args_insert->tests);
+    check_delete(tree, args_insert->tests);
+    check_scan(tree, args_insert->tests);
+    check_bulk_load(simd, mode, args_insert->tests);
+    check_values(simd, mode, args_insert->tests);
+    check_snapshot(simd, mode, args_insert->tests);
+    check_wal(simd, mode, args_insert->tests);
+    check_checkpoint(simd, mode, args_insert->tests);
+    check_read_snapshot(simd, mode, args_insert->tests);
+    check_insert_batch(simd, mode, args_insert->tests);
+    check_buffered(simd, mode, args_insert->tests);
+    check_append(simd, mode, args_insert->tests);
+    check_full_leaf(simd, mode);
+    check_epoch_records(simd, mode, args_insert->tests);
+    check_pool_caches(simd, mode, args_insert->tests);
+    check_combining(simd, mode, args_insert->tests);
+    check_update(simd, mode, args_insert->tests);
+    check_sharded(simd, mode, args_insert->tests);
+
     bptree_free(tree);
     free(args_get);
     free(args_insert);
     free(tree);
+}
+
+int main(int argc, char *argv[])
+{
+    int tests = 1000;
+    bptree_simd_t simd = BPTREE_SIMD_NONE;
+    switch (argc)
+    {
+    case 3:
+        simd = atoi(argv[2]);
+        if (simd < BPTREE_SIMD_NONE || simd > BPTREE_SIMD_BEST)
+        {
+            printf("cannot convert '%s' to node search (0 to 3)\n", argv[2]);
+            exit(1);
+        }
+        printf("node search %d (resolved to %d)\n", simd, bptree_simd_resolve(simd));
+    case 2:
+        tests = atoi(argv[1]);
+        if (tests == 0)
+        {
+            printf("cannot convert '%s' to integer\n", argv[1]);
+            exit(1);
+        }
+    }
+
+    check_find_index(tests);
+    check_key_widths(tests);
+    check_string_keys(tests, simd);
+    printf("copy-on-write leaves\n");
+    run_tests(tests, simd, BPTREE_COPY_ON_WRITE);
+    printf("in place leaves\n");
+    run_tests(tests, simd, BPTREE_IN_PLACE);
+    printf("buffered inserts\n");
+    run_tests(tests, simd, BPTREE_BUFFERED);
+
+    printf("done!\n");
 }
\ No newline at end of file